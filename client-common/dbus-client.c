@@ -19,6 +19,7 @@
 
 
 #include <stdio.h>
+#include <string.h>
 
 #include <dbus/dbus.h>
 
@@ -28,9 +29,51 @@
 static DBusError *err;
 static DBusConnection *conn;
 
+static const struct mbp_dbus_handlers *handlers;
+static void *handlers_data;
+
 
 /* Method calls */
 /* WARNING: method calls are synchronous for now with a 250ms timeout */
+int
+mbp_call_get_state(DBusPendingCallNotifyFunction cb, void *userdata)
+{
+  DBusMessage *msg;
+  DBusPendingCall *pending;
+
+  int ret;
+
+  msg = dbus_message_new_method_call("org.pommed", "/org/pommed",
+				     "org.pommed", "getState");
+
+  if (msg == NULL)
+    {
+      printf("Failed to create method call message\n");
+
+      return -1;
+    }
+
+  ret = dbus_connection_send_with_reply(conn, msg, &pending, 250);
+  if (ret == FALSE)
+    {
+      printf("Could not send method call\n");
+
+      dbus_message_unref(msg);
+
+      return -1;
+    }
+
+  dbus_connection_flush(conn);
+
+  dbus_message_unref(msg);
+
+  dbus_pending_call_block(pending);
+
+  cb(pending, userdata);
+
+  return 0;
+}
+
 int
 mbp_call_lcd_getlevel(DBusPendingCallNotifyFunction cb, void *userdata)
 {
@@ -313,17 +356,262 @@ mbp_dbus_check_error(DBusMessage *msg)
 }
 
 
+/* Signal dispatch */
+
+#define MBP_DBUS_SIGNAL_IFACE  "org.pommed.signal."
+#define MBP_DBUS_SIGNAL_PATH   "/org/pommed/notify"
+
+static void
+signal_lcd_backlight(DBusMessage *msg)
+{
+  int cur, prev, max, who;
+
+  if (dbus_message_get_args(msg, NULL,
+			    DBUS_TYPE_UINT32, &cur,
+			    DBUS_TYPE_UINT32, &prev,
+			    DBUS_TYPE_UINT32, &max,
+			    DBUS_TYPE_UINT32, &who,
+			    DBUS_TYPE_INVALID))
+    handlers->lcd_backlight(cur, prev, max, who, handlers_data);
+}
+
+static void
+signal_kbd_backlight(DBusMessage *msg)
+{
+  int cur, prev, max, who;
+
+  if (dbus_message_get_args(msg, NULL,
+			    DBUS_TYPE_UINT32, &cur,
+			    DBUS_TYPE_UINT32, &prev,
+			    DBUS_TYPE_UINT32, &max,
+			    DBUS_TYPE_UINT32, &who,
+			    DBUS_TYPE_INVALID))
+    handlers->kbd_backlight(cur, prev, max, who, handlers_data);
+}
+
+static void
+signal_ambient_light(DBusMessage *msg)
+{
+  int l, l_prev, r, r_prev, max;
+
+  if (dbus_message_get_args(msg, NULL,
+			    DBUS_TYPE_UINT32, &l,
+			    DBUS_TYPE_UINT32, &l_prev,
+			    DBUS_TYPE_UINT32, &r,
+			    DBUS_TYPE_UINT32, &r_prev,
+			    DBUS_TYPE_UINT32, &max,
+			    DBUS_TYPE_INVALID))
+    handlers->ambient_light(l, l_prev, r, r_prev, max, handlers_data);
+}
+
+static void
+signal_audio_volume(DBusMessage *msg)
+{
+  int cur, prev, max;
+
+  if (dbus_message_get_args(msg, NULL,
+			    DBUS_TYPE_UINT32, &cur,
+			    DBUS_TYPE_UINT32, &prev,
+			    DBUS_TYPE_UINT32, &max,
+			    DBUS_TYPE_INVALID))
+    handlers->audio_volume(cur, prev, max, handlers_data);
+}
+
+static void
+signal_audio_mute(DBusMessage *msg)
+{
+  int mute;
+
+  if (dbus_message_get_args(msg, NULL,
+			    DBUS_TYPE_BOOLEAN, &mute,
+			    DBUS_TYPE_INVALID))
+    handlers->audio_mute(mute, handlers_data);
+}
+
+static void
+signal_cd_eject(DBusMessage *msg)
+{
+  handlers->cd_eject(handlers_data);
+}
+
+static void
+signal_video_switch(DBusMessage *msg)
+{
+  handlers->video_switch(handlers_data);
+}
+
+/* Whether the client has a handler for the signal */
+#define SIGNAL_WANTED(cb)				\
+  static int						\
+  wanted_##cb(void)					\
+  {							\
+    return (handlers->cb != NULL);			\
+  }
+
+SIGNAL_WANTED(lcd_backlight)
+SIGNAL_WANTED(kbd_backlight)
+SIGNAL_WANTED(ambient_light)
+SIGNAL_WANTED(audio_volume)
+SIGNAL_WANTED(audio_mute)
+SIGNAL_WANTED(cd_eject)
+SIGNAL_WANTED(video_switch)
+
+/* Signal name, also the last component of its path and interface */
+static const struct
+{
+  const char *name;
+  int (*wanted)(void);
+  void (*dispatch)(DBusMessage *msg);
+} signals[] =
+  {
+    { "lcdBacklight", wanted_lcd_backlight, signal_lcd_backlight },
+    { "kbdBacklight", wanted_kbd_backlight, signal_kbd_backlight },
+    { "ambientLight", wanted_ambient_light, signal_ambient_light },
+    { "audioVolume", wanted_audio_volume, signal_audio_volume },
+    { "audioMute", wanted_audio_mute, signal_audio_mute },
+    { "cdEject", wanted_cd_eject, signal_cd_eject },
+    { "videoSwitch", wanted_video_switch, signal_video_switch },
+  };
+
+#define N_SIGNALS  (sizeof(signals) / sizeof(*signals))
+
+static int
+signal_wanted(int i)
+{
+  return signals[i].wanted();
+}
+
+static DBusHandlerResult
+mbp_dbus_filter(DBusConnection *lconn, DBusMessage *msg, void *data)
+{
+  const char *iface;
+  const char *member;
+  int i;
+
+  if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      if (handlers->disconnected == NULL)
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      handlers->disconnected(handlers_data);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  iface = dbus_message_get_interface(msg);
+  member = dbus_message_get_member(msg);
+
+  if ((iface == NULL) || (member == NULL))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (strncmp(iface, MBP_DBUS_SIGNAL_IFACE, strlen(MBP_DBUS_SIGNAL_IFACE)) != 0)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  iface += strlen(MBP_DBUS_SIGNAL_IFACE);
+
+  for (i = 0; i < N_SIGNALS; i++)
+    {
+      if ((strcmp(member, signals[i].name) != 0)
+	  || (strcmp(iface, signals[i].name) != 0))
+	continue;
+
+      if (signal_wanted(i))
+	signals[i].dispatch(msg);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+
 /* Connection init and cleanup */
 
+/* Match rules are added without waiting for the bus: one rule covering
+ * all the signals, or one rule per signal for buses without
+ * path_namespace support (dbus < 1.5), where AddMatch fails.
+ */
+static void
+bus_add_match_fallback(void)
+{
+  char match[256];
+  int i;
+
+  printf("Bus does not support path_namespace, adding one match per signal\n");
+
+  for (i = 0; i < N_SIGNALS; i++)
+    {
+      if (!signal_wanted(i))
+	continue;
+
+      snprintf(match, sizeof(match),
+	       "type='signal',sender='org.pommed',path='" MBP_DBUS_SIGNAL_PATH "/%s',interface='" MBP_DBUS_SIGNAL_IFACE "%s'",
+	       signals[i].name, signals[i].name);
+
+      /* No error: doesn't block */
+      dbus_bus_add_match(conn, match, NULL);
+    }
+}
+
+static void
+bus_add_match_cb(DBusPendingCall *pending, void *data)
+{
+  DBusMessage *msg;
+
+  msg = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+
+  if (msg == NULL)
+    return;
+
+  if ((dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR)
+      && (conn != NULL))
+    bus_add_match_fallback();
+
+  dbus_message_unref(msg);
+}
+
 static int
-bus_add_match(DBusConnection *conn, char *match)
+bus_add_match(void)
 {
-  dbus_bus_add_match(conn, match, err);
-  dbus_connection_flush(conn);
+  DBusMessage *msg;
+  DBusPendingCall *pending;
+  const char *match = "type='signal',sender='org.pommed',path_namespace='" MBP_DBUS_SIGNAL_PATH "'";
 
-  if (dbus_error_is_set(err))
+  int ret;
+
+  msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+				     DBUS_INTERFACE_DBUS, "AddMatch");
+  if (msg == NULL)
+    {
+      printf("Failed to create AddMatch message\n");
+
+      return -1;
+    }
+
+  ret = dbus_message_append_args(msg,
+				 DBUS_TYPE_STRING, &match,
+				 DBUS_TYPE_INVALID);
+  if (ret == TRUE)
+    ret = dbus_connection_send_with_reply(conn, msg, &pending, DBUS_TIMEOUT_USE_DEFAULT);
+
+  dbus_message_unref(msg);
+
+  if ((ret == FALSE) || (pending == NULL))
+    {
+      printf("Could not send AddMatch\n");
+
+      return -1;
+    }
+
+  ret = dbus_pending_call_set_notify(pending, bus_add_match_cb, NULL, NULL);
+  if (ret == FALSE)
     {
-      printf("Match error: %s\n", err->message);
+      dbus_pending_call_cancel(pending);
+      dbus_pending_call_unref(pending);
 
       return -1;
     }
@@ -337,6 +625,8 @@ mbp_dbus_cleanup(void)
 {
   if (conn != NULL)
     {
+      dbus_connection_remove_filter(conn, mbp_dbus_filter, NULL);
+
       dbus_error_free(err);
       dbus_connection_unref(conn);
 
@@ -346,10 +636,15 @@ mbp_dbus_cleanup(void)
 
 
 DBusConnection *
-mbp_dbus_init(DBusError *error, unsigned int signals)
+mbp_dbus_init(DBusError *error, const struct mbp_dbus_handlers *h, void *userdata)
 {
+  int i;
+
   err = error;
 
+  handlers = h;
+  handlers_data = userdata;
+
   dbus_error_init(err);
 
   conn = dbus_bus_get(DBUS_BUS_SYSTEM, err);
@@ -366,50 +661,19 @@ mbp_dbus_init(DBusError *error, unsigned int signals)
 
   dbus_connection_set_exit_on_disconnect(conn, FALSE);
 
-  if ((signals & MBP_DBUS_SIG_LCD)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/lcdBacklight',interface='org.pommed.signal.lcdBacklight'") < 0))
+  if (!dbus_connection_add_filter(conn, mbp_dbus_filter, NULL, NULL))
     {
       mbp_dbus_cleanup();
       return NULL;
     }
 
-  if ((signals & MBP_DBUS_SIG_KBD)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/kbdBacklight',interface='org.pommed.signal.kbdBacklight'") < 0))
+  for (i = 0; i < N_SIGNALS; i++)
     {
-      mbp_dbus_cleanup();
-      return NULL;
-    }
-
-  if ((signals & MBP_DBUS_SIG_VOL)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/audioVolume',interface='org.pommed.signal.audioVolume'") < 0))
-    {
-      mbp_dbus_cleanup();
-      return NULL;
-    }
-
-  if ((signals & MBP_DBUS_SIG_MUTE)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/audioMute',interface='org.pommed.signal.audioMute'") < 0))
-    {
-      mbp_dbus_cleanup();
-      return NULL;
-    }
-
-  if ((signals & MBP_DBUS_SIG_LIGHT)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/ambientLight',interface='org.pommed.signal.ambientLight'") < 0))
-    {
-      mbp_dbus_cleanup();
-      return NULL;
-    }
-
-  if ((signals & MBP_DBUS_SIG_EJECT)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/cdEject',interface='org.pommed.signal.cdEject'") < 0))
-    {
-      mbp_dbus_cleanup();
-      return NULL;
+      if (signal_wanted(i))
+	break;
     }
 
-  if ((signals & MBP_DBUS_SIG_VIDEO)
-      && (bus_add_match(conn, "type='signal',path='/org/pommed/notify/videoSwitch',interface='org.pommed.signal.videoSwitch'") < 0))
+  if ((i < N_SIGNALS) && (bus_add_match() < 0))
     {
       mbp_dbus_cleanup();
       return NULL;
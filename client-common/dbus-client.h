@@ -4,15 +4,22 @@
 #ifndef __MBP_DBUS_CLIENT_H__
 #define __MBP_DBUS_CLIENT_H__
 
-/* Signals to listen to */
-#define MBP_DBUS_SIG_NONE   0
-#define MBP_DBUS_SIG_LCD    (1 << 0)
-#define MBP_DBUS_SIG_KBD    (1 << 1)
-#define MBP_DBUS_SIG_VOL    (1 << 2)
-#define MBP_DBUS_SIG_MUTE   (1 << 3)
-#define MBP_DBUS_SIG_EJECT  (1 << 4)
-#define MBP_DBUS_SIG_LIGHT  (1 << 5)
-#define MBP_DBUS_SIG_VIDEO  (1 << 6)
+/* Signal handlers; leave NULL the signals you don't want.
+ * Levels are cur, prev, max; who is LCD_* or KBD_*.
+ */
+struct mbp_dbus_handlers
+{
+  void (*lcd_backlight)(int cur, int prev, int max, int who, void *userdata);
+  void (*kbd_backlight)(int cur, int prev, int max, int who, void *userdata);
+  void (*ambient_light)(int l, int l_prev, int r, int r_prev, int max, void *userdata);
+  void (*audio_volume)(int cur, int prev, int max, void *userdata);
+  void (*audio_mute)(int mute, void *userdata);
+  void (*cd_eject)(void *userdata);
+  void (*video_switch)(void *userdata);
+
+  /* Connection lost; call mbp_dbus_cleanup() and reconnect later */
+  void (*disconnected)(void *userdata);
+};
 
 
 #define LCD_USER      0
@@ -23,6 +30,13 @@
 
 
 /* Method calls */
+/* getState reply: lcd level, lcd max, kbd level, kbd max,
+ * ambient left, ambient right, ambient max, volume, volume max (UINT32)
+ * and mute (BOOLEAN)
+ */
+int
+mbp_call_get_state(DBusPendingCallNotifyFunction cb, void *userdata);
+
 int
 mbp_call_lcd_getlevel(DBusPendingCallNotifyFunction cb, void *userdata);
 
@@ -48,8 +62,11 @@ mbp_dbus_check_error(DBusMessage *msg);
 
 
 /* Connection init and cleanup */
+/* The handlers are called from a filter on the connection, when
+ * messages are dispatched; handlers must stay valid until cleanup.
+ */
 DBusConnection *
-mbp_dbus_init(DBusError *error, unsigned int signals);
+mbp_dbus_init(DBusError *error, const struct mbp_dbus_handlers *handlers, void *userdata);
 
 void
 mbp_dbus_cleanup(void);
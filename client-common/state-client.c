@@ -0,0 +1,165 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+
+#include <linux/futex.h>
+
+#include "state-client.h"
+
+
+/* Reader side of pommed's state page (see pommed/state.c) */
+
+/* An update takes a few hundred ns; past this many tries, the writer
+ * died in the middle of one, or is stuck
+ */
+#define STATE_READ_RETRIES   10000
+
+static struct pommed_state *st;
+
+
+int
+mbp_state_init(void)
+{
+  struct stat stbuf;
+  int fd;
+  int ret;
+
+  mbp_state_cleanup();
+
+  fd = open(STATE_FILE, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  ret = fstat(fd, &stbuf);
+  if ((ret < 0) || (stbuf.st_size < sizeof(struct pommed_state)))
+    {
+      close(fd);
+
+      return -1;
+    }
+
+  st = mmap(NULL, sizeof(struct pommed_state), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (st == MAP_FAILED)
+    {
+      st = NULL;
+
+      return -1;
+    }
+
+  if ((st->magic != STATE_MAGIC) || (st->version != STATE_VERSION))
+    {
+      printf("Unknown pommed state page version\n");
+
+      mbp_state_cleanup();
+
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+mbp_state_cleanup(void)
+{
+  if (st != NULL)
+    munmap(st, sizeof(struct pommed_state));
+
+  st = NULL;
+}
+
+
+int64_t
+mbp_state_read(struct pommed_state *state)
+{
+  uint32_t seq;
+  int i;
+
+  if (st == NULL)
+    return -1;
+
+  for (i = 0; i < STATE_READ_RETRIES; i++)
+    {
+      seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+
+      /* Update in progress, let the writer finish */
+      if (seq & 1)
+	{
+	  sched_yield();
+	  continue;
+	}
+
+      memcpy(state, (void *)st, sizeof(struct pommed_state));
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) == seq)
+	break;
+    }
+
+  if (i == STATE_READ_RETRIES)
+    return -1;
+
+  if (!state->alive)
+    return -1;
+
+  return seq;
+}
+
+int
+mbp_state_wait(int64_t seq, int timeout)
+{
+  struct timespec ts;
+  int ret;
+
+  if (st == NULL)
+    return -1;
+
+  if (timeout >= 0)
+    {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+    }
+
+  /* Returns at once (EAGAIN) if seq already moved on */
+  ret = syscall(SYS_futex, &st->seq, FUTEX_WAIT, (uint32_t)seq,
+		(timeout >= 0) ? &ts : NULL, NULL, 0);
+
+  if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR))
+    return -1;
+
+  if (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) == (uint32_t)seq)
+    return -1;
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * pommed - state-client.h
+ */
+#ifndef __MBP_STATE_CLIENT_H__
+#define __MBP_STATE_CLIENT_H__
+
+#include "../pommed/state.h"
+
+
+int
+mbp_state_init(void);
+
+void
+mbp_state_cleanup(void);
+
+/* Consistent snapshot of the state page; returns the sequence
+ * number to pass to mbp_state_wait(), -1 if pommed is gone or
+ * died halfway through an update (call mbp_state_init() again).
+ */
+int64_t
+mbp_state_read(struct pommed_state *state);
+
+/* Sleep until the state changes from seq; timeout in ms, -1 for none.
+ * Returns 0 on change, -1 on timeout or error.
+ */
+int
+mbp_state_wait(int64_t seq, int timeout);
+
+
+#endif /* !__MBP_STATE_CLIENT_H__ */
@@ -339,135 +339,127 @@ mbp_video_getvtstate_cb(DBusPendingCall *pending, void *status)
 static gboolean
 mbp_dbus_reconnect(gpointer userdata);
 
-static DBusHandlerResult
-mbp_dbus_listen(DBusConnection *lconn, DBusMessage *msg, gpointer userdata)
+static void
+mbp_lcd_backlight(int cur, int prev, int max, int who, void *userdata)
 {
-  int scratch;
-  int cur;
-  int max;
-  int who;
   double ratio;
 
-  Display *dpy;
+  if (who != LCD_USER)
+    return;
 
-  if (dbus_message_is_signal(msg, "org.pommed.signal.lcdBacklight", "lcdBacklight"))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &cur,
-			    DBUS_TYPE_UINT32, &scratch, /* previous */
-			    DBUS_TYPE_UINT32, &max,
-			    DBUS_TYPE_UINT32, &who,
-			    DBUS_TYPE_INVALID);
+  ratio = (double)cur / (double)max;
 
-      if (who == LCD_USER)
-	{
-	  ratio = (double)cur / (double)max;
+  show_window(IMG_LCD_BCK, _("LCD backlight level"), ratio);
+}
 
-	  show_window(IMG_LCD_BCK, _("LCD backlight level"), ratio);
-	}
-    }
-  else if (dbus_message_is_signal(msg, "org.pommed.signal.kbdBacklight", "kbdBacklight"))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &cur,
-			    DBUS_TYPE_UINT32, &scratch, /* previous */
-			    DBUS_TYPE_UINT32, &max,
-			    DBUS_TYPE_UINT32, &who,
-			    DBUS_TYPE_INVALID);
+static void
+mbp_kbd_backlight(int cur, int prev, int max, int who, void *userdata)
+{
+  double ratio;
 
-      if (who == KBD_USER)
-	{
-	  ratio = (double)cur / (double)max;
+  if (who != KBD_USER)
+    return;
 
-	  show_window(IMG_KBD_BCK, _("Keyboard backlight level"), ratio);
-	}
-    }
-  else if (dbus_message_is_signal(msg, "org.pommed.signal.audioVolume", "audioVolume"))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &cur,
-			    DBUS_TYPE_UINT32, &scratch, /* previous */
-			    DBUS_TYPE_UINT32, &max,
-			    DBUS_TYPE_INVALID);
+  ratio = (double)cur / (double)max;
 
-      ratio = (double)cur / (double)max;
+  show_window(IMG_KBD_BCK, _("Keyboard backlight level"), ratio);
+}
 
-      if (!mbp.muted)
-	show_window(IMG_AUDIO_VOL_ON, _("Sound volume"), ratio);
-      else
-	show_window(IMG_AUDIO_VOL_OFF, _("Sound volume (muted)"), ratio);
-    }
-  else if (dbus_message_is_signal(msg, "org.pommed.signal.audioMute", "audioMute"))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_BOOLEAN, &mbp.muted,
-			    DBUS_TYPE_INVALID);
+static void
+mbp_audio_volume(int cur, int prev, int max, void *userdata)
+{
+  double ratio;
 
-      if (mbp.muted)
-	show_window(IMG_AUDIO_MUTE, _("Sound muted"), -1.0);
-      else
-	show_window(IMG_AUDIO_MUTE, _("Sound unmuted"), -1.0);
-    }
-  else if (dbus_message_is_signal(msg, "org.pommed.signal.cdEject", "cdEject"))
-    {
-      show_window(IMG_CD_EJECT, _("Eject"), -1.0);
-    }
-  else if (dbus_message_is_signal(msg, "org.pommed.signal.videoSwitch", "videoSwitch"))
-    {
-      int vtnum;
-      int vtstate;
-      int ret;
+  ratio = (double)cur / (double)max;
 
-      dpy = GDK_WINDOW_XDISPLAY(GTK_WIDGET(mbp_w.window)->window);
+  if (!mbp.muted)
+    show_window(IMG_AUDIO_VOL_ON, _("Sound volume"), ratio);
+  else
+    show_window(IMG_AUDIO_VOL_OFF, _("Sound volume (muted)"), ratio);
+}
 
-      vtnum = mbp_get_x_vtnum(dpy);
+static void
+mbp_audio_mute(int mute, void *userdata)
+{
+  mbp.muted = mute;
 
-      ret = mbp_call_video_getvtstate(vtnum, mbp_video_getvtstate_cb, &vtstate);
-      if ((ret < 0) || (vtstate < 0))
-	fprintf(stderr, "video getVTState call failed !\n");
-      else if (vtstate == 1)
-	mbp_video_switch();
-    }
-  else if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
-    {
-      printf("DBus disconnected\n");
+  if (mbp.muted)
+    show_window(IMG_AUDIO_MUTE, _("Sound muted"), -1.0);
+  else
+    show_window(IMG_AUDIO_MUTE, _("Sound unmuted"), -1.0);
+}
 
-      mbp_dbus_cleanup();
+static void
+mbp_cd_eject(void *userdata)
+{
+  show_window(IMG_CD_EJECT, _("Eject"), -1.0);
+}
 
-      g_timeout_add(200, mbp_dbus_reconnect, NULL);
-    }
-  else
+static void
+mbp_video_switch_signal(void *userdata)
+{
+  Display *dpy;
+  int vtnum;
+  int vtstate;
+  int ret;
+
+  dpy = GDK_WINDOW_XDISPLAY(GTK_WIDGET(mbp_w.window)->window);
+
+  vtnum = mbp_get_x_vtnum(dpy);
+
+  ret = mbp_call_video_getvtstate(vtnum, mbp_video_getvtstate_cb, &vtstate);
+  if ((ret < 0) || (vtstate < 0))
+    fprintf(stderr, "video getVTState call failed !\n");
+  else if (vtstate == 1)
+    mbp_video_switch();
+}
+
+static void
+mbp_dbus_disconnected(void *userdata)
+{
+  printf("DBus disconnected\n");
+
+  mbp_dbus_cleanup();
+
+  g_timeout_add(200, mbp_dbus_reconnect, NULL);
+}
+
+static const struct mbp_dbus_handlers mbp_dbus_handlers =
+  {
+    .lcd_backlight = mbp_lcd_backlight,
+    .kbd_backlight = mbp_kbd_backlight,
+    .audio_volume = mbp_audio_volume,
+    .audio_mute = mbp_audio_mute,
+    .cd_eject = mbp_cd_eject,
+    .video_switch = mbp_video_switch_signal,
+    .disconnected = mbp_dbus_disconnected,
+  };
+
+/* Signals are handled by dbus-client, only the getMute reply here */
+static DBusHandlerResult
+mbp_dbus_listen(DBusConnection *lconn, DBusMessage *msg, gpointer userdata)
+{
+  if ((dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+      && (dbus_message_get_reply_serial(msg) == mute_serial))
     {
-      if ((dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
-	  && (dbus_message_get_reply_serial(msg) == mute_serial))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_BOOLEAN, &mbp.muted,
-				DBUS_TYPE_INVALID);
-	}
-      else
-	{
-	  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	}
+      dbus_message_get_args(msg, &dbus_err,
+			    DBUS_TYPE_BOOLEAN, &mbp.muted,
+			    DBUS_TYPE_INVALID);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
     }
 
-  return DBUS_HANDLER_RESULT_HANDLED;
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
 static int
 mbp_dbus_connect(void)
 {
-  unsigned int signals;
-
   DBusMessage *msg;
 
   int ret;
 
-  signals = MBP_DBUS_SIG_LCD | MBP_DBUS_SIG_KBD
-    | MBP_DBUS_SIG_VOL | MBP_DBUS_SIG_MUTE
-    | MBP_DBUS_SIG_EJECT | MBP_DBUS_SIG_VIDEO;
-
-  conn = mbp_dbus_init(&dbus_err, signals);
+  conn = mbp_dbus_init(&dbus_err, &mbp_dbus_handlers, NULL);
 
   if (conn == NULL)
     return -1;
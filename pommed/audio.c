@@ -19,16 +19,25 @@
  */ 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+#include <syslog.h>
+
+#include <sys/epoll.h>
 
 #define NDEBUG
 #include <alsa/asoundlib.h>
 
 #include "pommed.h"
+#include "evloop.h"
 #include "conffile.h"
 #include "audio.h"
 #include "beep.h"
 #include "dbus.h"
+#include "fade.h"
+#include "latency.h"
 
 
 struct _audio_info audio_info;
@@ -43,6 +52,15 @@ static long vol_max;
 static long vol_step;
 static int play;
 
+/* Mixer poll descriptors registered with the event loop */
+static struct pollfd *mixer_pfds;
+static int mixer_npfds;
+
+static int
+audio_volume_write(int vol);
+
+static struct fade vol_fade = { .timer = -1, .write = audio_volume_write };
+
 
 void
 audio_step(int dir)
@@ -56,40 +74,40 @@ audio_step(int dir)
   if (vol_elem == NULL)
     return;
 
-  snd_mixer_handle_events(mixer_hdl);
-
   if (!snd_mixer_selem_is_active(vol_elem))
     return;
 
-  snd_mixer_selem_get_playback_volume(vol_elem, 0, &vol);
+  fade_cancel(&vol_fade);
+
+  /* Kept up to date by the mixer element callbacks */
+  vol = audio_info.level;
 
   logdebug("Mixer volume: %ld\n", vol);
 
-  if (dir == STEP_UP)
+  if (dir > 0)
     {
-      newvol = vol + vol_step;
+      newvol = vol + dir * vol_step;
 
       if (newvol > vol_max)
 	newvol = vol_max;
 
-      logdebug("Audio stepping +%ld -> %ld\n", vol_step, newvol);
+      logdebug("Audio stepping +%ld -> %ld\n", dir * vol_step, newvol);
     }
-  else if (dir == STEP_DOWN)
+  else if (dir < 0)
     {
-      newvol = vol - vol_step;
+      newvol = vol + dir * vol_step;
 
       if (newvol < vol_min)
 	newvol = vol_min;
 
-      logdebug("Audio stepping -%ld -> %ld\n", vol_step, newvol);
+      logdebug("Audio stepping -%ld -> %ld\n", -dir * vol_step, newvol);
     }
   else
     return;
 
-  snd_mixer_selem_set_playback_volume(vol_elem, 0, newvol);
+  audio_volume_write(newvol);
 
-  if (snd_mixer_selem_is_playback_mono(vol_elem) == 0)
-    snd_mixer_selem_set_playback_volume(vol_elem, 1, newvol);
+  latency_mark(LATENCY_VOLUME, LATENCY_WRITE);
 
   if (audio_cfg.beep)
     beep_audio();
@@ -100,6 +118,82 @@ audio_step(int dir)
 }
 
 
+static int
+audio_volume_write(int vol)
+{
+  if ((mixer_hdl == NULL) || (vol_elem == NULL))
+    return -1;
+
+  snd_mixer_selem_set_playback_volume(vol_elem, 0, vol);
+
+  if (snd_mixer_selem_is_playback_mono(vol_elem) == 0)
+    snd_mixer_selem_set_playback_volume(vol_elem, 1, vol);
+
+  return vol;
+}
+
+static void
+audio_volume_commit(int vol)
+{
+  if (audio_volume_write(vol) < 0)
+    return;
+
+  logdebug("Audio volume set to %d\n", vol);
+
+  mbpdbus_send_audio_volume(vol, audio_info.level);
+
+  audio_info.level = vol;
+}
+
+static void
+audio_fade_process(int id, uint64_t ticks)
+{
+  int ret;
+
+  ret = fade_process(&vol_fade, ticks);
+
+  if (ret > 0)
+    audio_volume_commit(vol_fade.to);
+}
+
+/* Absolute volume requested by a client, clamped to the mixer range */
+void
+audio_set_volume(int vol, int length)
+{
+  int from;
+
+  if (mixer_hdl == NULL)
+    return;
+
+  if ((vol_elem == NULL) || !snd_mixer_selem_is_active(vol_elem))
+    return;
+
+  if (vol < vol_min)
+    vol = vol_min;
+  else if (vol > vol_max)
+    vol = vol_max;
+
+  if (length > FADE_MAX_LENGTH)
+    length = FADE_MAX_LENGTH;
+
+  if (vol_fade.timer > 0)
+    from = vol_fade.cur;
+  else
+    from = audio_info.level;
+
+  fade_cancel(&vol_fade);
+
+  if ((length == 0) || (vol == from))
+    {
+      audio_volume_commit(vol);
+      return;
+    }
+
+  if (fade_start(&vol_fade, from, vol, length, audio_fade_process) < 0)
+    audio_volume_commit(vol);
+}
+
+
 static void
 audio_set_mute_elem(snd_mixer_elem_t *elem)
 {
@@ -119,8 +213,6 @@ audio_toggle_mute(void)
   if (mixer_hdl == NULL)
     return;
 
-  snd_mixer_handle_events(mixer_hdl);
-
   play = !play;
 
   if (spkr_elem != NULL)
@@ -129,12 +221,190 @@ audio_toggle_mute(void)
   if (head_elem != NULL)
     audio_set_mute_elem(head_elem);
 
+  latency_mark(LATENCY_MUTE, LATENCY_WRITE);
+
   mbpdbus_send_audio_mute(!play);
 
   audio_info.muted = !play;
 }
 
 
+static void
+audio_mixer_unwatch(void);
+
+
+/* Mixer element callbacks, called from snd_mixer_handle_events();
+ * track changes made by other applications or by the driver
+ * (headphones plugged in) and let the clients know.
+ */
+static int
+audio_vol_elem_event(snd_mixer_elem_t *elem, unsigned int mask)
+{
+  long vol;
+
+  if (mask == SND_CTL_EVENT_MASK_REMOVE)
+    {
+      logdebug("Mixer volume element removed\n");
+
+      fade_cancel(&vol_fade);
+
+      vol_elem = NULL;
+      return 0;
+    }
+
+  if (!(mask & SND_CTL_EVENT_MASK_VALUE))
+    return 0;
+
+  /* Our own fade steps; the final value is signalled on commit */
+  if (vol_fade.timer > 0)
+    return 0;
+
+  snd_mixer_selem_get_playback_volume(elem, 0, &vol);
+
+  if (vol == audio_info.level)
+    return 0;
+
+  logdebug("Mixer volume changed: %d -> %ld\n", audio_info.level, vol);
+
+  mbpdbus_send_audio_volume(vol, audio_info.level);
+
+  audio_info.level = vol;
+
+  return 0;
+}
+
+static int
+audio_mute_elem_get(snd_mixer_elem_t *elem)
+{
+  int on;
+
+  if (elem == NULL)
+    return -1;
+
+  if (!snd_mixer_selem_has_playback_switch(elem))
+    return -1;
+
+  snd_mixer_selem_get_playback_switch(elem, 0, &on);
+
+  return on;
+}
+
+static int
+audio_mute_elem_event(snd_mixer_elem_t *elem, unsigned int mask)
+{
+  int spkr;
+  int head;
+  int muted;
+
+  if (mask == SND_CTL_EVENT_MASK_REMOVE)
+    {
+      if (elem == spkr_elem)
+	spkr_elem = NULL;
+      else if (elem == head_elem)
+	head_elem = NULL;
+
+      return 0;
+    }
+
+  if (!(mask & SND_CTL_EVENT_MASK_VALUE))
+    return 0;
+
+  /* Muted if no output is switched on */
+  spkr = audio_mute_elem_get(spkr_elem);
+  head = audio_mute_elem_get(head_elem);
+
+  if ((spkr < 0) && (head < 0))
+    return 0;
+
+  muted = (spkr < 1) && (head < 1);
+
+  if (muted == audio_info.muted)
+    return 0;
+
+  logdebug("Mixer mute changed: %d -> %d\n", audio_info.muted, muted);
+
+  play = !muted;
+
+  mbpdbus_send_audio_mute(muted);
+
+  audio_info.muted = muted;
+
+  return 0;
+}
+
+static void
+audio_mixer_process(int fd, uint32_t events)
+{
+  if (events & (EPOLLERR | EPOLLHUP))
+    {
+      logmsg(LOG_WARNING, "Error condition signaled on mixer, audio events disabled");
+
+      audio_mixer_unwatch();
+
+      return;
+    }
+
+  snd_mixer_handle_events(mixer_hdl);
+}
+
+static int
+audio_mixer_watch(void)
+{
+  int ret;
+  int i;
+
+  mixer_npfds = snd_mixer_poll_descriptors_count(mixer_hdl);
+  if (mixer_npfds <= 0)
+    {
+      mixer_npfds = 0;
+      return -1;
+    }
+
+  mixer_pfds = (struct pollfd *) malloc(mixer_npfds * sizeof(struct pollfd));
+  if (mixer_pfds == NULL)
+    {
+      logmsg(LOG_ERR, "Could not allocate memory for mixer poll descriptors");
+
+      mixer_npfds = 0;
+      return -1;
+    }
+
+  mixer_npfds = snd_mixer_poll_descriptors(mixer_hdl, mixer_pfds, mixer_npfds);
+
+  for (i = 0; i < mixer_npfds; i++)
+    {
+      ret = evloop_add(mixer_pfds[i].fd, EPOLLIN, audio_mixer_process);
+      if (ret < 0)
+	{
+	  logmsg(LOG_ERR, "Could not add mixer to event loop");
+
+	  mixer_npfds = i;
+	  audio_mixer_unwatch();
+
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+static void
+audio_mixer_unwatch(void)
+{
+  int i;
+
+  /* The fds belong to ALSA, don't close them */
+  for (i = 0; i < mixer_npfds; i++)
+    evloop_remove(mixer_pfds[i].fd);
+
+  if (mixer_pfds != NULL)
+    free(mixer_pfds);
+
+  mixer_pfds = NULL;
+  mixer_npfds = 0;
+}
+
+
 int
 audio_init(void)
 {
@@ -150,6 +420,9 @@ audio_init(void)
   spkr_elem = NULL;
   head_elem = NULL;
 
+  mixer_pfds = NULL;
+  mixer_npfds = 0;
+
   if (audio_cfg.disabled)
     {
       audio_info.level = 0;
@@ -265,6 +538,18 @@ audio_init(void)
   audio_info.max = vol_max;
   audio_info.muted = !play;
 
+  /* Track external changes from now on */
+  snd_mixer_elem_set_callback(vol_elem, audio_vol_elem_event);
+
+  if (spkr_elem != NULL)
+    snd_mixer_elem_set_callback(spkr_elem, audio_mute_elem_event);
+
+  if (head_elem != NULL)
+    snd_mixer_elem_set_callback(head_elem, audio_mute_elem_event);
+
+  if (audio_mixer_watch() < 0)
+    logmsg(LOG_WARNING, "Could not watch mixer, external volume changes will be missed");
+
   return 0;
 }
 
@@ -273,6 +558,16 @@ audio_cleanup(void)
 {
   if (mixer_hdl != NULL)
     {
+      /* Jump to the end of the fade in progress */
+      if (vol_fade.timer > 0)
+	{
+	  fade_cancel(&vol_fade);
+
+	  audio_volume_commit(vol_fade.to);
+	}
+
+      audio_mixer_unwatch();
+
       snd_mixer_detach(mixer_hdl, audio_cfg.card);
       snd_mixer_close(mixer_hdl);
 
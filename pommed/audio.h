@@ -19,6 +19,9 @@ extern struct _audio_info audio_info;
 void
 audio_step(int dir);
 
+void
+audio_set_volume(int vol, int length);
+
 void
 audio_toggle_mute(void);
 
@@ -24,14 +24,18 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <errno.h>
 
 #include <syslog.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include <linux/input.h>
 #include <linux/uinput.h>
@@ -48,6 +52,7 @@
 #include "conffile.h"
 #include "audio.h"
 #include "beep.h"
+#include "latency.h"
 
 
 
@@ -57,23 +62,77 @@
 #endif
 
 
+/* Beep thread data definitions */
+struct sample {
+  char *audiodata;
+  int audiodatalen;
+  int format;
+  unsigned int channels;
+  unsigned int speed;
+  unsigned int framesize;
+  int framecount;
+};
+
+/* Samples */
+enum {
+  AUDIO_CLICK = 0,
+  AUDIO_N /* keep this one last */
+};
+
+/* Commands sent to the beep thread */
+enum {
+  BEEP_CMD_CLICK,  /* volume change feedback */
+  BEEP_CMD_TONE,   /* SND_TONE on the beeper device, value is the frequency */
+};
+
+struct beep_cmd {
+  int type;
+  int value;
+  struct timespec stamp;            /* command issued, CLOCK_MONOTONIC */
+  uint64_t key;                     /* keypress being traced, 0 if none */
+};
+
+/* Commands go through a single-producer (main thread), single-consumer
+ * (beep thread) lock-free ring; the eventfd wakes the beep thread up.
+ * head is only written by the producer, tail by the consumer.
+ * quit bypasses the ring, so the thread can be stopped even with a full
+ * ring; the thread signals done_efd on its way out.
+ */
+struct dspdata {
+  struct beep_cmd ring[BEEP_RING_SIZE];
+  unsigned int head;
+  unsigned int tail;
+  int quit;
+  int efd;
+  int done_efd;
+  int lat_fd[2];                    /* latencies back to the main thread */
+
+  pthread_t thread;
+  snd_pcm_t *pcm;                   /* kept open while in use */
+  struct sample *sample[AUDIO_N];   /* sound to play */
+};
+
+
 static int beep_fd;
 static int beep_thread_running = 0;
 
 
 /* Beep thread */
 static void
-beep_thread_command(int command);
+beep_thread_command(int type, int value, uint64_t key);
 
 static void
 beep_thread_cleanup(void);
 
+static void
+beep_thread_stop(void);
+
 static int
 beep_thread_init(void);
 
 
 static void
-beep_beep(void)
+beep_beep(int freq)
 {
   if (!beep_cfg.enabled)
     return;
@@ -81,7 +140,7 @@ beep_beep(void)
   if (audio_info.muted)
     return;
 
-  beep_thread_command(AUDIO_CLICK);
+  beep_thread_command(BEEP_CMD_TONE, freq, 0);
 }
 
 void
@@ -90,7 +149,8 @@ beep_audio(void)
   if (audio_info.muted)
     return;
 
-  beep_thread_command(AUDIO_CLICK);
+  /* Volume change feedback */
+  beep_thread_command(BEEP_CMD_CLICK, 0, latency_handoff(LATENCY_VOLUME, LATENCY_BEEP));
 }
 
 
@@ -231,7 +291,7 @@ beep_process_events(int fd, uint32_t events)
 	{
 	  logdebug("\nBEEP: BEEP!\n");
 
-	  beep_beep(); /* Catch that, Coyote */
+	  beep_beep(ev.value); /* Catch that, Coyote */
 	}
     }
 }
@@ -280,8 +340,9 @@ beep_cleanup(void)
 {
   if (beep_thread_running)
     {
-      beep_thread_command(AUDIO_COMMAND_QUIT);
-      beep_thread_cleanup();
+      beep_thread_stop();
+
+      beep_thread_running = 0;
     }
 
   beep_close_device();
@@ -375,8 +436,6 @@ beep_load_sample(char *filename)
     }
 
   sample->framesize = framesize;
-  sample->periods = sample->framesize;
-  sample->buffersize = (sample->periods * 8192) >> 2;
   sample->framecount = framecount;
   sample->audiodatalen = framecount * framesize;
 
@@ -404,95 +463,133 @@ beep_load_sample(char *filename)
 }
 
 
-/* Called from the audio thread */
+/* Called from the audio thread
+ * The PCM is configured once for the sample format and kept open
+ * until it's been idle for BEEP_PCM_IDLE_TIMEOUT seconds, so a click
+ * only costs a single write.
+ */
 static void
-beep_play_sample(struct dspdata *dsp, int cmd)
+beep_pcm_close(struct dspdata *dsp)
 {
-  snd_pcm_t *pcm_handle;          
-  snd_pcm_hw_params_t *hwparams;
+  if (dsp->pcm == NULL)
+    return;
 
-  char *pcm_name = "default";
+  logdebug("beep: closing idle PCM device\n");
 
-  struct sample *s = dsp->sample[cmd];
+  snd_pcm_drain(dsp->pcm);
+  snd_pcm_close(dsp->pcm);
 
-  snd_pcm_hw_params_alloca(&hwparams);
+  dsp->pcm = NULL;
+}
 
-  if (snd_pcm_open(&pcm_handle, pcm_name, SND_PCM_STREAM_PLAYBACK, 0) < 0)
-    {
-      logmsg(LOG_WARNING, "beep: error opening PCM device %s", pcm_name);
-      return;
-    }
+static int
+beep_pcm_open(struct dspdata *dsp, struct sample *s)
+{
+  char *pcm_name = "default";
+  int ret;
 
-  if (snd_pcm_hw_params_any(pcm_handle, hwparams) < 0)
+  ret = snd_pcm_open(&dsp->pcm, pcm_name, SND_PCM_STREAM_PLAYBACK, 0);
+  if (ret < 0)
     {
-      logmsg(LOG_WARNING, "beep: cannot configure PCM device");
-      return;
-    }
+      logmsg(LOG_WARNING, "beep: error opening PCM device %s: %s", pcm_name, snd_strerror(ret));
 
-  if (snd_pcm_hw_params_set_access(pcm_handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
-    {
-      logmsg(LOG_WARNING, "beep: error setting access");
-      return;
+      dsp->pcm = NULL;
+      return -1;
     }
 
-  if (snd_pcm_hw_params_set_format(pcm_handle, hwparams, s->format) < 0)
+  /* Buffer large enough for the whole sample; playback is started
+   * explicitly, so the buffer size does not add latency
+   */
+  ret = snd_pcm_set_params(dsp->pcm, s->format, SND_PCM_ACCESS_RW_INTERLEAVED,
+			   s->channels, s->speed, 1, BEEP_PCM_BUFFER_TIME);
+  if (ret < 0)
     {
-      logmsg(LOG_WARNING, "beep: error setting format");
-      return;
-    }
+      logmsg(LOG_WARNING, "beep: cannot configure PCM device: %s", snd_strerror(ret));
 
-  if (snd_pcm_hw_params_set_rate_near(pcm_handle, hwparams, &s->speed, 0) < 0)
-    {
-      logmsg(LOG_WARNING, "beep: error setting rate");
-      return;
-    }
+      snd_pcm_close(dsp->pcm);
+      dsp->pcm = NULL;
 
-  /* Set number of channels */
-  if (snd_pcm_hw_params_set_channels_near(pcm_handle, hwparams, &s->channels) < 0)
-    {
-      logmsg(LOG_WARNING, "beep: error setting channels");
-      return;
+      return -1;
     }
 
-  /* Set number of periods. Periods used to be called fragments. */ 
-  if (snd_pcm_hw_params_set_periods_near(pcm_handle, hwparams, &s->periods, 0) < 0)
-    {
-      logmsg(LOG_WARNING, "beep: error setting periods");
-      return;
-    }
+  return 0;
+}
+
+static void
+beep_play_sample(struct dspdata *dsp, int cmd)
+{
+  struct sample *s = dsp->sample[cmd];
+  snd_pcm_sframes_t ret;
 
-  /* Set buffer size (in frames). The resulting latency is given by */
-  /* latency = periodsize * periods / (rate * bytes_per_frame)     */
-  if (snd_pcm_hw_params_set_buffer_size_near(pcm_handle, hwparams, &s->buffersize) < 0)
+  if ((dsp->pcm == NULL) && (beep_pcm_open(dsp, s) < 0))
+    return;
+
+  /* Cut the previous click short if it's still playing,
+   * recover from the underrun that ended it otherwise
+   */
+  snd_pcm_drop(dsp->pcm);
+  snd_pcm_prepare(dsp->pcm);
+
+  ret = snd_pcm_writei(dsp->pcm, s->audiodata, s->framecount);
+  if (ret < 0)
     {
-      logmsg(LOG_WARNING, "beep: error setting buffersize");
-      return;
+      ret = snd_pcm_recover(dsp->pcm, ret, 1);
+      if (ret == 0)
+	ret = snd_pcm_writei(dsp->pcm, s->audiodata, s->framecount);
     }
 
-  /* Apply HW parameter settings to */
-  /* PCM device and prepare device  */
-  if (snd_pcm_hw_params(pcm_handle, hwparams) < 0)
+  if (ret < 0)
     {
-      logmsg(LOG_WARNING, "beep: error setting HW params");
+      logmsg(LOG_WARNING, "beep: error writing to PCM device: %s", snd_strerror(ret));
+
+      /* Start afresh next time */
+      snd_pcm_close(dsp->pcm);
+      dsp->pcm = NULL;
+
       return;
     }
 
-  int pcmreturn;
-  /* Write num_frames frames from buffer data to    */ 
-  /* the PCM device pointed to by pcm_handle.       */
-  /* Returns the number of frames actually written. */
-  while ((pcmreturn = snd_pcm_writei(pcm_handle, s->audiodata, s->framecount)) < 0)
-    {
-      snd_pcm_prepare(pcm_handle);
-    }
+  if (snd_pcm_state(dsp->pcm) == SND_PCM_STATE_PREPARED)
+    snd_pcm_start(dsp->pcm);
+}
 
-  /* Stop PCM device and drop pending frames */
-  snd_pcm_drop(pcm_handle);
 
-  /* Stop PCM device after pending frames have been played */ 
-  snd_pcm_close(pcm_handle);
-}
+/* Called from the audio thread */
+static void
+beep_thread_run(struct dspdata *dsp, struct beep_cmd *cmd)
+{
+  struct timespec end;
+  uint64_t now;
+  uint64_t t;
 
+  switch (cmd->type)
+    {
+      case BEEP_CMD_CLICK:
+      case BEEP_CMD_TONE:
+	/* We only have the one sample, used for both */
+	beep_play_sample(dsp, AUDIO_CLICK);
+
+	if (debug)
+	  {
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+
+	    logdebug("beep: %s %d started after %ld us\n",
+		     (cmd->type == BEEP_CMD_TONE) ? "tone" : "click", cmd->value,
+		     (end.tv_sec - cmd->stamp.tv_sec) * 1000000 + (end.tv_nsec - cmd->stamp.tv_nsec) / 1000);
+	  }
+
+	/* Traced keypress; dropped if the pipe is full */
+	if ((cmd->key != 0) && (dsp->lat_fd[1] >= 0))
+	  {
+	    now = evloop_now();
+	    t = (now > cmd->key) ? now - cmd->key : 0;
+
+	    if (write(dsp->lat_fd[1], &t, sizeof(t)) != sizeof(t))
+	      logdebug("beep: latency pipe full, sample dropped\n");
+	  }
+	break;
+    }
+}
 
 /* Called from the audio thread
  * Audio thread main loop
@@ -501,49 +598,155 @@ void *
 beep_thread (void *arg)
 {
   struct dspdata *dsp = (struct dspdata *) arg;
+  struct pollfd pfd;
+  struct beep_cmd cmd;
+  unsigned int head;
+  uint64_t val;
+  int ret;
+
+  pfd.fd = dsp->efd;
+  pfd.events = POLLIN;
+
   for (;;)
     {
-      pthread_mutex_lock(&dsp->mutex);
-      pthread_cond_wait(&dsp->cond, &dsp->mutex);
-      pthread_mutex_unlock(&dsp->mutex);
+      ret = poll(&pfd, 1, (dsp->pcm != NULL) ? BEEP_PCM_IDLE_TIMEOUT * 1000 : -1);
+      if (ret < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  logmsg(LOG_ERR, "beep: poll failed: %s", strerror(errno));
+	  break;
+	}
+
+      if (ret == 0)
+	{
+	  beep_pcm_close(dsp);
+	  continue;
+	}
 
-      switch (dsp->command)
+      /* Reset the eventfd counter before draining the ring, so a
+       * command queued after this point triggers another wakeup
+       */
+      if ((read(dsp->efd, &val, sizeof(val)) < 0) && (errno != EAGAIN))
+	logmsg(LOG_WARNING, "beep: could not read eventfd: %s", strerror(errno));
+
+      if (__atomic_load_n(&dsp->quit, __ATOMIC_ACQUIRE))
+	break;
+
+      head = __atomic_load_n(&dsp->head, __ATOMIC_ACQUIRE);
+
+      while (dsp->tail != head)
 	{
-	  case AUDIO_CLICK:
-	    dsp->command = AUDIO_COMMAND_NONE;
-
-	    beep_play_sample(dsp, AUDIO_CLICK);
-	    break;
-	  case AUDIO_COMMAND_QUIT:
-	    pthread_exit(NULL);
-	    break;
-	  case AUDIO_COMMAND_NONE:
-	    break;
+	  cmd = dsp->ring[dsp->tail & (BEEP_RING_SIZE - 1)];
+
+	  __atomic_store_n(&dsp->tail, dsp->tail + 1, __ATOMIC_RELEASE);
+
+	  beep_thread_run(dsp, &cmd);
 	}
     }
 
+  beep_pcm_close(dsp);
+
+  val = 1;
+  if (write(dsp->done_efd, &val, sizeof(val)) != sizeof(val))
+    logmsg(LOG_ERR, "beep: could not signal thread exit: %s", strerror(errno));
+
   return NULL;
 }
 
 
 /* Called from the main thread
- * This function wakes the audio thread
+ * Queues a command and wakes the audio thread; never blocks
  */
 static void
-beep_thread_command(int command)
+beep_thread_command(int type, int value, uint64_t key)
 {
+  struct beep_cmd *cmd;
+  unsigned int tail;
+  uint64_t val = 1;
+
   if (!beep_thread_running)
     return;
 
-  pthread_mutex_lock(&(_dsp.mutex));
+  tail = __atomic_load_n(&_dsp.tail, __ATOMIC_ACQUIRE);
+
+  /* Can only happen if the beep thread is stuck; the thread takes
+   * the commands in order, and there's no point in queueing dozens
+   * of clicks anyway
+   */
+  if ((_dsp.head - tail) >= BEEP_RING_SIZE)
+    {
+      logdebug("beep: command queue full, dropping command %d\n", type);
+
+      return;
+    }
+
+  cmd = &_dsp.ring[_dsp.head & (BEEP_RING_SIZE - 1)];
 
-  _dsp.command = command;
+  cmd->type = type;
+  cmd->value = value;
+  cmd->key = key;
+  clock_gettime(CLOCK_MONOTONIC, &cmd->stamp);
 
-  pthread_cond_signal(&(_dsp.cond));
-  pthread_mutex_unlock(&(_dsp.mutex));
+  __atomic_store_n(&_dsp.head, _dsp.head + 1, __ATOMIC_RELEASE);
+
+  if (write(_dsp.efd, &val, sizeof(val)) != sizeof(val))
+    logmsg(LOG_ERR, "beep: could not wake up the audio thread: %s", strerror(errno));
 }
 
 
+/* Called from the main thread
+ * Click start latencies for traced keypresses, from the beep thread
+ */
+static void
+beep_latency_process(int fd, uint32_t events)
+{
+  uint64_t t[BEEP_RING_SIZE];
+  int ret;
+  int i;
+
+  ret = read(fd, t, sizeof(t));
+  if (ret < (int)sizeof(t[0]))
+    return;
+
+  for (i = 0; i < ret / sizeof(t[0]); i++)
+    latency_record(LATENCY_VOLUME, LATENCY_BEEP, t[i]);
+}
+
+/* Called from the main thread, with event loop statistics enabled */
+static void
+beep_latency_init(void)
+{
+  int ret;
+
+  ret = pipe(_dsp.lat_fd);
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "beep: could not create latency pipe: %s", strerror(errno));
+
+      _dsp.lat_fd[0] = -1;
+      _dsp.lat_fd[1] = -1;
+
+      return;
+    }
+
+  fcntl(_dsp.lat_fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(_dsp.lat_fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(_dsp.lat_fd[1], F_SETFL, O_NONBLOCK);
+  fcntl(_dsp.lat_fd[1], F_SETFD, FD_CLOEXEC);
+
+  ret = evloop_add(_dsp.lat_fd[0], EPOLLIN, beep_latency_process);
+  if (ret < 0)
+    {
+      close(_dsp.lat_fd[0]);
+      close(_dsp.lat_fd[1]);
+
+      _dsp.lat_fd[0] = -1;
+      _dsp.lat_fd[1] = -1;
+    }
+}
+
 /* Called from the main thread */
 static void
 beep_thread_cleanup(void)
@@ -561,8 +764,63 @@ beep_thread_cleanup(void)
       free(_dsp.sample[i]);
     }
 
-  pthread_mutex_destroy(&(_dsp.mutex));
-  pthread_cond_destroy(&(_dsp.cond));
+  if (_dsp.efd >= 0)
+    close(_dsp.efd);
+
+  _dsp.efd = -1;
+
+  if (_dsp.done_efd >= 0)
+    close(_dsp.done_efd);
+
+  _dsp.done_efd = -1;
+
+  if (_dsp.lat_fd[0] >= 0)
+    {
+      evloop_remove(_dsp.lat_fd[0]);
+
+      close(_dsp.lat_fd[0]);
+      close(_dsp.lat_fd[1]);
+    }
+
+  _dsp.lat_fd[0] = -1;
+  _dsp.lat_fd[1] = -1;
+}
+
+/* Called from the main thread */
+static void
+beep_thread_stop(void)
+{
+  struct pollfd pfd;
+  uint64_t val = 1;
+  int ret;
+
+  __atomic_store_n(&_dsp.quit, 1, __ATOMIC_RELEASE);
+
+  if (write(_dsp.efd, &val, sizeof(val)) != sizeof(val))
+    logmsg(LOG_ERR, "beep: could not wake up the audio thread: %s", strerror(errno));
+
+  pfd.fd = _dsp.done_efd;
+  pfd.events = POLLIN;
+
+  ret = poll(&pfd, 1, BEEP_EXIT_TIMEOUT);
+  if (ret <= 0)
+    {
+      logmsg(LOG_WARNING, "beep: audio thread stuck, not waiting for it");
+
+      /* The thread still uses the samples, the eventfds and the
+       * latency pipe write end, leave them alone
+       */
+      pthread_detach(_dsp.thread);
+
+      if (_dsp.lat_fd[0] >= 0)
+	evloop_remove(_dsp.lat_fd[0]);
+
+      return;
+    }
+
+  pthread_join(_dsp.thread, NULL);
+
+  beep_thread_cleanup();
 }
 
 /* Called from the main thread
@@ -582,9 +840,29 @@ beep_thread_init(void)
     return -1;
 
   _dsp.thread = 0;
+  _dsp.pcm = NULL;
+  _dsp.head = 0;
+  _dsp.tail = 0;
+  _dsp.quit = 0;
+  _dsp.done_efd = -1;
+  _dsp.lat_fd[0] = -1;
+  _dsp.lat_fd[1] = -1;
+
+  _dsp.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_dsp.efd >= 0)
+    _dsp.done_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if ((_dsp.efd < 0) || (_dsp.done_efd < 0))
+    {
+      logmsg(LOG_ERR, "beep: could not create eventfd: %s", strerror(errno));
+
+      beep_thread_cleanup();
+      return -1;
+    }
+
+  if (evloop_stats_enabled())
+    beep_latency_init();
 
-  pthread_mutex_init(&(_dsp.mutex), NULL);
-  pthread_cond_init (&(_dsp.cond), NULL);
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
@@ -9,6 +9,15 @@
 #define BEEP_DEFAULT_FILE    "/usr/share/pommed/goutte.wav"
 #define BEEP_DEVICE_NAME     "Pommed beeper device"
 
+/* Release the PCM device after this many seconds without a click */
+#define BEEP_PCM_IDLE_TIMEOUT  5
+/* PCM buffer time, in us */
+#define BEEP_PCM_BUFFER_TIME   500000
+/* Beep thread command queue, power of 2 */
+#define BEEP_RING_SIZE         32
+/* Wait this long for the beep thread on exit (ms) */
+#define BEEP_EXIT_TIMEOUT      2000
+
 void
 beep_audio(void);
 
@@ -22,33 +31,4 @@ void
 beep_fix_config(void);
 
 
-/* Beep thread data definitions */
-struct sample {
-  char *audiodata;
-  int audiodatalen;
-  int format;
-  unsigned int channels;
-  unsigned int speed;
-  unsigned int framesize;
-  int framecount;
-  unsigned int periods;
-  unsigned long buffersize;
-};
-
-enum {
-  AUDIO_COMMAND_NONE = -2,
-  AUDIO_COMMAND_QUIT = -1,
-  AUDIO_CLICK = 0,
-  AUDIO_N /* keep this one last */
-};
-
-struct dspdata {
-  int command;
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  pthread_t thread;
-  struct sample *sample[AUDIO_N];   /* sound to play */
-};
-
-
 #endif /* !__BEEP_H__ */
@@ -0,0 +1,311 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Volume click latency: time from the click request to playback start,
+ * opening and configuring the PCM device for every click (as the beep
+ * thread used to) vs. the PCM kept open and configured (see beep.c).
+ *
+ * Needs a working ALSA "default" PCM; reports and exits cleanly without.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define NDEBUG
+#include <alsa/asoundlib.h>
+
+#include <audiofile.h>
+
+#include "../beep.h"
+
+
+#define DEFAULT_ITERATIONS   200
+/* Between two clicks (ms), about the keyboard auto-repeat rate */
+#define CLICK_INTERVAL       30
+
+
+struct sample {
+  char *audiodata;
+  int format;
+  unsigned int channels;
+  unsigned int speed;
+  int framecount;
+};
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+sleep_ms(int ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+
+  nanosleep(&ts, NULL);
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+  uint64_t ua = *(const uint64_t *)a;
+  uint64_t ub = *(const uint64_t *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+
+static int
+load_sample(char *filename, struct sample *s)
+{
+  AFfilehandle affd;
+  int dummy, precision, byteorder, framesize;
+  int ret;
+
+  affd = afOpenFile(filename, "r", 0);
+  if (!affd)
+    return -1;
+
+  afGetSampleFormat(affd, AF_DEFAULT_TRACK, &dummy, &precision);
+  byteorder = afGetVirtualByteOrder(affd, AF_DEFAULT_TRACK);
+  framesize = (int) afGetFrameSize(affd, AF_DEFAULT_TRACK, 0);
+  s->channels = afGetChannels(affd, AF_DEFAULT_TRACK);
+  s->speed = (int) afGetRate(affd, AF_DEFAULT_TRACK);
+  s->framecount = afGetFrameCount(affd, AF_DEFAULT_TRACK);
+
+  if (precision == 8)
+    s->format = SND_PCM_FORMAT_S8;
+  else if (byteorder == AF_BYTEORDER_LITTLEENDIAN)
+    s->format = SND_PCM_FORMAT_S16_LE;
+  else
+    s->format = SND_PCM_FORMAT_S16_BE;
+
+  s->audiodata = malloc(s->framecount * framesize);
+  if (s->audiodata == NULL)
+    {
+      afCloseFile(affd);
+      return -1;
+    }
+
+  ret = afReadFrames(affd, AF_DEFAULT_TRACK, s->audiodata, s->framecount);
+
+  afCloseFile(affd);
+
+  return (ret == s->framecount) ? 0 : -1;
+}
+
+
+static int
+pcm_open(snd_pcm_t **pcm, struct sample *s)
+{
+  int ret;
+
+  ret = snd_pcm_open(pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+  if (ret < 0)
+    return ret;
+
+  ret = snd_pcm_set_params(*pcm, s->format, SND_PCM_ACCESS_RW_INTERLEAVED,
+			   s->channels, s->speed, 1, BEEP_PCM_BUFFER_TIME);
+  if (ret < 0)
+    {
+      snd_pcm_close(*pcm);
+      *pcm = NULL;
+    }
+
+  return ret;
+}
+
+static int
+pcm_play(snd_pcm_t *pcm, struct sample *s)
+{
+  snd_pcm_sframes_t ret;
+
+  snd_pcm_drop(pcm);
+  snd_pcm_prepare(pcm);
+
+  ret = snd_pcm_writei(pcm, s->audiodata, s->framecount);
+  if (ret < 0)
+    return ret;
+
+  if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED)
+    snd_pcm_start(pcm);
+
+  return 0;
+}
+
+
+/* Open, configure, play; closed outside of the timed section */
+static int
+click_open(snd_pcm_t **pcm, struct sample *s)
+{
+  int ret;
+
+  ret = pcm_open(pcm, s);
+  if (ret < 0)
+    return ret;
+
+  return pcm_play(*pcm, s);
+}
+
+static void
+click_open_done(snd_pcm_t **pcm)
+{
+  if (*pcm == NULL)
+    return;
+
+  snd_pcm_drain(*pcm);
+  snd_pcm_close(*pcm);
+
+  *pcm = NULL;
+}
+
+/* PCM opened before the first click */
+static int
+click_persistent(snd_pcm_t **pcm, struct sample *s)
+{
+  if ((*pcm == NULL) && (pcm_open(pcm, s) < 0))
+    return -1;
+
+  return pcm_play(*pcm, s);
+}
+
+
+static int
+run(const char *label, int persistent, struct sample *s, int iterations, uint64_t *t)
+{
+  snd_pcm_t *pcm = NULL;
+  uint64_t start;
+  uint64_t total;
+  int ret;
+  int i;
+
+  if (persistent && (pcm_open(&pcm, s) < 0))
+    return -1;
+
+  total = 0;
+  for (i = 0; i < iterations; i++)
+    {
+      start = now_ns();
+
+      if (persistent)
+	ret = click_persistent(&pcm, s);
+      else
+	ret = click_open(&pcm, s);
+
+      t[i] = now_ns() - start;
+
+      if (ret < 0)
+	{
+	  fprintf(stderr, "%s: playback failed: %s\n", label, snd_strerror(ret));
+
+	  click_open_done(&pcm);
+	  return -1;
+	}
+
+      total += t[i];
+
+      if (!persistent)
+	click_open_done(&pcm);
+
+      sleep_ms(CLICK_INTERVAL);
+    }
+
+  click_open_done(&pcm);
+
+  qsort(t, iterations, sizeof(*t), u64_cmp);
+
+  printf("%-12s %8.1f %8.1f %8.1f %8.1f %8.1f\n", label,
+	 (double)total / iterations / 1000.0,
+	 t[iterations / 2] / 1000.0,
+	 t[iterations * 90 / 100] / 1000.0,
+	 t[iterations * 99 / 100] / 1000.0,
+	 t[iterations - 1] / 1000.0);
+
+  return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct sample s;
+  snd_pcm_t *pcm;
+  char *file;
+  uint64_t *t;
+  int iterations;
+  int ret;
+
+  file = BEEP_DEFAULT_FILE;
+  iterations = DEFAULT_ITERATIONS;
+
+  if (argc > 1)
+    file = argv[1];
+  if (argc > 2)
+    iterations = atoi(argv[2]);
+
+  if (iterations <= 0)
+    {
+      fprintf(stderr, "Usage: %s [sample.wav] [iterations]\n", argv[0]);
+      return 1;
+    }
+
+  if (load_sample(file, &s) < 0)
+    {
+      printf("beep_bench: cannot load %s, skipped\n", file);
+      return 0;
+    }
+
+  /* No sound card in this box, nothing to measure */
+  ret = pcm_open(&pcm, &s);
+  if (ret < 0)
+    {
+      printf("beep_bench: no usable ALSA default PCM (%s), skipped\n", snd_strerror(ret));
+      return 0;
+    }
+  snd_pcm_close(pcm);
+
+  t = malloc(iterations * sizeof(*t));
+  if (t == NULL)
+    return 1;
+
+  printf("Click request to playback start, %d clicks every %d ms (us)\n", iterations, CLICK_INTERVAL);
+  printf("%-12s %8s %8s %8s %8s %8s\n", "", "avg", "p50", "p90", "p99", "max");
+
+  ret = run("open/click", 0, &s, iterations, t);
+  if (ret == 0)
+    ret = run("persistent", 1, &s, iterations, t);
+
+  free(t);
+  free(s.audiodata);
+
+  return (ret == 0) ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * DBus method dispatch microbenchmark: the dbus_message_is_method_call()
+ * chain pommed used to have vs. the hashed dispatch table.
+ *
+ * No bus connection is needed, messages are built locally.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <dbus/dbus.h>
+
+#include "../dispatch.h"
+
+
+#define DEFAULT_ITERATIONS   1000000
+
+
+static const char *methods[][2] =
+  {
+    { "org.pommed.lcdBacklight", "getLevel" },
+    { "org.pommed.kbdBacklight", "getLevel" },
+    { "org.pommed.ambient", "getLevel" },
+    { "org.pommed.audio", "getVolume" },
+    { "org.pommed.audio", "getMute" },
+    { "org.pommed.video", "getVTState" },
+    { "org.pommed.lcdBacklight", "levelUp" },
+    { "org.pommed.lcdBacklight", "levelDown" },
+    { "org.pommed.kbdBacklight", "inhibit" },
+    { "org.pommed.kbdBacklight", "disinhibit" },
+    { "org.pommed.audio", "volumeUp" },
+    { "org.pommed.audio", "volumeDown" },
+    { "org.pommed.audio", "toggleMute" },
+    { "org.pommed.cd", "eject" },
+    /* Not handled: goes through the whole chain */
+    { "org.pommed.bogus", "frobnicate" },
+  };
+
+#define N_METHODS     (sizeof(methods) / sizeof(*methods))
+#define N_HANDLED     (N_METHODS - 1)
+
+
+static volatile int sink;
+
+static void
+handler(DBusMessage *req, int arg)
+{
+  sink = arg;
+}
+
+static struct dispatch_method table[N_HANDLED];
+
+
+/* The dispatch code as it was, minus the handlers */
+static int
+chain_dispatch(DBusMessage *msg)
+{
+  if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "getLevel"))
+    return 0;
+  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "getLevel"))
+    return 1;
+  else if (dbus_message_is_method_call(msg, "org.pommed.ambient", "getLevel"))
+    return 2;
+  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "getVolume"))
+    return 3;
+  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "getMute"))
+    return 4;
+  else if (dbus_message_is_method_call(msg, "org.pommed.video", "getVTState"))
+    return 5;
+  else if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "levelUp"))
+    return 6;
+  else if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "levelDown"))
+    return 7;
+  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "inhibit"))
+    return 8;
+  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "disinhibit"))
+    return 9;
+  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "volumeUp"))
+    return 10;
+  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "volumeDown"))
+    return 11;
+  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "toggleMute"))
+    return 12;
+  else if (dbus_message_is_method_call(msg, "org.pommed.cd", "eject"))
+    return 13;
+  else if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    return 14;
+
+  return -1;
+}
+
+static int
+table_dispatch(DBusMessage *msg)
+{
+  struct dispatch_method *m;
+
+  if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return -1;
+
+  m = dispatch_lookup(dbus_message_get_interface(msg), dbus_message_get_member(msg));
+  if (m == NULL)
+    return -1;
+
+  m->cb(msg, m->arg);
+
+  return m->arg;
+}
+
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusMessage *msg[N_METHODS];
+  struct timespec start;
+  struct timespec end;
+  char name[64];
+  double t_chain;
+  double t_table;
+  double tot_chain;
+  double tot_table;
+  long iterations;
+  long n;
+  int i;
+
+  iterations = DEFAULT_ITERATIONS;
+  if (argc > 1)
+    iterations = strtol(argv[1], NULL, 10);
+
+  if (iterations <= 0)
+    {
+      fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+
+      return 1;
+    }
+
+  for (i = 0; i < N_HANDLED; i++)
+    {
+      table[i].iface = methods[i][0];
+      table[i].member = methods[i][1];
+      table[i].cb = handler;
+      table[i].arg = i;
+    }
+
+  dispatch_register(table, N_HANDLED);
+
+  for (i = 0; i < N_METHODS; i++)
+    {
+      msg[i] = dbus_message_new_method_call("org.pommed", "/org/pommed",
+					    methods[i][0], methods[i][1]);
+      if (msg[i] == NULL)
+	{
+	  fprintf(stderr, "Could not create message\n");
+
+	  return 1;
+	}
+
+      /* Sanity check: both must agree */
+      if (chain_dispatch(msg[i]) != table_dispatch(msg[i]))
+	{
+	  fprintf(stderr, "Dispatch mismatch for %s.%s\n", methods[i][0], methods[i][1]);
+
+	  return 1;
+	}
+    }
+
+  printf("DBus method dispatch, %ld iterations, ns per message\n\n", iterations);
+  printf("%-40s %10s %10s\n", "method", "chain", "table");
+
+  tot_chain = 0;
+  tot_table = 0;
+
+  for (i = 0; i < N_METHODS; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (n = 0; n < iterations; n++)
+	sink = chain_dispatch(msg[i]);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      t_chain = elapsed_ns(&start, &end) / iterations;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (n = 0; n < iterations; n++)
+	sink = table_dispatch(msg[i]);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      t_table = elapsed_ns(&start, &end) / iterations;
+
+      tot_chain += t_chain;
+      tot_table += t_table;
+
+      snprintf(name, sizeof(name), "%s.%s", methods[i][0], methods[i][1]);
+
+      printf("%-40s %10.1f %10.1f\n", name, t_chain, t_table);
+    }
+
+  printf("\n%-40s %10.1f %10.1f\n", "average", tot_chain / N_METHODS, tot_table / N_METHODS);
+
+  for (i = 0; i < N_METHODS; i++)
+    dbus_message_unref(msg[i]);
+
+  return 0;
+}
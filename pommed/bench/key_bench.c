@@ -0,0 +1,827 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Hotkey load generator: creates a virtual internal keyboard through
+ * uinput, with IDs pommed picks up, replays scripted key bursts and
+ * times the DBus signals pommed sends in response.
+ *
+ * Script lines: <action> <count> <rate_hz> [press|repeat]
+ * Actions are listed by -h. A key is answered by the first signal of
+ * its kind sent after it; auto-repeated keys are coalesced by pommed,
+ * so a signal may answer several keys at once. Keys left unanswered
+ * (level already at its max...) are counted apart.
+ *
+ * For each burst: throughput, key-to-signal latency percentiles, and
+ * per key: read/write syscalls (/proc/<pid>/io), event loop wakeups
+ * (getStats) and voluntary context switches of pommed. pommed's own
+ * statistics follow, if it runs with -s.
+ *
+ * Runs against whichever system bus DBUS_SYSTEM_BUS_ADDRESS points to;
+ * see keybench.sh for the fake sysfs tree and private bus setup.
+ */
+
+/* ppoll() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+
+#include <errno.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <dbus/dbus.h>
+
+#include "../evdev.h"
+
+
+#define DEVICE_NAME          "pommed key_bench keyboard"
+
+/* pommed needs to find the device before the first burst (ms) */
+#define DEVICE_SETTLE        1000
+/* Keys still unanswered this long after the burst are given up on (ms) */
+#define ANSWER_TIMEOUT       1000
+/* Time for pommed to start and claim its name (s) */
+#define POMMED_TIMEOUT       10
+
+#define MAX_KEYS             100000
+
+#define SIGNAL_PREFIX        "org.pommed.signal."
+
+
+static struct action
+{
+  char *name;
+  int code;
+  char *signal;   /* NULL if pommed sends none */
+} actions[] =
+  {
+    { "lcd-up", KEY_BRIGHTNESSUP, "lcdBacklight" },
+    { "lcd-down", KEY_BRIGHTNESSDOWN, "lcdBacklight" },
+    { "vol-up", KEY_VOLUMEUP, "audioVolume" },
+    { "vol-down", KEY_VOLUMEDOWN, "audioVolume" },
+    { "mute", KEY_MUTE, "audioMute" },
+    { "kbd-up", KEY_KBDILLUMUP, "kbdBacklight" },
+    { "kbd-down", KEY_KBDILLUMDOWN, "kbdBacklight" },
+    { "kbd-toggle", KEY_KBDILLUMTOGGLE, "kbdBacklight" },
+    { "eject", KEY_EJECTCD, "cdEject" },
+    { "video", KEY_SWITCHVIDEOMODE, "videoSwitch" },
+    { "next", KEY_NEXTSONG, NULL },
+    { "prev", KEY_PREVIOUSSONG, NULL },
+    { "playpause", KEY_PLAYPAUSE, NULL },
+  };
+
+#define N_ACTIONS     (sizeof(actions) / sizeof(*actions))
+
+
+/* pommed process counters */
+struct counters
+{
+  uint64_t syscalls;
+  uint64_t csw;
+  uint64_t wakeups;
+};
+
+/* Burst in progress */
+static struct
+{
+  struct action *action;
+  uint64_t stamps[MAX_KEYS];  /* keys sent, CLOCK_MONOTONIC */
+  uint64_t lat[MAX_KEYS];     /* key to signal, per answered key */
+  int sent;
+  int answered;
+  uint64_t last;              /* last answer */
+} burst;
+
+static DBusConnection *conn;
+static unsigned long pommed_pid;
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+  uint64_t ua = *(const uint64_t *)a;
+  uint64_t ub = *(const uint64_t *)b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+
+/*
+ * Virtual keyboard
+ */
+
+static int
+uinput_open(void)
+{
+  char *uinput_dev[3] =
+    {
+      "/dev/input/uinput",
+      "/dev/uinput",
+      "/dev/misc/uinput"
+    };
+  struct uinput_user_dev dv;
+  int fd;
+  int ret;
+  int i;
+
+  for (i = 0; i < (sizeof(uinput_dev) / sizeof(uinput_dev[0])); i++)
+    {
+      fd = open(uinput_dev[i], O_RDWR, 0);
+
+      if (fd >= 0)
+	break;
+    }
+
+  if (fd < 0)
+    {
+      fprintf(stderr, "Could not open uinput: %s\n", strerror(errno));
+
+      return -1;
+    }
+
+  /* Looks like the internal keyboard of a MacBookPro8,1 */
+  memset(&dv, 0, sizeof(dv));
+  strcpy(dv.name, DEVICE_NAME);
+  dv.id.bustype = BUS_USB;
+  dv.id.vendor = USB_VENDOR_ID_APPLE;
+  dv.id.product = USB_PRODUCT_ID_WELLSPRING5_ANSI;
+  dv.id.version = 1;
+
+  ret = write(fd, &dv, sizeof(dv));
+  if (ret != sizeof(dv))
+    goto out_error;
+
+  ret = ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  ret |= ioctl(fd, UI_SET_EVBIT, EV_SYN);
+
+  for (i = 0; i < N_ACTIONS; i++)
+    ret |= ioctl(fd, UI_SET_KEYBIT, actions[i].code);
+
+  if (ret != 0)
+    goto out_error;
+
+  ret = ioctl(fd, UI_DEV_CREATE, NULL);
+  if (ret != 0)
+    goto out_error;
+
+  return fd;
+
+ out_error:
+  fprintf(stderr, "Could not set up uinput device: %s\n", strerror(errno));
+
+  close(fd);
+  return -1;
+}
+
+static void
+uinput_close(int fd)
+{
+  ioctl(fd, UI_DEV_DESTROY, NULL);
+
+  close(fd);
+}
+
+static void
+set_event(struct input_event *ev, int type, int code, int value)
+{
+  memset(ev, 0, sizeof(*ev));
+
+  ev->type = type;
+  ev->code = code;
+  ev->value = value;
+}
+
+/* value: 1 press, 2 auto-repeat; release: key up follows */
+static int
+send_key(int fd, int code, int value, int release)
+{
+  struct input_event ev[4];
+  int n;
+  int ret;
+
+  set_event(&ev[0], EV_KEY, code, value);
+  set_event(&ev[1], EV_SYN, SYN_REPORT, 0);
+  n = 2;
+
+  if (release)
+    {
+      set_event(&ev[2], EV_KEY, code, 0);
+      set_event(&ev[3], EV_SYN, SYN_REPORT, 0);
+      n = 4;
+    }
+
+  ret = write(fd, ev, n * sizeof(*ev));
+
+  return (ret == n * sizeof(*ev)) ? 0 : -1;
+}
+
+
+/*
+ * pommed process counters
+ */
+
+static uint64_t
+proc_field(const char *file, const char *field)
+{
+  char path[64];
+  char line[128];
+  FILE *fp;
+  uint64_t val;
+  int len;
+
+  snprintf(path, sizeof(path), "/proc/%lu/%s", pommed_pid, file);
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return 0;
+
+  val = 0;
+  len = strlen(field);
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      if ((strncmp(line, field, len) == 0) && (line[len] == ':'))
+	{
+	  val = strtoull(line + len + 1, NULL, 10);
+	  break;
+	}
+    }
+
+  fclose(fp);
+
+  return val;
+}
+
+static DBusMessage *
+pommed_call(const char *method)
+{
+  DBusMessage *msg;
+  DBusMessage *reply;
+
+  msg = dbus_message_new_method_call("org.pommed", "/org/pommed",
+				     "org.pommed", method);
+  if (msg == NULL)
+    return NULL;
+
+  reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, NULL);
+
+  dbus_message_unref(msg);
+
+  return reply;
+}
+
+/* getStats: enabled, wakeups, timer wakeups, events, max stall,
+ * callback stats, latency stats
+ */
+static uint64_t
+pommed_wakeups(void)
+{
+  DBusMessage *reply;
+  DBusMessageIter args;
+  uint64_t wakeups;
+
+  reply = pommed_call("getStats");
+  if (reply == NULL)
+    return 0;
+
+  wakeups = 0;
+
+  if (dbus_message_iter_init(reply, &args)
+      && dbus_message_iter_next(&args)
+      && (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_UINT64))
+    dbus_message_iter_get_basic(&args, &wakeups);
+
+  dbus_message_unref(reply);
+
+  return wakeups;
+}
+
+/* The getStats call costs pommed a few syscalls and a wakeup;
+ * keep it out of the measurement window
+ */
+static void
+counters_begin(struct counters *c)
+{
+  c->wakeups = pommed_wakeups();
+  c->syscalls = proc_field("io", "syscr") + proc_field("io", "syscw");
+  c->csw = proc_field("status", "voluntary_ctxt_switches");
+}
+
+static void
+counters_end(struct counters *c)
+{
+  c->syscalls = proc_field("io", "syscr") + proc_field("io", "syscw") - c->syscalls;
+  c->csw = proc_field("status", "voluntary_ctxt_switches") - c->csw;
+  c->wakeups = pommed_wakeups() - c->wakeups;
+}
+
+
+/*
+ * Signals
+ */
+
+static void
+process_signal(DBusMessage *msg)
+{
+  const char *iface;
+  uint64_t now;
+
+  iface = dbus_message_get_interface(msg);
+  if ((iface == NULL) || (strncmp(iface, SIGNAL_PREFIX, strlen(SIGNAL_PREFIX)) != 0))
+    return;
+
+  if ((burst.action == NULL) || (burst.action->signal == NULL))
+    return;
+
+  if (strcmp(iface + strlen(SIGNAL_PREFIX), burst.action->signal) != 0)
+    return;
+
+  now = now_ns();
+
+  if (burst.answered == burst.sent)
+    return;
+
+  for (; burst.answered < burst.sent; burst.answered++)
+    burst.lat[burst.answered] = now - burst.stamps[burst.answered];
+
+  burst.last = now;
+}
+
+/* Processes signals until the deadline (CLOCK_MONOTONIC) */
+static void
+pump(uint64_t deadline)
+{
+  DBusMessage *msg;
+  struct pollfd pfd;
+  struct timespec ts;
+  uint64_t now;
+  int fd;
+
+  dbus_connection_get_unix_fd(conn, &fd);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  for (;;)
+    {
+      while ((msg = dbus_connection_pop_message(conn)) != NULL)
+	{
+	  if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_SIGNAL)
+	    process_signal(msg);
+
+	  dbus_message_unref(msg);
+	}
+
+      now = now_ns();
+      if (now >= deadline)
+	break;
+
+      ts.tv_sec = (deadline - now) / 1000000000ULL;
+      ts.tv_nsec = (deadline - now) % 1000000000ULL;
+
+      if (ppoll(&pfd, 1, &ts, NULL) > 0)
+	dbus_connection_read_write(conn, 0);
+    }
+}
+
+
+/*
+ * Bursts
+ */
+
+static struct action *
+action_lookup(const char *name)
+{
+  int i;
+
+  for (i = 0; i < N_ACTIONS; i++)
+    {
+      if (strcmp(actions[i].name, name) == 0)
+	return &actions[i];
+    }
+
+  return NULL;
+}
+
+static int
+run_burst(int fd, struct action *a, int count, int rate, int repeat)
+{
+  struct counters c;
+  uint64_t period;
+  uint64_t start;
+  uint64_t end;
+  uint64_t t;
+  double tput;
+  int i;
+  int ret;
+
+  burst.sent = 0;
+  burst.answered = 0;
+  burst.last = 0;
+
+  counters_begin(&c);
+
+  /* Only count signals sent after this point */
+  pump(now_ns());
+  burst.action = a;
+
+  period = 1000000000ULL / rate;
+  start = now_ns();
+
+  for (i = 0; i < count; i++)
+    {
+      pump(start + i * period);
+
+      burst.stamps[i] = now_ns();
+      burst.sent++;
+
+      if (repeat)
+	ret = send_key(fd, a->code, (i == 0) ? 1 : 2, (i == count - 1));
+      else
+	ret = send_key(fd, a->code, 1, 1);
+
+      if (ret < 0)
+	{
+	  fprintf(stderr, "Could not send key: %s\n", strerror(errno));
+	  return -1;
+	}
+    }
+
+  end = now_ns();
+
+  /* Wait for the answers, if any */
+  if (a->signal != NULL)
+    {
+      t = end + ANSWER_TIMEOUT * 1000000ULL;
+
+      while ((burst.answered < burst.sent) && (now_ns() < t))
+	pump(now_ns() + 10000000ULL);
+    }
+
+  /* Let pommed settle: fades, deferred work */
+  pump(now_ns() + 100000000ULL);
+
+  burst.action = NULL;
+
+  counters_end(&c);
+
+  if (burst.last > end)
+    end = burst.last;
+
+  tput = (double)count * 1000000000.0 / (end - start);
+
+  printf("%-10s %-6s %6d %6d %8.1f", a->name, repeat ? "repeat" : "press", count, burst.answered, tput);
+
+  if (burst.answered > 0)
+    {
+      qsort(burst.lat, burst.answered, sizeof(*burst.lat), u64_cmp);
+
+      printf(" %8.1f %8.1f %8.1f %8.1f",
+	     burst.lat[burst.answered / 2] / 1000.0,
+	     burst.lat[burst.answered * 90 / 100] / 1000.0,
+	     burst.lat[burst.answered * 99 / 100] / 1000.0,
+	     burst.lat[burst.answered - 1] / 1000.0);
+    }
+  else
+    printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+
+  printf(" %7.2f %7.2f %7.2f\n",
+	 (double)c.syscalls / count, (double)c.wakeups / count, (double)c.csw / count);
+
+  return 0;
+}
+
+static int
+run_script(int fd, FILE *fp)
+{
+  char line[256];
+  char name[32];
+  char mode[16];
+  struct action *a;
+  int count;
+  int rate;
+  int lineno;
+  int ret;
+
+  printf("Latency: key to signal (us); per key: r/w syscalls, loop wakeups, context switches\n");
+  printf("%-10s %-6s %6s %6s %8s %8s %8s %8s %8s %7s %7s %7s\n",
+	 "action", "mode", "keys", "answ", "keys/s", "p50", "p90", "p99", "max", "sysc", "wakeup", "csw");
+
+  for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++)
+    {
+      if ((line[0] == '#') || (line[strspn(line, " \t\n")] == '\0'))
+	continue;
+
+      strcpy(mode, "press");
+
+      ret = sscanf(line, "%31s %d %d %15s", name, &count, &rate, mode);
+      if (ret < 3)
+	{
+	  fprintf(stderr, "line %d: syntax error\n", lineno);
+	  return -1;
+	}
+
+      a = action_lookup(name);
+      if (a == NULL)
+	{
+	  fprintf(stderr, "line %d: unknown action %s\n", lineno, name);
+	  return -1;
+	}
+
+      if ((count < 1) || (count > MAX_KEYS) || (rate < 1) || (rate > 100000))
+	{
+	  fprintf(stderr, "line %d: count or rate out of range\n", lineno);
+	  return -1;
+	}
+
+      if ((strcmp(mode, "press") != 0) && (strcmp(mode, "repeat") != 0))
+	{
+	  fprintf(stderr, "line %d: mode is press or repeat\n", lineno);
+	  return -1;
+	}
+
+      ret = run_burst(fd, a, count, rate, (mode[0] == 'r'));
+      if (ret < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+
+/*
+ * pommed statistics
+ */
+
+/* Upper bound of the bucket holding the given fraction of the calls */
+static uint64_t
+hist_percentile(const uint32_t *hist, int n, uint64_t calls, double p)
+{
+  uint64_t sum;
+  int i;
+
+  sum = 0;
+  for (i = 0; i < n; i++)
+    {
+      sum += hist[i];
+      if (sum >= calls * p)
+	break;
+    }
+
+  return 1ULL << i;
+}
+
+static void
+print_stats_array(DBusMessageIter *args, const char *title)
+{
+  DBusMessageIter array;
+  DBusMessageIter entry;
+  DBusMessageIter hist;
+  const char *name;
+  uint64_t calls;
+  uint64_t total;
+  uint64_t max;
+  const uint32_t *buckets;
+  int n;
+
+  if (dbus_message_iter_get_arg_type(args) != DBUS_TYPE_ARRAY)
+    return;
+
+  printf("\n%s (us)\n", title);
+  printf("%-32s %9s %9s %9s %9s\n", "", "calls", "avg", "p99 <", "max");
+
+  dbus_message_iter_recurse(args, &array);
+
+  while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse(&array, &entry);
+
+      dbus_message_iter_get_basic(&entry, &name);
+      dbus_message_iter_next(&entry);
+      dbus_message_iter_get_basic(&entry, &calls);
+      dbus_message_iter_next(&entry);
+      dbus_message_iter_get_basic(&entry, &total);
+      dbus_message_iter_next(&entry);
+      dbus_message_iter_get_basic(&entry, &max);
+      dbus_message_iter_next(&entry);
+
+      dbus_message_iter_recurse(&entry, &hist);
+      dbus_message_iter_get_fixed_array(&hist, &buckets, &n);
+
+      printf("%-32s %9llu %9.1f %9llu %9llu\n", name,
+	     (unsigned long long)calls, (double)total / calls,
+	     (unsigned long long)hist_percentile(buckets, n, calls, 0.99),
+	     (unsigned long long)max);
+
+      dbus_message_iter_next(&array);
+    }
+}
+
+static void
+print_pommed_stats(void)
+{
+  DBusMessage *reply;
+  DBusMessageIter args;
+  dbus_bool_t enabled;
+  uint64_t val[4];
+  int i;
+
+  reply = pommed_call("getStats");
+  if (reply == NULL)
+    return;
+
+  if (!dbus_message_iter_init(reply, &args))
+    goto out;
+
+  dbus_message_iter_get_basic(&args, &enabled);
+
+  for (i = 0; i < 4; i++)
+    {
+      dbus_message_iter_next(&args);
+      dbus_message_iter_get_basic(&args, &val[i]);
+    }
+
+  printf("\npommed: %llu wakeups (%llu timer), %llu events, longest iteration %llu us\n",
+	 (unsigned long long)val[0], (unsigned long long)val[1],
+	 (unsigned long long)val[2], (unsigned long long)val[3]);
+
+  if (!enabled)
+    {
+      printf("pommed runs without -s, no per-callback statistics\n");
+      goto out;
+    }
+
+  dbus_message_iter_next(&args);
+  print_stats_array(&args, "pommed callbacks");
+
+  dbus_message_iter_next(&args);
+  print_stats_array(&args, "pommed key-to-action latency");
+
+ out:
+  dbus_message_unref(reply);
+}
+
+
+/*
+ * Setup
+ */
+
+static int
+pommed_connect(void)
+{
+  DBusMessage *msg;
+  DBusMessage *reply;
+  DBusError err;
+  const char *name = "org.pommed";
+  uint32_t pid;
+  int i;
+
+  dbus_error_init(&err);
+
+  conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+  if (dbus_error_is_set(&err))
+    {
+      fprintf(stderr, "Could not connect to the bus: %s\n", err.message);
+
+      dbus_error_free(&err);
+      return -1;
+    }
+
+  for (i = 0; !dbus_bus_name_has_owner(conn, name, NULL); i++)
+    {
+      if (i == POMMED_TIMEOUT * 10)
+	{
+	  fprintf(stderr, "pommed is not on the bus\n");
+	  return -1;
+	}
+
+      usleep(100000);
+    }
+
+  msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+				     DBUS_INTERFACE_DBUS, "GetConnectionUnixProcessID");
+  dbus_message_append_args(msg, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+
+  reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
+  dbus_message_unref(msg);
+
+  if ((reply == NULL)
+      || !dbus_message_get_args(reply, &err, DBUS_TYPE_UINT32, &pid, DBUS_TYPE_INVALID))
+    {
+      fprintf(stderr, "Could not get pommed PID: %s\n", err.message);
+
+      dbus_error_free(&err);
+      return -1;
+    }
+
+  dbus_message_unref(reply);
+
+  pommed_pid = pid;
+
+  dbus_bus_add_match(conn, "type='signal',sender='org.pommed'", &err);
+  if (dbus_error_is_set(&err))
+    {
+      fprintf(stderr, "Could not add match rule: %s\n", err.message);
+
+      dbus_error_free(&err);
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+usage(char *prog)
+{
+  int i;
+
+  fprintf(stderr, "Usage: %s <script>\n", prog);
+  fprintf(stderr, "Script lines: <action> <count> <rate_hz> [press|repeat]\n");
+  fprintf(stderr, "Actions:");
+
+  for (i = 0; i < N_ACTIONS; i++)
+    fprintf(stderr, " %s", actions[i].name);
+
+  fprintf(stderr, "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  FILE *fp;
+  int fd;
+  int ret;
+
+  if ((argc != 2) || (argv[1][0] == '-'))
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+  fp = fopen(argv[1], "r");
+  if (fp == NULL)
+    {
+      fprintf(stderr, "Could not open %s: %s\n", argv[1], strerror(errno));
+      return 1;
+    }
+
+  ret = pommed_connect();
+  if (ret < 0)
+    return 1;
+
+  fd = uinput_open();
+  if (fd < 0)
+    return 1;
+
+  printf("pommed PID %lu, waiting %d ms for it to pick up the keyboard\n", pommed_pid, DEVICE_SETTLE);
+  pump(now_ns() + DEVICE_SETTLE * 1000000ULL);
+
+  ret = run_script(fd, fp);
+
+  fclose(fp);
+
+  uinput_close(fd);
+
+  if (ret == 0)
+    print_pommed_stats();
+
+  dbus_connection_close(conn);
+  dbus_connection_unref(conn);
+
+  return (ret == 0) ? 0 : 1;
+}
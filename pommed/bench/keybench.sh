@@ -0,0 +1,132 @@
+#! /bin/sh
+#
+# Hotkey benchmark harness: runs pommed against a fake MacBookPro8,1
+# sysfs tree and a private system bus, and replays a key script through
+# key_bench, with state_bench reading the state page all along. No Apple
+# hardware needed, but root and uinput are.
+#
+# pommed's paths are hardwired, so the fake tree, config and run
+# directory are mounted over the real ones in a private mount
+# namespace; the host is left alone.
+#
+# Usage: keybench.sh [key script]   (from the bench directory)
+#
+
+POMMED=${POMMED:-../pommed}
+SCRIPT=${1:-keys.script}
+
+# Inside the namespace
+if [ "$1" = "--inner" ]; then
+    TMP=$2
+    SCRIPT=$3
+
+    set -e
+
+    mount --make-rprivate /
+
+    # Fake /sys/class, with the real input devices
+    mkdir -p $TMP/input
+    mount --bind /sys/class/input $TMP/input
+    mount -t tmpfs keybench /sys/class
+    cp -a $TMP/class/. /sys/class/
+    mkdir /sys/class/input
+    mount --move $TMP/input /sys/class/input
+
+    # Keep the hands off the host fnmode
+    for d in /sys/module/hid_apple/parameters /sys/module/hid/parameters /sys/module/usbhid/parameters; do
+	test -d $d && mount -t tmpfs keybench $d
+    done
+
+    mkdir -p $TMP/etc $TMP/etc-work $TMP/run
+    cp pommed.conf.bench $TMP/etc/pommed.conf
+    mount -t overlay keybench -o lowerdir=/etc,upperdir=$TMP/etc,workdir=$TMP/etc-work /etc
+    mount --bind $TMP/run /var/run
+
+    dbus-daemon --config-file=bus.conf --address=unix:path=$TMP/bus --fork --print-pid > $TMP/dbus.pid
+    DBUS_SYSTEM_BUS_ADDRESS=unix:path=$TMP/bus
+    export DBUS_SYSTEM_BUS_ADDRESS
+
+    $POMMED -f -s > $TMP/pommed.log 2>&1 &
+    POMMED_PID=$!
+
+    # Exits along with pommed
+    ./state_bench > $TMP/state.log 2>&1 &
+    STATE_PID=$!
+
+    set +e
+
+    ./key_bench $SCRIPT
+    RET=$?
+
+    kill $POMMED_PID
+    wait $POMMED_PID
+    kill $(cat $TMP/dbus.pid)
+
+    wait $STATE_PID
+    STATE_RET=$?
+
+    echo
+    cat $TMP/state.log
+
+    if [ $RET -eq 0 ]; then
+	RET=$STATE_RET
+    fi
+
+    if [ $RET -ne 0 ]; then
+	echo "keybench: pommed log follows"
+	tail -n 30 $TMP/pommed.log
+    fi
+
+    exit $RET
+fi
+
+
+if [ "$(id -u)" != "0" ]; then
+    echo "keybench: needs root (uinput, mount namespace), skipped"
+    exit 0
+fi
+
+if [ ! -c /dev/input/uinput ] && [ ! -c /dev/uinput ] && [ ! -c /dev/misc/uinput ]; then
+    echo "keybench: no uinput device (modprobe uinput), skipped"
+    exit 0
+fi
+
+for p in unshare dbus-daemon; do
+    if ! command -v $p > /dev/null; then
+	echo "keybench: $p not found, skipped"
+	exit 0
+    fi
+done
+
+TMP=$(mktemp -d /tmp/keybench.XXXXXX) || exit 1
+trap "rm -rf $TMP" EXIT
+
+C=$TMP/class
+
+mkdir -p $C/dmi/id
+echo "Apple Inc." > $C/dmi/id/sys_vendor
+echo "MacBookPro8,1" > $C/dmi/id/product_name
+
+# pommed writes the levels in place, without a newline; over a plain
+# file, a shorter value would leave the tail of the previous one behind.
+# So the levels stay 3 digits wide: the bursts in keys.script move them
+# less than 200 steps, and return to the initial level. The keyboard
+# backlight toggle writes 0 over 100, which reads back as 0 ("000").
+
+# Wide range, bursts don't hit the limits
+mkdir -p $C/backlight/apple_backlight
+echo 999 > $C/backlight/apple_backlight/max_brightness
+echo 500 > $C/backlight/apple_backlight/brightness
+ln -s brightness $C/backlight/apple_backlight/actual_brightness
+
+mkdir -p $C/leds/smc::kbd_backlight
+echo 100 > $C/leds/smc::kbd_backlight/brightness
+
+mkdir -p $C/power_supply/ADP1
+echo 1 > $C/power_supply/ADP1/online
+
+mkdir -p $C/hwmon/hwmon0/device
+echo applesmc > $C/hwmon/hwmon0/device/name
+echo "(10,10)" > $C/hwmon/hwmon0/device/light
+
+unshare -m "$0" --inner $TMP "$SCRIPT"
@@ -0,0 +1,138 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * State page reader, run by keybench.sh alongside key_bench: follows
+ * the updates through client-common/state-client.c until pommed exits,
+ * checking every snapshot, and reports how long the reads took.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../../client-common/state-client.h"
+
+
+/* Wait this long for pommed to publish the page (s) */
+#define STATE_TIMEOUT        10
+/* Sleep at most this long between reads (ms) */
+#define STATE_WAIT           1000
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Levels within their range, counters never going back */
+static int
+check(struct pommed_state *s, struct pommed_state *prev)
+{
+  if ((s->lcd_level > s->lcd_max) || (s->kbd_level > s->kbd_max)
+      || (s->audio_level > s->audio_max))
+    return -1;
+
+  if ((s->updates < prev->updates) || (s->cd_ejects < prev->cd_ejects)
+      || (s->video_switches < prev->video_switches))
+    return -1;
+
+  return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct pommed_state s;
+  struct pommed_state prev;
+  uint64_t start;
+  uint64_t t;
+  uint64_t total;
+  uint64_t max;
+  int64_t seq;
+  int reads;
+  int bad;
+  int i;
+
+  for (i = 0; mbp_state_init() < 0; i++)
+    {
+      if (i == STATE_TIMEOUT * 10)
+	{
+	  fprintf(stderr, "state_bench: no state page from pommed\n");
+	  return 1;
+	}
+
+      usleep(100000);
+    }
+
+  seq = mbp_state_read(&prev);
+  if (seq < 0)
+    {
+      fprintf(stderr, "state_bench: pommed is gone\n");
+      return 1;
+    }
+
+  reads = 0;
+  bad = 0;
+  total = 0;
+  max = 0;
+
+  for (;;)
+    {
+      mbp_state_wait(seq, STATE_WAIT);
+
+      start = now_ns();
+      seq = mbp_state_read(&s);
+      t = now_ns() - start;
+
+      /* pommed exited */
+      if (seq < 0)
+	break;
+
+      reads++;
+      total += t;
+      if (t > max)
+	max = t;
+
+      if (check(&s, &prev) < 0)
+	{
+	  fprintf(stderr, "state_bench: inconsistent snapshot at update %llu\n",
+		  (unsigned long long)s.updates);
+	  bad++;
+	}
+
+      prev = s;
+    }
+
+  mbp_state_cleanup();
+
+  printf("State page: %d reads, %llu updates, read avg %.1f us, max %.1f us, %d inconsistent\n",
+	 reads, (unsigned long long)prev.updates,
+	 (reads > 0) ? (double)total / reads / 1000.0 : 0.0, max / 1000.0, bad);
+
+  return (bad == 0) ? 0 : 1;
+}
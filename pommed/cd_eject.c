@@ -20,54 +20,166 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <fcntl.h>
-#include <limits.h>
+#include <mntent.h>
+#include <sys/mount.h>
 
 #include <errno.h>
 
 #include <syslog.h>
 
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <linux/cdrom.h>
 
+#include <pthread.h>
+
 #include "pommed.h"
 #include "conffile.h"
+#include "evloop.h"
 #include "cd_eject.h"
 #include "dbus.h"
+#include "latency.h"
 
 
-void
-cd_eject(void)
+/* The drive can take seconds to answer (spin-up, mechanism), so
+ * the status check and the eject itself run on a short-lived thread.
+ * The thread signals completion through an eventfd watched by the
+ * main loop, which reaps it and reports the outcome.
+ */
+static struct
 {
-  char *eject_argv[3] = { "eject", eject_cfg.device, NULL };
-  char *eject_envp[1] = { NULL };
-  long max_fd;
-  int fd;
+  int efd;
+  pthread_t thread;
+  int running;
+
+  /* Filled in by the worker */
+  int opened;
+  int status;
   int ret;
+  int err;
 
-  if (!eject_cfg.enabled)
+  /* Last known drive status */
+  int last_status;
+  struct timespec last_probe;
+} cd = { .efd = -1 };
+
+
+/* Like eject(1), unmount the disc first; the drive refuses to
+ * eject a mounted disc.
+ */
+static void
+cd_eject_umount(void)
+{
+  FILE *fp;
+  struct mntent ent;
+  struct mntent *mnt;
+  char buf[1024];
+  char dev[PATH_MAX];
+  char fsname[PATH_MAX];
+
+  if (realpath(eject_cfg.device, dev) == NULL)
     return;
 
-  fd = open(eject_cfg.device, O_RDONLY | O_NONBLOCK);
+  fp = setmntent("/proc/self/mounts", "r");
+  if (fp == NULL)
+    return;
+
+  while ((mnt = getmntent_r(fp, &ent, buf, sizeof(buf))) != NULL)
+    {
+      if (mnt->mnt_fsname[0] != '/')
+	continue;
+
+      if (realpath(mnt->mnt_fsname, fsname) == NULL)
+	continue;
+
+      if (strcmp(dev, fsname) != 0)
+	continue;
+
+      if (umount2(mnt->mnt_dir, 0) < 0)
+	logmsg(LOG_WARNING, "Could not unmount %s: %s", mnt->mnt_dir, strerror(errno));
+    }
+
+  endmntent(fp);
+}
+
+static void *
+cd_eject_thread(void *arg)
+{
+  uint64_t val = 1;
+  int fd;
+
+  cd.opened = 0;
+  cd.status = -1;
+  cd.ret = -1;
+  cd.err = 0;
+
+  fd = open(eject_cfg.device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
   if (fd < 0)
     {
-      logmsg(LOG_ERR, "Could not open CD/DVD device: %s", strerror(errno));
+      cd.err = errno;
+      goto out;
+    }
 
-      return;
+  cd.opened = 1;
+
+  cd.status = ioctl(fd, CDROM_DRIVE_STATUS, CDSL_CURRENT);
+  cd.err = errno;
+
+  if ((cd.status == CDS_DISC_OK) || (cd.status == CDS_NO_INFO))
+    {
+      cd_eject_umount();
+
+      cd.ret = ioctl(fd, CDROMEJECT);
+      cd.err = errno;
     }
 
-  /* Check drive status */
-  ret = ioctl(fd, CDROM_DRIVE_STATUS);
   close(fd);
 
-  switch (ret)
+ out:
+  if (write(cd.efd, &val, sizeof(val)) != sizeof(val))
+    logmsg(LOG_ERR, "Could not signal CD eject completion: %s", strerror(errno));
+
+  return NULL;
+}
+
+static void
+cd_eject_done(int fd, uint32_t events)
+{
+  uint64_t val;
+
+  if (read(fd, &val, sizeof(val)) != sizeof(val))
+    return;
+
+  if (!cd.running)
+    return;
+
+  pthread_join(cd.thread, NULL);
+  cd.running = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &cd.last_probe);
+  cd.last_status = cd.status;
+
+  switch (cd.status)
     {
-      case CDS_NO_INFO: /* fall through to CDS_DISC_OK */
-	logmsg(LOG_INFO, "Driver does not support CDROM_DRIVE_STATUS, trying to eject anyway");
+      case -1:
+	if (!cd.opened)
+	  logmsg(LOG_ERR, "Could not open CD/DVD device: %s", strerror(cd.err));
+	else
+	  logmsg(LOG_INFO, "CDROM_DRIVE_STATUS failed: %s", strerror(cd.err));
+	return;
+
+      case CDS_NO_INFO:
+	logmsg(LOG_INFO, "Driver does not support CDROM_DRIVE_STATUS, tried to eject anyway");
+	break;
 
       case CDS_DISC_OK:
 	break;
@@ -85,42 +197,146 @@ cd_eject(void)
 	return;
 
       default:
-	logmsg(LOG_INFO, "CDROM_DRIVE_STATUS returned %d (%s)", ret, strerror(errno));
+	logmsg(LOG_INFO, "CDROM_DRIVE_STATUS returned %d (%s)", cd.status, strerror(cd.err));
 	return;
     }
 
-  ret = fork();
-  if (ret == 0) /* exec eject */
+  if (cd.ret < 0)
     {
-      max_fd = sysconf(_SC_OPEN_MAX);
+      logmsg(LOG_ERR, "Could not eject CD/DVD: %s", strerror(cd.err));
+
+      return;
+    }
 
-      if (max_fd > INT_MAX)
-	max_fd = INT_MAX;
+  cd.last_status = CDS_TRAY_OPEN;
 
-      for (fd = 3; fd < max_fd; fd++)
-	close(fd);
+  mbpdbus_send_cd_eject();
+}
 
-      execve("/usr/bin/eject", eject_argv, eject_envp);
 
-      logmsg(LOG_ERR, "Could not execute eject: %s", strerror(errno));
-      exit(1);
+void
+cd_eject(void)
+{
+  pthread_attr_t attr;
+  struct timespec now;
+  int ret;
+
+  if (!eject_cfg.enabled)
+    return;
+
+  if (cd.efd < 0)
+    return;
+
+  if (cd.running)
+    {
+      logdebug("CD eject already in progress\n");
+
+      return;
+    }
+
+  /* The drive was found empty very recently, don't wake it up again */
+  if ((cd.last_status == CDS_NO_DISC) || (cd.last_status == CDS_TRAY_OPEN))
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+
+      if ((now.tv_sec - cd.last_probe.tv_sec) * 1000
+	  + (now.tv_nsec - cd.last_probe.tv_nsec) / 1000000 < EJECT_STATUS_CACHE)
+	{
+	  logmsg(LOG_INFO, (cd.last_status == CDS_NO_DISC) ? "No disc in CD/DVD drive" : "Drive tray already open");
+
+	  return;
+	}
     }
-  else if (ret == -1)
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+  ret = pthread_create(&cd.thread, &attr, cd_eject_thread, NULL);
+
+  pthread_attr_destroy(&attr);
+
+  if (ret != 0)
     {
-      logmsg(LOG_ERR, "Could not fork: %s", strerror(errno));
+      logmsg(LOG_ERR, "Could not start CD eject thread: %s", strerror(ret));
+
       return;
     }
-  else
+
+  cd.running = 1;
+
+  /* The drive takes it from here */
+  latency_mark(LATENCY_EJECT, LATENCY_WRITE);
+}
+
+
+int
+cd_eject_init(void)
+{
+  int ret;
+
+  if (!eject_cfg.enabled)
+    return 0;
+
+  cd.running = 0;
+  cd.last_status = CDS_NO_INFO;
+
+  cd.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (cd.efd < 0)
+    {
+      logmsg(LOG_ERR, "Could not create CD eject eventfd: %s", strerror(errno));
+
+      return -1;
+    }
+
+  ret = evloop_add(cd.efd, EPOLLIN, cd_eject_done);
+  if (ret < 0)
     {
-      mbpdbus_send_cd_eject();
+      close(cd.efd);
+      cd.efd = -1;
+
+      return -1;
+    }
 
-      waitpid(ret, &ret, 0);
-      if ((WIFEXITED(ret) == 0) || (WEXITSTATUS(ret) != 0))
+  return 0;
+}
+
+void
+cd_eject_cleanup(void)
+{
+  struct pollfd pfd;
+  int ret;
+
+  if (cd.efd < 0)
+    return;
+
+  evloop_remove(cd.efd);
+
+  /* Don't leave the drive halfway through an eject, unless it's stuck */
+  if (cd.running)
+    {
+      pfd.fd = cd.efd;
+      pfd.events = POLLIN;
+
+      ret = poll(&pfd, 1, EJECT_EXIT_TIMEOUT);
+      if (ret <= 0)
 	{
-	  logmsg(LOG_INFO, "eject failed");
+	  logmsg(LOG_WARNING, "CD eject still in progress, not waiting for it");
+
+	  /* The thread still writes to the eventfd, leave it open */
+	  pthread_detach(cd.thread);
+	  cd.running = 0;
+	  cd.efd = -1;
+
 	  return;
 	}
+
+      pthread_join(cd.thread, NULL);
+      cd.running = 0;
     }
+
+  close(cd.efd);
+
+  cd.efd = -1;
 }
 
 
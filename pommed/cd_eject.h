@@ -5,10 +5,21 @@
 #ifndef __CD_EJECT_H__
 #define __CD_EJECT_H__
 
+/* Trust an empty drive status for this long (ms) */
+#define EJECT_STATUS_CACHE   2000
+/* Wait this long for an eject in progress on exit (ms) */
+#define EJECT_EXIT_TIMEOUT   2000
+
 
 void
 cd_eject(void);
 
+int
+cd_eject_init(void);
+
+void
+cd_eject_cleanup(void);
+
 void
 cd_eject_fix_config(void);
 
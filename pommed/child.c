@@ -0,0 +1,488 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2011 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* posix_spawn_file_actions_addclosefrom_np() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+
+#include <errno.h>
+
+#include <syslog.h>
+
+#include "pommed.h"
+#include "evloop.h"
+#include "child.h"
+
+
+extern char **environ;
+
+
+/* Children are reaped through a pidfd each when the kernel supports
+ * it (Linux 5.3), through a signalfd for SIGCHLD otherwise. Should
+ * watching a pidfd fail (out of fds), the child is polled instead.
+ */
+struct child
+{
+  pid_t pid;
+  int pidfd;
+  int timer;
+  char *name;
+
+  child_cb cb;
+  void *data;
+
+  struct child *next;
+};
+
+static struct child *children;
+static int sigchld_fd = -1;
+static int use_pidfd;
+static int poll_timer = -1;
+
+
+static int
+child_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+static void
+child_free(struct child *c)
+{
+  struct child *p;
+
+  if (children == c)
+    children = c->next;
+  else
+    {
+      for (p = children; p != NULL; p = p->next)
+	{
+	  if (p->next == c)
+	    {
+	      p->next = c->next;
+	      break;
+	    }
+	}
+    }
+
+  if (c->pidfd >= 0)
+    {
+      evloop_remove(c->pidfd);
+      close(c->pidfd);
+    }
+
+  if (c->timer > 0)
+    evloop_remove_timer(c->timer);
+
+  free(c->name);
+  free(c);
+}
+
+/* Returns 1 if the child has been reaped */
+static int
+child_reap(struct child *c)
+{
+  int status;
+  pid_t ret;
+
+  ret = waitpid(c->pid, &status, WNOHANG);
+  if (ret == 0)
+    return 0;
+
+  if (ret < 0)
+    {
+      logmsg(LOG_ERR, "Could not reap %s (%d): %s", c->name, c->pid, strerror(errno));
+
+      /* Report it as failed */
+      status = W_EXITCODE(127, 0);
+    }
+
+  if ((WIFEXITED(status) == 0) || (WEXITSTATUS(status) != 0))
+    logmsg(LOG_INFO, "%s failed", c->name);
+  else
+    logdebug("%s (%d) exited\n", c->name, c->pid);
+
+  if (c->cb != NULL)
+    c->cb(c->pid, status, c->data);
+
+  child_free(c);
+
+  return 1;
+}
+
+
+static void
+child_pidfd_process(int fd, uint32_t events)
+{
+  struct pommed_event *ev;
+  struct child *c;
+
+  ev = evloop_lookup(fd);
+  c = (ev != NULL) ? ev->data : NULL;
+
+  if (c == NULL)
+    {
+      /* Should not happen */
+      evloop_remove(fd);
+      close(fd);
+
+      return;
+    }
+
+  child_reap(c);
+}
+
+static void
+child_sigchld_process(int fd, uint32_t events)
+{
+  struct signalfd_siginfo si;
+  struct child *c;
+  struct child *next;
+  int ret;
+
+  /* Drain the signalfd; SIGCHLD coalesces, so check every child */
+  do
+    {
+      ret = read(fd, &si, sizeof(si));
+    }
+  while (ret == sizeof(si));
+
+  for (c = children; c != NULL; c = next)
+    {
+      next = c->next;
+
+      child_reap(c);
+    }
+}
+
+/* Reaps the children without a pidfd, in pidfd mode */
+static void
+child_poll(int id, uint64_t ticks)
+{
+  struct child *c;
+  struct child *next;
+
+  for (c = children; c != NULL; c = next)
+    {
+      next = c->next;
+
+      if (c->pidfd < 0)
+	child_reap(c);
+    }
+
+  /* The callbacks may have spawned more children */
+  for (c = children; c != NULL; c = c->next)
+    {
+      if (c->pidfd < 0)
+	return;
+    }
+
+  evloop_remove_timer(poll_timer);
+  poll_timer = -1;
+}
+
+static void
+child_timeout(int id, uint64_t ticks)
+{
+  struct child *c;
+
+  for (c = children; c != NULL; c = c->next)
+    {
+      if (c->timer == id)
+	break;
+    }
+
+  if (c == NULL)
+    return;
+
+  /* One-shot timer, gone now */
+  c->timer = -1;
+
+  logmsg(LOG_WARNING, "%s (%d) timed out, killing it", c->name, c->pid);
+
+  kill(c->pid, SIGKILL);
+}
+
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+static int
+child_exec(char *const argv[], char *const envp[], int flags, pid_t *pid)
+{
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_t fa;
+  sigset_t sigs;
+  int ret;
+
+  posix_spawnattr_init(&attr);
+  posix_spawn_file_actions_init(&fa);
+
+  /* Clean signal state: nothing blocked (SIGCHLD may be, for the
+   * signalfd), default dispositions for what we might have changed
+   */
+  sigemptyset(&sigs);
+  posix_spawnattr_setsigmask(&attr, &sigs);
+
+  sigaddset(&sigs, SIGCHLD);
+  sigaddset(&sigs, SIGPIPE);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  /* Don't leak our fds to the child */
+  posix_spawn_file_actions_addclosefrom_np(&fa, 3);
+
+  if (flags & CHILD_PATH)
+    ret = posix_spawnp(pid, argv[0], &fa, &attr, argv, envp);
+  else
+    ret = posix_spawn(pid, argv[0], &fa, &attr, argv, envp);
+
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+
+  return ret;
+}
+
+#else
+
+/* No closefrom file action, fall back to vfork() */
+static int
+child_exec(char *const argv[], char *const envp[], int flags, pid_t *pid)
+{
+  sigset_t sigs;
+  long max_fd;
+  int fd;
+
+  *pid = vfork();
+  if (*pid < 0)
+    return errno;
+
+  if (*pid > 0)
+    return 0;
+
+  /* Child; only async-signal-safe calls from here on */
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  sigemptyset(&sigs);
+  sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+#endif
+    {
+      max_fd = sysconf(_SC_OPEN_MAX);
+
+      if (max_fd > INT_MAX)
+	max_fd = INT_MAX;
+
+      for (fd = 3; fd < max_fd; fd++)
+	close(fd);
+    }
+
+  if (flags & CHILD_PATH)
+    execvpe(argv[0], argv, envp);
+  else
+    execve(argv[0], argv, envp);
+
+  _exit(127);
+}
+#endif
+
+
+/* Spawn a command without waiting for it; the child is reaped from
+ * the event loop and cb, if any, is called with its exit status.
+ * If timeout (ms) is > 0, the child is killed when it expires.
+ */
+pid_t
+child_spawn(char *const argv[], char *const envp[], int flags, int timeout, child_cb cb, void *data)
+{
+  struct child *c;
+  pid_t pid;
+  int ret;
+
+  c = (struct child *) malloc(sizeof(struct child));
+  if (c == NULL)
+    {
+      logmsg(LOG_ERR, "Could not allocate memory for child process");
+
+      return -1;
+    }
+
+  c->name = strdup(argv[0]);
+  if (c->name == NULL)
+    {
+      logmsg(LOG_ERR, "Could not allocate memory for child process");
+
+      free(c);
+      return -1;
+    }
+
+  c->pidfd = -1;
+  c->timer = -1;
+  c->cb = cb;
+  c->data = data;
+
+  if (envp == NULL)
+    envp = environ;
+
+  ret = child_exec(argv, envp, flags, &pid);
+
+  if (ret != 0)
+    {
+      logmsg(LOG_ERR, "Could not execute %s: %s", argv[0], strerror(ret));
+
+      free(c->name);
+      free(c);
+      return -1;
+    }
+
+  c->pid = pid;
+
+  c->next = children;
+  children = c;
+
+  if (use_pidfd)
+    {
+      c->pidfd = child_pidfd_open(pid);
+
+      if ((c->pidfd < 0) || (evloop_add(c->pidfd, EPOLLIN, child_pidfd_process) < 0))
+	{
+	  logmsg(LOG_WARNING, "Could not watch %s (%d), polling it", c->name, pid);
+
+	  if (c->pidfd >= 0)
+	    close(c->pidfd);
+	  c->pidfd = -1;
+
+	  /* Still reaped from the event loop, and killed on timeout */
+	  if (poll_timer < 0)
+	    {
+	      poll_timer = evloop_add_timer(CHILD_POLL_INTERVAL, child_poll);
+	      if (poll_timer < 0)
+		logmsg(LOG_ERR, "Could not poll %s (%d)", c->name, pid);
+	    }
+	}
+      else
+	evloop_lookup(c->pidfd)->data = c;
+    }
+
+  if (timeout > 0)
+    c->timer = evloop_add_oneshot_timer(timeout, child_timeout);
+
+  logdebug("Spawned %s (%d)\n", c->name, pid);
+
+  return pid;
+}
+
+
+int
+child_init(void)
+{
+  sigset_t sigs;
+  int fd;
+  int ret;
+
+  children = NULL;
+
+  fd = child_pidfd_open(getpid());
+  if (fd >= 0)
+    {
+      close(fd);
+
+      use_pidfd = 1;
+
+      return 0;
+    }
+
+  logdebug("pidfd not available, reaping children through signalfd\n");
+
+  use_pidfd = 0;
+
+  /* SIGCHLD must be blocked for signalfd to get it; threads
+   * created after this point inherit the mask
+   */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGCHLD);
+
+  ret = sigprocmask(SIG_BLOCK, &sigs, NULL);
+  if (ret < 0)
+    {
+      logmsg(LOG_ERR, "Could not block SIGCHLD: %s", strerror(errno));
+
+      return -1;
+    }
+
+  sigchld_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigchld_fd < 0)
+    {
+      logmsg(LOG_ERR, "Could not create signalfd: %s", strerror(errno));
+
+      return -1;
+    }
+
+  ret = evloop_add(sigchld_fd, EPOLLIN, child_sigchld_process);
+  if (ret < 0)
+    {
+      logmsg(LOG_ERR, "Could not add signalfd to event loop");
+
+      close(sigchld_fd);
+      sigchld_fd = -1;
+
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+child_cleanup(void)
+{
+  /* Children still running are left alone */
+  while (children != NULL)
+    child_free(children);
+
+  if (poll_timer > 0)
+    evloop_remove_timer(poll_timer);
+
+  poll_timer = -1;
+
+  /* sigchld_fd is closed by evloop_cleanup() */
+}
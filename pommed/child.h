@@ -0,0 +1,31 @@
+/*
+ * pommed - child.h
+ */
+
+#ifndef __CHILD_H__
+#define __CHILD_H__
+
+
+/* child_spawn() flags */
+#define CHILD_PATH          (1 << 0)  /* search PATH for the executable */
+
+/* Children we couldn't get a pidfd for are polled this often (ms) */
+#define CHILD_POLL_INTERVAL 100
+
+/* Called from the event loop once the child has been reaped;
+ * status is as returned by waitpid()
+ */
+typedef void(*child_cb)(pid_t pid, int status, void *data);
+
+
+pid_t
+child_spawn(char *const argv[], char *const envp[], int flags, int timeout, child_cb cb, void *data);
+
+int
+child_init(void);
+
+void
+child_cleanup(void);
+
+
+#endif /* !__CHILD_H__ */
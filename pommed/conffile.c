@@ -133,6 +133,9 @@ static cfg_opt_t song_opts[] =
     CFG_STR("playpause_cmd", "mpc toggle", CFGF_NONE),
     CFG_STR("next_cmd", "mpc next", CFGF_NONE),
     CFG_STR("prev_cmd", "mpc prev", CFGF_NONE),
+    CFG_BOOL("mpd", 0, CFGF_NONE),
+    CFG_STR("mpd_host", "localhost", CFGF_NONE),
+    CFG_INT("mpd_port", 6600, CFGF_NONE),
     CFG_END()
   };
 
@@ -254,6 +257,9 @@ config_print(void)
   printf("    playpause command: %s\n", song_cfg.playpause_cmd);
   printf("    next command: %s\n", song_cfg.next_cmd);
   printf("    prev command: %s\n", song_cfg.prev_cmd);
+  printf("    MPD client: %s\n", (song_cfg.mpd) ? "yes" : "no");
+  printf("    MPD host: %s\n", song_cfg.mpd_host);
+  printf("    MPD port: %d\n", song_cfg.mpd_port);
   printf(" + Beep:\n");
   printf("    enabled: %s\n", (beep_cfg.enabled) ? "yes" : "no");
   printf("    beepfile: %s\n", beep_cfg.beepfile);
@@ -315,6 +321,8 @@ config_load(void)
   cfg_set_validate_func(cfg, "song|playpause_cmd", config_validate_string);
   cfg_set_validate_func(cfg, "song|next_cmd", config_validate_string);
   cfg_set_validate_func(cfg, "song|prev_cmd", config_validate_string);
+  cfg_set_validate_func(cfg, "song|mpd_host", config_validate_string);
+  cfg_set_validate_func(cfg, "song|mpd_port", config_validate_positive_integer);
   /* beep */
   cfg_set_validate_func(cfg, "beep|beepfile", config_validate_string);
 
@@ -401,6 +409,9 @@ config_load(void)
   song_cfg.playpause_cmd = strdup(cfg_getstr(sec, "playpause_cmd"));
   song_cfg.next_cmd = strdup(cfg_getstr(sec, "next_cmd"));
   song_cfg.prev_cmd = strdup(cfg_getstr(sec, "prev_cmd"));
+  song_cfg.mpd = cfg_getbool(sec, "mpd");
+  song_cfg.mpd_host = strdup(cfg_getstr(sec, "mpd_host"));
+  song_cfg.mpd_port = cfg_getint(sec, "mpd_port");
   song_fix_config();
 
   sec = cfg_getsec(cfg, "beep");
@@ -434,7 +445,15 @@ config_cleanup(void)
 
   free(eject_cfg.device);
 
-  /* Free Song? */
+  free(song_cfg.playpause_cmd);
+  free(song_cfg.next_cmd);
+  free(song_cfg.prev_cmd);
+
+  free(song_cfg.playpause_argv);
+  free(song_cfg.next_argv);
+  free(song_cfg.prev_argv);
+
+  free(song_cfg.mpd_host);
 
   free(beep_cfg.beepfile);
 }
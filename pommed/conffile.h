@@ -67,6 +67,14 @@ struct _song_cfg {
   char *playpause_cmd;
   char *next_cmd;
   char *prev_cmd;
+  int mpd;
+  char *mpd_host;
+  int mpd_port;
+
+  /* Parsed by song_fix_config() */
+  char **playpause_argv;
+  char **next_argv;
+  char **prev_argv;
 };
 
 struct _beep_cfg {
@@ -21,6 +21,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
 
 #include <syslog.h>
 
@@ -37,29 +40,61 @@
 #include "audio.h"
 #include "video.h"
 #include "cd_eject.h"
+#include "dispatch.h"
+#include "state.h"
+#include "latency.h"
 
 
 static DBusError err;
+/* Bus connection, being set up or registered */
+static DBusConnection *bus_conn;
+/* Same connection, only once registered with our name */
 static DBusConnection *conn;
 
-static int dbus_timer;
+static int dbus_timer = -1;
+static int dbus_backoff;
 
 
-void
-mbpdbus_send_lcd_backlight(int cur, int prev, int who)
+/* Signals are queued on the connection without flushing; libdbus
+ * enables its write watch and the data goes out from the event loop.
+ *
+ * Level signals (LCD & keyboard backlight, ambient light, volume) come
+ * in bursts during fades and key repeats; updates made during a loop
+ * iteration are merged and sent once, at the end of the iteration,
+ * carrying the first previous value and the latest current value.
+ */
+static struct
+{
+  int pending;
+  int cur;
+  int prev;
+  int who;
+} lcd_sig, kbd_sig, audio_sig;
+
+static struct
+{
+  int pending;
+  int l;
+  int l_prev;
+  int r;
+  int r_prev;
+} ambient_sig;
+
+
+static void
+mbpdbus_send_signal(const char *name, int first_arg_type, ...)
 {
   DBusMessage *msg;
+  char path[64];
+  char iface[64];
+  va_list ap;
 
   int ret;
 
-  if (conn == NULL)
-    return;
-
-  logdebug("DBus lcdBacklight: %d %d\n", cur, prev);
+  snprintf(path, sizeof(path), "/org/pommed/notify/%s", name);
+  snprintf(iface, sizeof(iface), "org.pommed.signal.%s", name);
 
-  msg = dbus_message_new_signal("/org/pommed/notify/lcdBacklight",
-				"org.pommed.signal.lcdBacklight",
-				"lcdBacklight");
+  msg = dbus_message_new_signal(path, iface, name);
   if (msg == NULL)
     {
       logdebug("Failed to create DBus message\n");
@@ -67,12 +102,10 @@ mbpdbus_send_lcd_backlight(int cur, int prev, int who)
       return;
     }
 
-  ret = dbus_message_append_args(msg,
-				 DBUS_TYPE_UINT32, &cur,
-				 DBUS_TYPE_UINT32, &prev,
-				 DBUS_TYPE_UINT32, &lcd_bck_info.max,
-				 DBUS_TYPE_UINT32, &who,
-				 DBUS_TYPE_INVALID);
+  va_start(ap, first_arg_type);
+  ret = dbus_message_append_args_valist(msg, first_arg_type, ap);
+  va_end(ap);
+
   if (ret == FALSE)
     {
       logdebug("Failed to add arguments\n");
@@ -84,301 +117,229 @@ mbpdbus_send_lcd_backlight(int cur, int prev, int who)
 
   ret = dbus_connection_send(conn, msg, NULL);
   if (ret == FALSE)
-    {
-      logdebug("Could not send lcdBacklight signal\n");
-
-      dbus_message_unref(msg);
-
-      return;
-    }
-
-  dbus_connection_flush(conn);
+    logdebug("Could not send %s signal\n", name);
 
   dbus_message_unref(msg);
 }
 
-void
-mbpdbus_send_kbd_backlight(int cur, int prev, int who)
+static void
+mbpdbus_send_pending(void)
 {
-  DBusMessage *msg;
-
-  int ret;
-
   if (conn == NULL)
-    return;
-
-  logdebug("DBus kbdBacklight: %d %d\n", cur, prev);
-
-  msg = dbus_message_new_signal("/org/pommed/notify/kbdBacklight",
-				"org.pommed.signal.kbdBacklight",
-				"kbdBacklight");
-  if (msg == NULL)
     {
-      logdebug("Failed to create DBus message\n");
+      lcd_sig.pending = 0;
+      kbd_sig.pending = 0;
+      ambient_sig.pending = 0;
+      audio_sig.pending = 0;
 
       return;
     }
 
-  ret = dbus_message_append_args(msg,
-				 DBUS_TYPE_UINT32, &cur,
-				 DBUS_TYPE_UINT32, &prev,
-				 DBUS_TYPE_UINT32, &kbd_bck_info.max,
-				 DBUS_TYPE_UINT32, &who,
-				 DBUS_TYPE_INVALID);
-  if (ret == FALSE)
+  if (lcd_sig.pending)
     {
-      logdebug("Failed to add arguments\n");
-
-      dbus_message_unref(msg);
-
-      return;
-    }
+      logdebug("DBus lcdBacklight: %d %d\n", lcd_sig.cur, lcd_sig.prev);
 
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
-    {
-      logdebug("Could not send kbdBacklight signal\n");
+      mbpdbus_send_signal("lcdBacklight",
+			  DBUS_TYPE_UINT32, &lcd_sig.cur,
+			  DBUS_TYPE_UINT32, &lcd_sig.prev,
+			  DBUS_TYPE_UINT32, &lcd_bck_info.max,
+			  DBUS_TYPE_UINT32, &lcd_sig.who,
+			  DBUS_TYPE_INVALID);
 
-      dbus_message_unref(msg);
+      latency_mark(LATENCY_LCD_UP, LATENCY_SIGNAL);
+      latency_mark(LATENCY_LCD_DOWN, LATENCY_SIGNAL);
 
-      return;
+      lcd_sig.pending = 0;
     }
 
-  dbus_connection_flush(conn);
-
-  dbus_message_unref(msg);
-}
-
-void
-mbpdbus_send_ambient_light(int l, int l_prev, int r, int r_prev)
-{
-  DBusMessage *msg;
+  if (kbd_sig.pending)
+    {
+      logdebug("DBus kbdBacklight: %d %d\n", kbd_sig.cur, kbd_sig.prev);
 
-  int ret;
+      mbpdbus_send_signal("kbdBacklight",
+			  DBUS_TYPE_UINT32, &kbd_sig.cur,
+			  DBUS_TYPE_UINT32, &kbd_sig.prev,
+			  DBUS_TYPE_UINT32, &kbd_bck_info.max,
+			  DBUS_TYPE_UINT32, &kbd_sig.who,
+			  DBUS_TYPE_INVALID);
 
-  if (conn == NULL)
-    return;
+      latency_mark(LATENCY_KBD, LATENCY_SIGNAL);
 
-  logdebug("DBus ambientLight: %d %d %d %d\n", l, l_prev, r, r_prev);
+      kbd_sig.pending = 0;
+    }
 
-  msg = dbus_message_new_signal("/org/pommed/notify/ambientLight",
-				"org.pommed.signal.ambientLight",
-				"ambientLight");
-  if (msg == NULL)
+  if (ambient_sig.pending)
     {
-      logdebug("Failed to create DBus message\n");
-
-      return;
+      logdebug("DBus ambientLight: %d %d %d %d\n",
+	       ambient_sig.l, ambient_sig.l_prev, ambient_sig.r, ambient_sig.r_prev);
+
+      mbpdbus_send_signal("ambientLight",
+			  DBUS_TYPE_UINT32, &ambient_sig.l,
+			  DBUS_TYPE_UINT32, &ambient_sig.l_prev,
+			  DBUS_TYPE_UINT32, &ambient_sig.r,
+			  DBUS_TYPE_UINT32, &ambient_sig.r_prev,
+			  DBUS_TYPE_UINT32, &ambient_info.max,
+			  DBUS_TYPE_INVALID);
+
+      ambient_sig.pending = 0;
     }
 
-  ret = dbus_message_append_args(msg,
-				 DBUS_TYPE_UINT32, &l,
-				 DBUS_TYPE_UINT32, &l_prev,
-				 DBUS_TYPE_UINT32, &r,
-				 DBUS_TYPE_UINT32, &r_prev,
-				 DBUS_TYPE_UINT32, &ambient_info.max,
-				 DBUS_TYPE_INVALID);
-  if (ret == FALSE)
+  if (audio_sig.pending)
     {
-      logdebug("Failed to add arguments\n");
+      logdebug("DBus audioVolume: %d %d\n", audio_sig.cur, audio_sig.prev);
 
-      dbus_message_unref(msg);
+      mbpdbus_send_signal("audioVolume",
+			  DBUS_TYPE_UINT32, &audio_sig.cur,
+			  DBUS_TYPE_UINT32, &audio_sig.prev,
+			  DBUS_TYPE_UINT32, &audio_info.max,
+			  DBUS_TYPE_INVALID);
 
-      return;
+      latency_mark(LATENCY_VOLUME, LATENCY_SIGNAL);
+
+      audio_sig.pending = 0;
     }
+}
 
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
-    {
-      logdebug("Could not send kbdBacklight signal\n");
+static void
+mbpdbus_queue_pending(void)
+{
+  /* Can't defer (shouldn't happen); send right away */
+  if (evloop_defer(mbpdbus_send_pending) < 0)
+    mbpdbus_send_pending();
+}
 
-      dbus_message_unref(msg);
 
-      return;
-    }
+void
+mbpdbus_send_lcd_backlight(int cur, int prev, int who)
+{
+  state_update();
 
-  dbus_connection_flush(conn);
+  if (conn == NULL)
+    return;
 
-  dbus_message_unref(msg);
+  if (!lcd_sig.pending)
+    lcd_sig.prev = prev;
+
+  lcd_sig.cur = cur;
+  lcd_sig.who = who;
+  lcd_sig.pending = 1;
+
+  mbpdbus_queue_pending();
 }
 
 void
-mbpdbus_send_audio_volume(int cur, int prev)
+mbpdbus_send_kbd_backlight(int cur, int prev, int who)
 {
-  DBusMessage *msg;
-
-  int ret;
+  state_update();
 
   if (conn == NULL)
     return;
 
-  logdebug("DBus audioVolume: %d %d\n", cur, prev);
-
-  msg = dbus_message_new_signal("/org/pommed/notify/audioVolume",
-				"org.pommed.signal.audioVolume",
-				"audioVolume");
-  if (msg == NULL)
-    {
-      logdebug("Failed to create DBus message\n");
+  if (!kbd_sig.pending)
+    kbd_sig.prev = prev;
 
-      return;
-    }
+  kbd_sig.cur = cur;
+  kbd_sig.who = who;
+  kbd_sig.pending = 1;
 
-  ret = dbus_message_append_args(msg,
-				 DBUS_TYPE_UINT32, &cur,
-				 DBUS_TYPE_UINT32, &prev,
-				 DBUS_TYPE_UINT32, &audio_info.max,
-				 DBUS_TYPE_INVALID);
-  if (ret == FALSE)
-    {
-      logdebug("Failed to add arguments\n");
+  mbpdbus_queue_pending();
+}
 
-      dbus_message_unref(msg);
+void
+mbpdbus_send_ambient_light(int l, int l_prev, int r, int r_prev)
+{
+  state_update();
 
-      return;
-    }
+  if (conn == NULL)
+    return;
 
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
+  if (!ambient_sig.pending)
     {
-      logdebug("Could not send audioVolume signal\n");
-
-      dbus_message_unref(msg);
-
-      return;
+      ambient_sig.l_prev = l_prev;
+      ambient_sig.r_prev = r_prev;
     }
 
-  dbus_connection_flush(conn);
+  ambient_sig.l = l;
+  ambient_sig.r = r;
+  ambient_sig.pending = 1;
 
-  dbus_message_unref(msg);
+  mbpdbus_queue_pending();
 }
 
 void
-mbpdbus_send_audio_mute(int mute)
+mbpdbus_send_audio_volume(int cur, int prev)
 {
-  DBusMessage *msg;
-
-  int ret;
+  state_update();
 
   if (conn == NULL)
     return;
 
-  logdebug("DBus audioMute: %d\n", mute);
-
-  msg = dbus_message_new_signal("/org/pommed/notify/audioMute",
-				"org.pommed.signal.audioMute",
-				"audioMute");
-  if (msg == NULL)
-    {
-      logdebug("Failed to create DBus message\n");
-
-      return;
-    }
+  if (!audio_sig.pending)
+    audio_sig.prev = prev;
 
-  ret = dbus_message_append_args(msg,
-				 DBUS_TYPE_BOOLEAN, &mute,
-				 DBUS_TYPE_INVALID);
-  if (ret == FALSE)
-    {
-      logdebug("Failed to add arguments\n");
+  audio_sig.cur = cur;
+  audio_sig.pending = 1;
 
-      dbus_message_unref(msg);
+  mbpdbus_queue_pending();
+}
 
-      return;
-    }
+/* The remaining signals are events, not levels: they are never merged,
+ * but pending level updates go out first to keep the ordering.
+ */
+void
+mbpdbus_send_audio_mute(int mute)
+{
+  state_update();
 
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
-    {
-      logdebug("Could not send audioMute signal\n");
+  if (conn == NULL)
+    return;
 
-      dbus_message_unref(msg);
+  mbpdbus_send_pending();
 
-      return;
-    }
+  logdebug("DBus audioMute: %d\n", mute);
 
-  dbus_connection_flush(conn);
+  mbpdbus_send_signal("audioMute",
+		      DBUS_TYPE_BOOLEAN, &mute,
+		      DBUS_TYPE_INVALID);
 
-  dbus_message_unref(msg);
+  latency_mark(LATENCY_MUTE, LATENCY_SIGNAL);
 }
 
 void
 mbpdbus_send_cd_eject(void)
 {
-  DBusMessage *msg;
-
-  int ret;
+  state_event(STATE_CD_EJECT);
 
   if (conn == NULL)
     return;
 
-  logdebug("DBus CD eject\n");
-
-  msg = dbus_message_new_signal("/org/pommed/notify/cdEject",
-				"org.pommed.signal.cdEject",
-				"cdEject");
-  if (msg == NULL)
-    {
-      logdebug("Failed to create DBus message\n");
-
-      return;
-    }
-
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
-    {
-      logdebug("Could not send cdEject signal\n");
-
-      dbus_message_unref(msg);
+  mbpdbus_send_pending();
 
-      return;
-    }
+  logdebug("DBus CD eject\n");
 
-  dbus_connection_flush(conn);
+  mbpdbus_send_signal("cdEject", DBUS_TYPE_INVALID);
 
-  dbus_message_unref(msg);
+  latency_mark(LATENCY_EJECT, LATENCY_SIGNAL);
 }
 
 void
 mbpdbus_send_video_switch(void)
 {
-  DBusMessage *msg;
-
-  int ret;
+  state_event(STATE_VIDEO_SWITCH);
 
   if (conn == NULL)
     return;
 
-  logdebug("DBus video switch\n");
-
-  msg = dbus_message_new_signal("/org/pommed/notify/videoSwitch",
-				"org.pommed.signal.videoSwitch",
-				"videoSwitch");
-  if (msg == NULL)
-    {
-      logdebug("Failed to create DBus message\n");
-
-      return;
-    }
-
-  ret = dbus_connection_send(conn, msg, NULL);
-  if (ret == FALSE)
-    {
-      logdebug("Could not send videoSwitch signal\n");
-
-      dbus_message_unref(msg);
-
-      return;
-    }
+  mbpdbus_send_pending();
 
-  dbus_connection_flush(conn);
+  logdebug("DBus video switch\n");
 
-  dbus_message_unref(msg);
+  mbpdbus_send_signal("videoSwitch", DBUS_TYPE_INVALID);
 }
 
 
 static void
-process_lcd_getlevel_call(DBusMessage *req)
+process_lcd_getlevel_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
   DBusMessageIter args;
@@ -424,7 +385,7 @@ process_lcd_getlevel_call(DBusMessage *req)
 
 
 static void
-process_kbd_getlevel_call(DBusMessage *req)
+process_kbd_getlevel_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
   DBusMessageIter args;
@@ -470,7 +431,7 @@ process_kbd_getlevel_call(DBusMessage *req)
 
 
 static void
-process_ambient_getlevel_call(DBusMessage *req)
+process_ambient_getlevel_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
   DBusMessageIter args;
@@ -516,7 +477,7 @@ process_ambient_getlevel_call(DBusMessage *req)
 }
 
 static void
-process_audio_getvolume_call(DBusMessage *req)
+process_audio_getvolume_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
   DBusMessageIter args;
@@ -561,7 +522,7 @@ process_audio_getvolume_call(DBusMessage *req)
 }
 
 static void
-process_audio_getmute_call(DBusMessage *req)
+process_audio_getmute_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
   DBusMessageIter args;
@@ -605,7 +566,7 @@ process_audio_getmute_call(DBusMessage *req)
 }
 
 static void
-process_video_getvtstate_call(DBusMessage *req)
+process_video_getvtstate_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
 
@@ -654,52 +615,53 @@ process_video_getvtstate_call(DBusMessage *req)
 }
 
 
+/* All the levels in one go, so clients can initialize with a single
+ * round trip. Same order and types as the individual getters.
+ */
 static void
-process_lcd_backlight_step_call(DBusMessage *req, int dir)
+process_get_state_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
+  DBusMessageIter args;
 
   int ret;
 
-  logdebug("Got lcdBacklight levelUp/levelDown call\n");
+  logdebug("Got getState call\n");
+
+  if (dbus_message_iter_init(req, &args))
+    {
+      logdebug("getState call with arguments ?!\n");
 
-  mops->lcd_backlight_step(dir);
+      return;
+    }
 
   msg = dbus_message_new_method_return(req);
 
-  ret = dbus_connection_send(conn, msg, NULL);
+  ret = dbus_message_append_args(msg,
+				 DBUS_TYPE_UINT32, &lcd_bck_info.level,
+				 DBUS_TYPE_UINT32, &lcd_bck_info.max,
+				 DBUS_TYPE_UINT32, &kbd_bck_info.level,
+				 DBUS_TYPE_UINT32, &kbd_bck_info.max,
+				 DBUS_TYPE_UINT32, &ambient_info.left,
+				 DBUS_TYPE_UINT32, &ambient_info.right,
+				 DBUS_TYPE_UINT32, &ambient_info.max,
+				 DBUS_TYPE_UINT32, &audio_info.level,
+				 DBUS_TYPE_UINT32, &audio_info.max,
+				 DBUS_TYPE_BOOLEAN, &audio_info.muted,
+				 DBUS_TYPE_INVALID);
   if (ret == FALSE)
     {
-      logdebug("Could not send lcdBacklight levelUp/levelDown reply\n");
+      logdebug("Failed to add arguments\n");
 
       dbus_message_unref(msg);
 
       return;
     }
 
-  dbus_message_unref(msg);
-}
-
-static void
-process_kbd_backlight_inhibit_call(DBusMessage *req, int inhibit)
-{
-  DBusMessage *msg;
-
-  int ret;
-
-  logdebug("Got kbdBacklight inhibit call\n");
-
-  if (inhibit)
-    kbd_backlight_inhibit_set(KBD_INHIBIT_USER);
-  else
-    kbd_backlight_inhibit_clear(KBD_INHIBIT_USER);
-
-  msg = dbus_message_new_method_return(req);
-
   ret = dbus_connection_send(conn, msg, NULL);
   if (ret == FALSE)
     {
-      logdebug("Could not send kbdBacklight inhibit reply\n");
+      logdebug("Could not send getState reply\n");
 
       dbus_message_unref(msg);
 
@@ -709,10 +671,297 @@ process_kbd_backlight_inhibit_call(DBusMessage *req, int inhibit)
   dbus_message_unref(msg);
 }
 
-static void
-process_audio_volume_step_call(DBusMessage *req, int dir)
+
+/* Appends an ARRAY of (name, calls, total us, max us, histogram)
+ * STRUCTs, skipping the entries never hit; see evloop.h for the
+ * histogram buckets.
+ */
+static int
+process_append_stats(DBusMessageIter *args, const struct evloop_stat *stats, int n)
 {
-  DBusMessage *msg;
+  DBusMessageIter array;
+  DBusMessageIter entry;
+  DBusMessageIter hist;
+
+  const uint32_t *buckets;
+  uint64_t total;
+  uint64_t max;
+  int i;
+
+  int ret;
+
+  ret = dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY, "(stttau)", &array);
+
+  for (i = 0; ret && (i < n); i++)
+    {
+      if (stats[i].calls == 0)
+	continue;
+
+      total = stats[i].total / 1000;
+      max = stats[i].max / 1000;
+      buckets = stats[i].hist;
+
+      ret &= dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+
+      ret &= dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &stats[i].name);
+      ret &= dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &stats[i].calls);
+      ret &= dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &total);
+      ret &= dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &max);
+
+      ret &= dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY, "u", &hist);
+      ret &= dbus_message_iter_append_fixed_array(&hist, DBUS_TYPE_UINT32, &buckets, EVLOOP_HIST_BUCKETS);
+      ret &= dbus_message_iter_close_container(&entry, &hist);
+
+      ret &= dbus_message_iter_close_container(&array, &entry);
+    }
+
+  ret &= dbus_message_iter_close_container(args, &array);
+
+  return ret;
+}
+
+/* Event loop statistics: enabled (BOOLEAN), wakeups, timer wakeups,
+ * events, longest iteration in us (UINT64), then the per-callback
+ * statistics and the key-to-action latencies, see process_append_stats().
+ * Only the counters are meaningful unless pommed runs with -s.
+ */
+static void
+process_get_stats_call(DBusMessage *req, int arg)
+{
+  DBusMessage *msg;
+  DBusMessageIter args;
+
+  struct evloop_counters c;
+  const struct evloop_stat *stats;
+  dbus_bool_t enabled;
+  uint64_t stall;
+  int n;
+
+  int ret;
+
+  logdebug("Got getStats call\n");
+
+  if (dbus_message_iter_init(req, &args))
+    {
+      logdebug("getStats call with arguments ?!\n");
+
+      return;
+    }
+
+  evloop_get_counters(&c);
+  n = evloop_get_stats(&stats);
+
+  enabled = evloop_stats_enabled();
+  stall = c.max_stall / 1000;
+
+  msg = dbus_message_new_method_return(req);
+
+  dbus_message_iter_init_append(msg, &args);
+
+  ret = dbus_message_iter_append_basic(&args, DBUS_TYPE_BOOLEAN, &enabled);
+  ret &= dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT64, &c.wakeups);
+  ret &= dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT64, &c.timer_wakeups);
+  ret &= dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT64, &c.events);
+  ret &= dbus_message_iter_append_basic(&args, DBUS_TYPE_UINT64, &stall);
+
+  if (ret)
+    ret = process_append_stats(&args, stats, n);
+
+  if (ret)
+    {
+      n = latency_get_stats(&stats);
+      ret = process_append_stats(&args, stats, n);
+    }
+
+  if (ret == FALSE)
+    {
+      logdebug("Failed to add arguments\n");
+
+      dbus_message_unref(msg);
+
+      return;
+    }
+
+  ret = dbus_connection_send(conn, msg, NULL);
+  if (ret == FALSE)
+    {
+      logdebug("Could not send getStats reply\n");
+
+      dbus_message_unref(msg);
+
+      return;
+    }
+
+  dbus_message_unref(msg);
+}
+
+
+/* Arguments of the absolute setters: UINT32 value [, UINT32 fade_ms] */
+static int
+process_set_args(DBusMessage *req, int *val, int *length)
+{
+  DBusMessageIter iter;
+  dbus_uint32_t arg;
+
+  *length = 0;
+
+  if (!dbus_message_iter_init(req, &iter))
+    return -1;
+
+  if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
+    return -1;
+
+  dbus_message_iter_get_basic(&iter, &arg);
+  *val = (arg > INT_MAX) ? INT_MAX : arg;
+
+  if (!dbus_message_iter_next(&iter))
+    return 0;
+
+  if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
+    return -1;
+
+  dbus_message_iter_get_basic(&iter, &arg);
+  *length = (arg > INT_MAX) ? INT_MAX : arg;
+
+  return 0;
+}
+
+static void
+process_set_reply(DBusMessage *req, const char *what)
+{
+  DBusMessage *msg;
+
+  int ret;
+
+  msg = dbus_message_new_method_return(req);
+
+  ret = dbus_connection_send(conn, msg, NULL);
+  if (ret == FALSE)
+    logdebug("Could not send %s reply\n", what);
+
+  dbus_message_unref(msg);
+}
+
+static void
+process_lcd_backlight_set_call(DBusMessage *req, int arg)
+{
+  int val;
+  int length;
+
+  logdebug("Got lcdBacklight setLevel call\n");
+
+  if (process_set_args(req, &val, &length) < 0)
+    {
+      logdebug("lcdBacklight setLevel call with no/inappropriate arguments ?!\n");
+
+      return;
+    }
+
+  lcd_backlight_set_level(val, length);
+
+  process_set_reply(req, "lcdBacklight setLevel");
+}
+
+static void
+process_kbd_backlight_set_call(DBusMessage *req, int arg)
+{
+  int val;
+  int length;
+
+  logdebug("Got kbdBacklight setLevel call\n");
+
+  if (process_set_args(req, &val, &length) < 0)
+    {
+      logdebug("kbdBacklight setLevel call with no/inappropriate arguments ?!\n");
+
+      return;
+    }
+
+  kbd_backlight_set_level(val, length);
+
+  process_set_reply(req, "kbdBacklight setLevel");
+}
+
+static void
+process_audio_set_volume_call(DBusMessage *req, int arg)
+{
+  int val;
+  int length;
+
+  logdebug("Got audio setVolume call\n");
+
+  if (process_set_args(req, &val, &length) < 0)
+    {
+      logdebug("audio setVolume call with no/inappropriate arguments ?!\n");
+
+      return;
+    }
+
+  audio_set_volume(val, length);
+
+  process_set_reply(req, "audio setVolume");
+}
+
+
+static void
+process_lcd_backlight_step_call(DBusMessage *req, int dir)
+{
+  DBusMessage *msg;
+
+  int ret;
+
+  logdebug("Got lcdBacklight levelUp/levelDown call\n");
+
+  lcd_backlight_step(dir);
+
+  msg = dbus_message_new_method_return(req);
+
+  ret = dbus_connection_send(conn, msg, NULL);
+  if (ret == FALSE)
+    {
+      logdebug("Could not send lcdBacklight levelUp/levelDown reply\n");
+
+      dbus_message_unref(msg);
+
+      return;
+    }
+
+  dbus_message_unref(msg);
+}
+
+static void
+process_kbd_backlight_inhibit_call(DBusMessage *req, int inhibit)
+{
+  DBusMessage *msg;
+
+  int ret;
+
+  logdebug("Got kbdBacklight inhibit call\n");
+
+  if (inhibit)
+    kbd_backlight_inhibit_set(KBD_INHIBIT_USER);
+  else
+    kbd_backlight_inhibit_clear(KBD_INHIBIT_USER);
+
+  msg = dbus_message_new_method_return(req);
+
+  ret = dbus_connection_send(conn, msg, NULL);
+  if (ret == FALSE)
+    {
+      logdebug("Could not send kbdBacklight inhibit reply\n");
+
+      dbus_message_unref(msg);
+
+      return;
+    }
+
+  dbus_message_unref(msg);
+}
+
+static void
+process_audio_volume_step_call(DBusMessage *req, int dir)
+{
+  DBusMessage *msg;
 
   int ret;
 
@@ -736,7 +985,7 @@ process_audio_volume_step_call(DBusMessage *req, int dir)
 }
 
 static void
-process_audio_toggle_mute_call(DBusMessage *req)
+process_audio_toggle_mute_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
 
@@ -762,7 +1011,7 @@ process_audio_toggle_mute_call(DBusMessage *req)
 }
 
 static void
-process_cd_eject_call(DBusMessage *req)
+process_cd_eject_call(DBusMessage *req, int arg)
 {
   DBusMessage *msg;
 
@@ -789,60 +1038,98 @@ process_cd_eject_call(DBusMessage *req)
 
 
 static void
-mbpdbus_reconnect(int id, uint64_t ticks)
+mbpdbus_connection_lost(void);
+
+/* Methods, per subsystem */
+static struct dispatch_method pommed_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed", "getState", process_get_state_call, 0),
+    DISPATCH_METHOD("org.pommed", "getStats", process_get_stats_call, 0),
+  };
+
+static struct dispatch_method lcd_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.lcdBacklight", "getLevel", process_lcd_getlevel_call, 0),
+    DISPATCH_METHOD("org.pommed.lcdBacklight", "levelUp", process_lcd_backlight_step_call, STEP_UP),
+    DISPATCH_METHOD("org.pommed.lcdBacklight", "levelDown", process_lcd_backlight_step_call, STEP_DOWN),
+    DISPATCH_METHOD("org.pommed.lcdBacklight", "setLevel", process_lcd_backlight_set_call, 0),
+  };
+
+static struct dispatch_method kbd_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.kbdBacklight", "getLevel", process_kbd_getlevel_call, 0),
+    DISPATCH_METHOD("org.pommed.kbdBacklight", "inhibit", process_kbd_backlight_inhibit_call, 1),
+    DISPATCH_METHOD("org.pommed.kbdBacklight", "disinhibit", process_kbd_backlight_inhibit_call, 0),
+    DISPATCH_METHOD("org.pommed.kbdBacklight", "setLevel", process_kbd_backlight_set_call, 0),
+  };
+
+static struct dispatch_method ambient_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.ambient", "getLevel", process_ambient_getlevel_call, 0),
+  };
+
+static struct dispatch_method audio_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.audio", "getVolume", process_audio_getvolume_call, 0),
+    DISPATCH_METHOD("org.pommed.audio", "getMute", process_audio_getmute_call, 0),
+    DISPATCH_METHOD("org.pommed.audio", "volumeUp", process_audio_volume_step_call, STEP_UP),
+    DISPATCH_METHOD("org.pommed.audio", "volumeDown", process_audio_volume_step_call, STEP_DOWN),
+    DISPATCH_METHOD("org.pommed.audio", "setVolume", process_audio_set_volume_call, 0),
+    DISPATCH_METHOD("org.pommed.audio", "toggleMute", process_audio_toggle_mute_call, 0),
+  };
+
+static struct dispatch_method video_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.video", "getVTState", process_video_getvtstate_call, 0),
+  };
+
+static struct dispatch_method cd_methods[] =
+  {
+    DISPATCH_METHOD("org.pommed.cd", "eject", process_cd_eject_call, 0),
+  };
+
+#define REGISTER_METHODS(m)  dispatch_register(m, sizeof(m) / sizeof(*m))
+
+static void
+mbpdbus_register_methods(void)
 {
-  int ret;
+  static int registered;
 
-  ret = mbpdbus_init();
-  if (ret == 0)
-    {
-      evloop_remove_timer(id);
-      dbus_timer = -1;
-    }
+  if (registered)
+    return;
+
+  REGISTER_METHODS(pommed_methods);
+  REGISTER_METHODS(lcd_methods);
+  REGISTER_METHODS(kbd_methods);
+  REGISTER_METHODS(ambient_methods);
+  REGISTER_METHODS(audio_methods);
+  REGISTER_METHODS(video_methods);
+  REGISTER_METHODS(cd_methods);
+
+  registered = 1;
 }
 
+
 static DBusHandlerResult
 mbpdbus_process_requests(DBusConnection *lconn, DBusMessage *msg, void *data)
 {
-  // Get methods
-  if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "getLevel"))
-    process_lcd_getlevel_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "getLevel"))
-    process_kbd_getlevel_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.ambient", "getLevel"))
-    process_ambient_getlevel_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "getVolume"))
-    process_audio_getvolume_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "getMute"))
-    process_audio_getmute_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.video", "getVTState"))
-    process_video_getvtstate_call(msg);
-  // Set methods
-  else if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "levelUp"))
-    process_lcd_backlight_step_call(msg, STEP_UP);
-  else if (dbus_message_is_method_call(msg, "org.pommed.lcdBacklight", "levelDown"))
-    process_lcd_backlight_step_call(msg, STEP_DOWN);
-  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "inhibit"))
-    process_kbd_backlight_inhibit_call(msg, 1);
-  else if (dbus_message_is_method_call(msg, "org.pommed.kbdBacklight", "disinhibit"))
-    process_kbd_backlight_inhibit_call(msg, 0);
-  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "volumeUp"))
-    process_audio_volume_step_call(msg, STEP_UP);
-  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "volumeDown"))
-    process_audio_volume_step_call(msg, STEP_DOWN);
-  else if (dbus_message_is_method_call(msg, "org.pommed.audio", "toggleMute"))
-    process_audio_toggle_mute_call(msg);
-  else if (dbus_message_is_method_call(msg, "org.pommed.cd", "eject"))
-    process_cd_eject_call(msg);
+  struct dispatch_method *m;
+
+  if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      m = dispatch_lookup(dbus_message_get_interface(msg), dbus_message_get_member(msg));
+      if (m == NULL)
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      m->cb(msg, m->arg);
+    }
   else if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
     {
       logmsg(LOG_INFO, "DBus disconnected");
 
-      mbpdbus_cleanup();
-
-      dbus_timer = evloop_add_timer(DBUS_TIMEOUT, mbpdbus_reconnect);
-      if (dbus_timer < 0)
-	logmsg(LOG_WARNING, "Could not set up timer for DBus reconnection");
+      /* Not from within libdbus */
+      if (evloop_defer(mbpdbus_connection_lost) < 0)
+	logmsg(LOG_ERR, "Could not schedule DBus reconnection");
     }
   else
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -862,8 +1149,36 @@ struct pommed_watch
   struct pommed_watch *next;
 };
 
+/* libdbus uses at most one watch for reading and one for writing */
+#define MAX_FD_WATCHES  4
 
-static struct pommed_watch *watches;
+/* DBusTimeouts, backed by evloop timers while enabled */
+struct pommed_timeout
+{
+  DBusTimeout *timeout;
+  int timer;
+
+  struct pommed_timeout *next;
+};
+
+
+static struct pommed_timeout *timeouts;
+
+
+static void
+mbpdbus_dispatch(void)
+{
+  DBusDispatchStatus ds;
+
+  if (bus_conn == NULL)
+    return;
+
+  do
+    {
+      ds = dbus_connection_dispatch(bus_conn);
+    }
+  while (ds == DBUS_DISPATCH_DATA_REMAINS);
+}
 
 
 static uint32_t
@@ -904,80 +1219,98 @@ epoll_to_dbus(uint32_t events)
   return flags;
 }
 
+/* The watches on an fd (libdbus uses one for reading, one for writing)
+ * hang off its evloop source
+ */
+static struct pommed_watch *
+mbpdbus_fd_watches(int fd)
+{
+  struct pommed_event *ev;
+
+  ev = evloop_lookup(fd);
+  if (ev == NULL)
+    return NULL;
+
+  return ev->data;
+}
+
+/* Poll fd for what its enabled watches want, park it if none */
+static int
+mbpdbus_update_fd(int fd)
+{
+  uint32_t events;
+
+  struct pommed_watch *w;
+
+  events = 0;
+  for (w = mbpdbus_fd_watches(fd); w != NULL; w = w->next)
+    {
+      if (w->enabled)
+	events |= w->events;
+    }
+
+  return evloop_modify(fd, events);
+}
+
 static void
 mbpdbus_process_watch(int fd, uint32_t events)
 {
-  int flags;
+  DBusWatch *ready[MAX_FD_WATCHES];
+  int flags[MAX_FD_WATCHES];
   uint32_t wanted;
-
-  DBusDispatchStatus ds;
+  int n;
+  int i;
 
   struct pommed_watch *w;
 
   logdebug("DBus process watch\n");
 
-  for (w = watches; w != NULL; w = w->next)
+  n = 0;
+  for (w = mbpdbus_fd_watches(fd); (w != NULL) && (n < MAX_FD_WATCHES); w = w->next)
     {
       if (!w->enabled)
 	continue;
 
-      if (w->fd == fd)
+      wanted = events & w->events;
+      if (wanted == 0)
+	continue;
+
+      ready[n] = w->watch;
+      flags[n] = epoll_to_dbus(wanted);
+      n++;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      /* DBus may have removed or disabled it while handling the others */
+      for (w = mbpdbus_fd_watches(fd); w != NULL; w = w->next)
 	{
-	  wanted = events & w->events;
-
-	  if (wanted != 0)
-	    {
-	      flags = epoll_to_dbus(wanted);
-
-	      dbus_watch_handle(w->watch, flags);
-
-	      do
-		{
-		  ds = dbus_connection_dispatch(conn);
-		}
-	      while (ds == DBUS_DISPATCH_DATA_REMAINS);
-
-	      /* Get out of the loop, as DBus will remove the watches
-	       * and our linked list can become invalid under our feet
-	       */
-	      if (events & (EPOLLERR | EPOLLHUP))
-		break;
-	    }
+	  if (w->watch == ready[i])
+	    break;
 	}
+
+      if ((w == NULL) || !w->enabled)
+	continue;
+
+      dbus_watch_handle(ready[i], flags[i]);
     }
+
+  mbpdbus_dispatch();
 }
 
 static dbus_bool_t
 mbpdbus_add_watch(DBusWatch *watch, void *data)
 {
-  uint32_t events;
   int fd;
   int ret;
 
+  struct pommed_event *ev;
   struct pommed_watch *w;
 
   logdebug("DBus add watch\n");
 
   fd = dbus_watch_get_unix_fd(watch);
 
-  events = 0;
-  for (w = watches; w != NULL; w = w->next)
-    {
-      if (w->enabled && (w->fd == fd))
-	events |= w->events;
-    }
-
-  if (events != 0)
-    {
-      ret = evloop_remove(fd);
-      if (ret < 0)
-	{
-	  logmsg(LOG_ERR, "Could not remove previous watch on same fd");
-
-	  return FALSE;
-	}
-    }
-
   w = (struct pommed_watch *)malloc(sizeof(struct pommed_watch));
   if (w == NULL)
     {
@@ -988,115 +1321,227 @@ mbpdbus_add_watch(DBusWatch *watch, void *data)
 
   w->watch = watch;
   w->fd = fd;
-  w->enabled = 1;
+  w->enabled = dbus_watch_get_enabled(watch);
 
   w->events = dbus_to_epoll(dbus_watch_get_flags(watch));
   w->events |= EPOLLERR | EPOLLHUP;
 
-  events |= w->events;
+  ev = evloop_lookup(fd);
+  if (ev == NULL)
+    {
+      /* Parked until mbpdbus_update_fd() */
+      ret = evloop_add(fd, 0, mbpdbus_process_watch);
+      if (ret < 0)
+	{
+	  free(w);
+
+	  return FALSE;
+	}
+
+      ev = evloop_lookup(fd);
+    }
+
+  w->next = ev->data;
+  ev->data = w;
 
-  ret = evloop_add(fd, events, mbpdbus_process_watch);
+  ret = mbpdbus_update_fd(fd);
   if (ret < 0)
     {
+      ev->data = w->next;
       free(w);
 
+      if (ev->data == NULL)
+	evloop_remove(fd);
+
       return FALSE;
     }
 
-  w->next = watches;
-  watches = w;
-
   return TRUE;
 }
 
 static void
 mbpdbus_remove_watch(DBusWatch *watch, void *data)
 {
-  uint32_t events;
   int fd;
-  int ret;
 
+  struct pommed_event *ev;
   struct pommed_watch *w;
-  struct pommed_watch *p;
+  struct pommed_watch **p;
 
   logdebug("DBus remove watch %p\n", watch);
 
   fd = dbus_watch_get_unix_fd(watch);
-  events = 0;
 
-  for (p = NULL, w = watches; w != NULL; p = w, w = w->next)
+  ev = evloop_lookup(fd);
+  if (ev == NULL)
+    return;
+
+  for (p = (struct pommed_watch **)&ev->data; *p != NULL; p = &(*p)->next)
     {
-      if (w->watch == watch)
-	{
-	  if (p != NULL)
-	    p->next = w->next;
-	  else
-	    watches = w->next;
+      w = *p;
 
-	  free(w);
+      if (w->watch != watch)
+	continue;
 
-	  continue;
-	}
+      *p = w->next;
+      free(w);
 
-      if (w->enabled && (w->fd == fd))
-	events |= w->events;
+      break;
     }
 
-  ret = evloop_remove(fd);
-  if (ret < 0)
-    return;
-
-  if (events == 0)
-    return;
-
-  ret = evloop_add(fd, events, mbpdbus_process_watch);
-  if (ret < 0)
-    logmsg(LOG_WARNING, "Could not re-add watch");
+  if (ev->data == NULL)
+    evloop_remove(fd);
+  else if (mbpdbus_update_fd(fd) < 0)
+    logmsg(LOG_WARNING, "Could not update DBus watch");
 }
 
 static void
 mbpdbus_toggle_watch(DBusWatch *watch, void *data)
 {
-  uint32_t events;
   int fd;
-  int ret;
 
   struct pommed_watch *w;
 
   logdebug("DBus toggle watch\n");
 
   fd = dbus_watch_get_unix_fd(watch);
-  events = 0;
 
-  for (w = watches; w != NULL; w = w->next)
+  for (w = mbpdbus_fd_watches(fd); w != NULL; w = w->next)
     {
       if (w->watch == watch)
 	{
-	  if (!dbus_watch_get_enabled(watch))
-	    w->enabled = 0;
-	  else
-	    {
-	      w->enabled = 1;
-	      events |= w->events;
-	    }
-
-	  continue;
+	  w->enabled = dbus_watch_get_enabled(watch);
+	  break;
 	}
-
-      if (w->enabled && (w->fd == fd))
-	events |= events;
     }
 
-  ret = evloop_remove(fd);
-  if (ret < 0)
+  if (w == NULL)
     return;
 
-  if (events == 0)
+  if (mbpdbus_update_fd(fd) < 0)
+    logmsg(LOG_WARNING, "Could not update DBus watch");
+}
+
+static void
+mbpdbus_process_timeout(int id, uint64_t ticks)
+{
+  struct pommed_timeout *t;
+
+  logdebug("DBus process timeout\n");
+
+  for (t = timeouts; t != NULL; t = t->next)
+    {
+      if (t->timer == id)
+	break;
+    }
+
+  if (t == NULL)
     return;
 
-  ret = evloop_add(fd, events, mbpdbus_process_watch);
-  if (ret < 0)
-    logmsg(LOG_WARNING, "Could not re-add watch");
+  /* t may be gone once this returns */
+  dbus_timeout_handle(t->timeout);
+
+  mbpdbus_dispatch();
+}
+
+static int
+mbpdbus_arm_timeout(struct pommed_timeout *t)
+{
+  int interval;
+
+  if (t->timer > 0)
+    evloop_remove_timer(t->timer);
+
+  t->timer = -1;
+
+  if (!dbus_timeout_get_enabled(t->timeout))
+    return 0;
+
+  interval = dbus_timeout_get_interval(t->timeout);
+  if (interval < 1)
+    interval = 1;
+
+  t->timer = evloop_add_timer(interval, mbpdbus_process_timeout);
+
+  return t->timer;
+}
+
+static dbus_bool_t
+mbpdbus_add_timeout(DBusTimeout *timeout, void *data)
+{
+  struct pommed_timeout *t;
+
+  logdebug("DBus add timeout\n");
+
+  t = (struct pommed_timeout *)malloc(sizeof(struct pommed_timeout));
+  if (t == NULL)
+    {
+      logmsg(LOG_ERR, "Could not allocate memory for a new DBus timeout");
+
+      return FALSE;
+    }
+
+  t->timeout = timeout;
+  t->timer = -1;
+
+  if (mbpdbus_arm_timeout(t) < 0)
+    {
+      free(t);
+
+      return FALSE;
+    }
+
+  t->next = timeouts;
+  timeouts = t;
+
+  return TRUE;
+}
+
+static void
+mbpdbus_remove_timeout(DBusTimeout *timeout, void *data)
+{
+  struct pommed_timeout *t;
+  struct pommed_timeout *p;
+
+  logdebug("DBus remove timeout %p\n", timeout);
+
+  for (p = NULL, t = timeouts; t != NULL; p = t, t = t->next)
+    {
+      if (t->timeout != timeout)
+	continue;
+
+      if (p != NULL)
+	p->next = t->next;
+      else
+	timeouts = t->next;
+
+      if (t->timer > 0)
+	evloop_remove_timer(t->timer);
+
+      free(t);
+
+      return;
+    }
+}
+
+static void
+mbpdbus_toggle_timeout(DBusTimeout *timeout, void *data)
+{
+  struct pommed_timeout *t;
+
+  logdebug("DBus toggle timeout\n");
+
+  for (t = timeouts; t != NULL; t = t->next)
+    {
+      if (t->timeout != timeout)
+	continue;
+
+      /* The interval may have changed too */
+      if (mbpdbus_arm_timeout(t) < 0)
+	logmsg(LOG_WARNING, "Could not re-arm DBus timeout");
+
+      return;
+    }
 }
 
 static void
@@ -1106,71 +1551,240 @@ mbpdbus_data_free(void *data)
 }
 
 
-int
-mbpdbus_init(void)
+/* Connection setup
+ *
+ * Nothing blocks: the socket is opened, then Hello and RequestName are
+ * sent as asynchronous calls, driven by the watches and timeouts above.
+ * Only once we own our name is conn set and are signals sent. On
+ * failure or disconnection, we retry after DBUS_TIMEOUT ms, doubling
+ * up to DBUS_RECONNECT_MAX ms, with jitter so daemons don't all come
+ * back to a restarted bus at once.
+ */
+
+static void
+mbpdbus_disconnect(void)
 {
-  int ret;
+  conn = NULL;
 
-  watches = NULL;
-  dbus_timer = -1;
+  if (bus_conn == NULL)
+    return;
 
-  dbus_error_init(&err);
+  /* Private connection: close, then unref; the watches and timeouts
+   * are removed along the way
+   */
+  dbus_connection_close(bus_conn);
+  dbus_connection_unref(bus_conn);
 
-  conn = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
-  if (dbus_error_is_set(&err))
-    {
-      logmsg(LOG_ERR, "DBus system bus connection failed: %s", err.message);
+  bus_conn = NULL;
+}
 
-      dbus_error_free(&err);
+static void
+mbpdbus_reconnect(int id, uint64_t ticks);
+
+static void
+mbpdbus_schedule_reconnect(void)
+{
+  int delay;
+
+  if (dbus_timer > 0)
+    return;
+
+  /* Somewhere in [backoff / 2, backoff] */
+  delay = dbus_backoff / 2 + random() % (dbus_backoff / 2 + 1);
 
-      conn = NULL;
+  logdebug("DBus reconnection in %d ms\n", delay);
 
-      goto init_reconnect;
+  dbus_timer = evloop_add_oneshot_timer(delay, mbpdbus_reconnect);
+  if (dbus_timer < 0)
+    {
+      logmsg(LOG_ERR, "Could not set up timer for DBus reconnection");
+
+      return;
     }
 
-  dbus_connection_set_exit_on_disconnect(conn, FALSE);
+  dbus_backoff *= 2;
+  if (dbus_backoff > DBUS_RECONNECT_MAX)
+    dbus_backoff = DBUS_RECONNECT_MAX;
+}
 
-  ret = dbus_bus_request_name(conn, "org.pommed", 0, &err);
+static void
+mbpdbus_connection_lost(void)
+{
+  mbpdbus_disconnect();
 
-  if (dbus_error_is_set(&err))
+  mbpdbus_schedule_reconnect();
+}
+
+static DBusMessage *
+mbpdbus_steal_reply(DBusPendingCall *pending, const char *what)
+{
+  DBusMessage *reply;
+  DBusError lerr;
+
+  reply = dbus_pending_call_steal_reply(pending);
+  dbus_pending_call_unref(pending);
+
+  if (reply == NULL)
+    return NULL;
+
+  dbus_error_init(&lerr);
+
+  if (dbus_set_error_from_message(&lerr, reply))
     {
-      logmsg(LOG_ERR, "Failed to request DBus name: %s", err.message);
+      logmsg(LOG_ERR, "DBus %s failed: %s", what, lerr.message);
 
-      mbpdbus_cleanup();
+      dbus_error_free(&lerr);
+      dbus_message_unref(reply);
 
-      goto init_reconnect;
+      return NULL;
     }
 
-  if (ret != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  return reply;
+}
+
+static int
+mbpdbus_call_bus(DBusMessage *msg, DBusPendingCallNotifyFunction notify)
+{
+  DBusPendingCall *pending;
+  int ret;
+
+  if (msg == NULL)
+    return -1;
+
+  ret = dbus_connection_send_with_reply(bus_conn, msg, &pending, DBUS_CALL_TIMEOUT);
+  dbus_message_unref(msg);
+
+  if ((ret == FALSE) || (pending == NULL))
+    return -1;
+
+  /* Our reference is dropped by the notify function */
+  ret = dbus_pending_call_set_notify(pending, notify, NULL, NULL);
+  if (ret == FALSE)
+    {
+      dbus_pending_call_cancel(pending);
+      dbus_pending_call_unref(pending);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+mbpdbus_request_name_reply(DBusPendingCall *pending, void *data)
+{
+  DBusMessage *reply;
+  dbus_uint32_t owner;
+  int ret;
+
+  reply = mbpdbus_steal_reply(pending, "name request");
+  if (reply == NULL)
+    goto lost;
+
+  ret = dbus_message_get_args(reply, NULL, DBUS_TYPE_UINT32, &owner, DBUS_TYPE_INVALID);
+  dbus_message_unref(reply);
+
+  if (ret == FALSE)
+    goto lost;
+
+  if (owner != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
     {
       logmsg(LOG_ERR, "Not primary DBus name owner");
 
-      mbpdbus_cleanup();
+      goto lost;
+    }
+
+  logmsg(LOG_INFO, "Connected to DBus system bus");
 
-      goto init_reconnect;
+  conn = bus_conn;
+  dbus_backoff = DBUS_TIMEOUT;
+
+  return;
+
+ lost:
+  evloop_defer(mbpdbus_connection_lost);
+}
+
+static void
+mbpdbus_hello_reply(DBusPendingCall *pending, void *data)
+{
+  DBusMessage *reply;
+  DBusMessage *msg;
+  const char *name = "org.pommed";
+  dbus_uint32_t flags = 0;
+
+  reply = mbpdbus_steal_reply(pending, "Hello");
+  if (reply == NULL)
+    goto lost;
+
+  dbus_message_unref(reply);
+
+  msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+				     DBUS_INTERFACE_DBUS, "RequestName");
+  if ((msg != NULL)
+      && !dbus_message_append_args(msg,
+				   DBUS_TYPE_STRING, &name,
+				   DBUS_TYPE_UINT32, &flags,
+				   DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref(msg);
+      msg = NULL;
     }
 
-  ret = dbus_connection_set_watch_functions(conn, mbpdbus_add_watch, mbpdbus_remove_watch,
-					    mbpdbus_toggle_watch, NULL, mbpdbus_data_free);
-  if (!ret)
+  if (mbpdbus_call_bus(msg, mbpdbus_request_name_reply) == 0)
+    return;
+
+ lost:
+  evloop_defer(mbpdbus_connection_lost);
+}
+
+static int
+mbpdbus_connect(void)
+{
+  DBusMessage *msg;
+  const char *address;
+  int ret;
+
+  address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+  if (address == NULL)
+    address = DBUS_SYSTEM_BUS_ADDRESS;
+
+  bus_conn = dbus_connection_open_private(address, &err);
+  if (dbus_error_is_set(&err))
     {
-      mbpdbus_cleanup();
+      /* Only once per outage */
+      if (dbus_backoff == DBUS_TIMEOUT)
+	logmsg(LOG_ERR, "DBus system bus connection failed: %s", err.message);
+
+      dbus_error_free(&err);
 
-      goto init_reconnect;
+      bus_conn = NULL;
+
+      return -1;
     }
 
-  dbus_connection_add_filter(conn, mbpdbus_process_requests, NULL, NULL);
+  dbus_connection_set_exit_on_disconnect(bus_conn, FALSE);
 
-  return 0;
+  ret = dbus_connection_set_watch_functions(bus_conn, mbpdbus_add_watch, mbpdbus_remove_watch,
+					    mbpdbus_toggle_watch, NULL, mbpdbus_data_free);
+  if (ret)
+    ret = dbus_connection_set_timeout_functions(bus_conn, mbpdbus_add_timeout, mbpdbus_remove_timeout,
+						mbpdbus_toggle_timeout, NULL, mbpdbus_data_free);
+  if (ret)
+    ret = dbus_connection_add_filter(bus_conn, mbpdbus_process_requests, NULL, NULL);
+  if (!ret)
+    {
+      mbpdbus_disconnect();
 
- init_reconnect:
-  if (dbus_timer > 0) /* Trying to reconnect already, called from mbpdbus_reconnect() */
       return -1;
+    }
 
-  dbus_timer = evloop_add_timer(DBUS_TIMEOUT, mbpdbus_reconnect);
-  if (dbus_timer < 0)
+  /* Authentication happens in the background, Hello is queued */
+  msg = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+				     DBUS_INTERFACE_DBUS, "Hello");
+  if (mbpdbus_call_bus(msg, mbpdbus_hello_reply) < 0)
     {
-      logmsg(LOG_ERR, "Could not set up timer for DBus reconnection");
+      mbpdbus_disconnect();
 
       return -1;
     }
@@ -1178,20 +1792,48 @@ mbpdbus_init(void)
   return 0;
 }
 
+static void
+mbpdbus_reconnect(int id, uint64_t ticks)
+{
+  /* Oneshot timer, gone already */
+  dbus_timer = -1;
+
+  if (mbpdbus_connect() < 0)
+    mbpdbus_schedule_reconnect();
+}
+
+
+int
+mbpdbus_init(void)
+{
+  timeouts = NULL;
+
+  dbus_timer = -1;
+  dbus_backoff = DBUS_TIMEOUT;
+
+  srandom(time(NULL) ^ getpid());
+
+  mbpdbus_register_methods();
+
+  dbus_error_init(&err);
+
+  if (mbpdbus_connect() == 0)
+    return 0;
+
+  mbpdbus_schedule_reconnect();
+
+  return (dbus_timer > 0) ? 0 : -1;
+}
+
 void
 mbpdbus_cleanup(void)
 {
   if (dbus_timer > 0)
     evloop_remove_timer(dbus_timer);
 
-  if (conn == NULL)
-    return;
+  dbus_timer = -1;
 
-  dbus_error_free(&err);
+  mbpdbus_disconnect();
 
-  /* This is a shared connection owned by libdbus
-   * Do not close it, only unref
-   */
-  dbus_connection_unref(conn);
-  conn = NULL;
+  dbus_error_free(&err);
 }
@@ -5,7 +5,13 @@
 #ifndef __MBPDBUS_H__
 #define __MBPDBUS_H__
 
-#define DBUS_TIMEOUT 200
+/* Reconnection delay (ms), doubled after each failure */
+#define DBUS_TIMEOUT            200
+#define DBUS_RECONNECT_MAX      30000
+/* Bus calls made while connecting (ms) */
+#define DBUS_CALL_TIMEOUT       5000
+
+#define DBUS_SYSTEM_BUS_ADDRESS "unix:path=/var/run/dbus/system_bus_socket"
 
 
 void
@@ -0,0 +1,125 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+
+#include "dispatch.h"
+
+
+/* DBus method dispatch: (interface, member) pairs are hashed into a
+ * small chained hash table. Each subsystem registers its own table of
+ * methods; the entries themselves are linked into the buckets, so
+ * registration does not allocate.
+ */
+
+static struct dispatch_method *buckets[DISPATCH_BUCKETS];
+
+
+/* FNV-1a over "interface\0member" */
+static uint32_t
+dispatch_hash(const char *iface, const char *member)
+{
+  uint32_t h;
+  const unsigned char *p;
+
+  h = 2166136261U;
+
+  for (p = (const unsigned char *)iface; *p != '\0'; p++)
+    {
+      h ^= *p;
+      h *= 16777619U;
+    }
+
+  h *= 16777619U;
+
+  for (p = (const unsigned char *)member; *p != '\0'; p++)
+    {
+      h ^= *p;
+      h *= 16777619U;
+    }
+
+  return h;
+}
+
+
+static int
+dispatch_registered(struct dispatch_method *entry, uint32_t bucket)
+{
+  struct dispatch_method *m;
+
+  for (m = buckets[bucket]; m != NULL; m = m->next)
+    {
+      if (m == entry)
+	return 1;
+    }
+
+  return 0;
+}
+
+/* Entries already registered are skipped; linking one twice
+ * would loop its chain onto itself
+ */
+void
+dispatch_register(struct dispatch_method *methods, int n)
+{
+  struct dispatch_method *m;
+  uint32_t bucket;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      m = &methods[i];
+
+      m->hash = dispatch_hash(m->iface, m->member);
+      bucket = m->hash & (DISPATCH_BUCKETS - 1);
+
+      if (dispatch_registered(m, bucket))
+	continue;
+
+      m->next = buckets[bucket];
+      buckets[bucket] = m;
+    }
+}
+
+struct dispatch_method *
+dispatch_lookup(const char *iface, const char *member)
+{
+  struct dispatch_method *m;
+  uint32_t h;
+
+  if ((iface == NULL) || (member == NULL))
+    return NULL;
+
+  h = dispatch_hash(iface, member);
+
+  for (m = buckets[h & (DISPATCH_BUCKETS - 1)]; m != NULL; m = m->next)
+    {
+      if ((m->hash == h)
+	  && (strcmp(m->member, member) == 0)
+	  && (strcmp(m->iface, iface) == 0))
+	return m;
+    }
+
+  return NULL;
+}
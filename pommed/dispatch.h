@@ -0,0 +1,41 @@
+/*
+ * pommed - dispatch.h
+ */
+
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+/* Power of 2 */
+#define DISPATCH_BUCKETS     64
+
+typedef void(*dispatch_cb)(DBusMessage *req, int arg);
+
+struct dispatch_method
+{
+  const char *iface;
+  const char *member;
+  dispatch_cb cb;
+  int arg;             /* passed to cb, for methods sharing a handler */
+
+  /* Filled in by dispatch_register() */
+  uint32_t hash;
+  struct dispatch_method *next;
+};
+
+#define DISPATCH_METHOD(iface, member, cb, arg) \
+  { iface, member, cb, arg, 0, NULL }
+
+
+/* The entries are linked in as they are and must outlive the table;
+ * registering the same table again is harmless
+ */
+void
+dispatch_register(struct dispatch_method *methods, int n);
+
+struct dispatch_method *
+dispatch_lookup(const char *iface, const char *member);
+
+#endif /* !__DISPATCH_H__ */
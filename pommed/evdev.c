@@ -24,6 +24,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include <syslog.h>
 
@@ -51,6 +54,7 @@
 #include "audio.h"
 #include "video.h"
 #include "beep.h"
+#include "latency.h"
 
 
 #define BITS_PER_LONG (sizeof(long) * 8)
@@ -65,6 +69,20 @@
 # define BUS_VIRTUAL 0x06
 #endif
 
+/* Added to linux/input.h in Linux 3.4 */
+#ifndef EVIOCSCLOCKID
+# define EVIOCSCLOCKID _IOW('E', 0xa0, int)
+#endif
+
+/* Added to linux/input.h in Linux 4.16 */
+#ifndef input_event_sec
+# define input_event_sec time.tv_sec
+# define input_event_usec time.tv_usec
+#endif
+
+
+static int
+evdev_prefilter(char *evname);
 
 static int
 evdev_try_add(int fd);
@@ -72,78 +90,195 @@ evdev_try_add(int fd);
 
 static int internal_kbd_fd;
 
-void
-evdev_process_events(int fd, uint32_t events)
+/* Brightness & volume steps not applied yet; while a key is held
+ * down, auto-repeated steps are accumulated and applied at most
+ * once every EVDEV_REPEAT_COALESCE ms, in a single write.
+ */
+static struct
 {
-  int ret;
+  int lcd;     /* signed number of LCD backlight steps */
+  int vol;     /* signed number of volume steps */
+  int press;   /* a fresh keypress is pending, apply right away */
 
-  struct input_event ev;
+  int timer;
+} evdev_steps;
 
-  /* some of the event devices cease to exist when suspending */
-  if (events & (EPOLLERR | EPOLLHUP))
+
+/* Keypress time, CLOCK_MONOTONIC in ns, for the latency traces.
+ * The devices are switched to CLOCK_MONOTONIC timestamps; devices
+ * that refuse EVIOCSCLOCKID report CLOCK_REALTIME, converted here.
+ * The clock of each device is kept in its event loop source data.
+ */
+static uint64_t
+evdev_key_stamp(int fd, struct input_event *ev)
+{
+  struct pommed_event *src;
+  struct timespec mono;
+  struct timespec real;
+  uint64_t stamp;
+
+  stamp = (uint64_t)ev->input_event_sec * 1000000000ULL + (uint64_t)ev->input_event_usec * 1000ULL;
+
+  src = evloop_lookup(fd);
+  if ((src != NULL) && ((intptr_t)src->data == CLOCK_MONOTONIC))
+    return stamp;
+
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+
+  stamp -= (real.tv_sec - mono.tv_sec) * 1000000000ULL;
+  stamp -= real.tv_nsec - mono.tv_nsec;
+
+  return stamp;
+}
+
+static void
+evdev_latency_key(int fd, int action, struct input_event *ev)
+{
+  if (!evloop_stats_enabled())
+    return;
+
+  /* value is 1 for a keypress, 2 for auto-repeat */
+  latency_key(action, evdev_key_stamp(fd, ev), (ev->value == 2));
+}
+
+
+static void
+evdev_steps_flush(void)
+{
+  if (evdev_steps.lcd != 0)
     {
-      logmsg(LOG_INFO, "Error condition signaled on event device");
+      logdebug("LCD backlight: applying %d step(s)\n", evdev_steps.lcd);
 
-      ret = evloop_remove(fd);
-      if (ret < 0)
-	logmsg(LOG_ERR, "Could not remove device from event loop");
+      lcd_backlight_step(evdev_steps.lcd);
+      latency_done((evdev_steps.lcd > 0) ? LATENCY_LCD_UP : LATENCY_LCD_DOWN);
 
-      if (fd == internal_kbd_fd)
-	internal_kbd_fd = -1;
+      evdev_steps.lcd = 0;
+    }
 
-      close(fd);
+  if (evdev_steps.vol != 0)
+    {
+      logdebug("Audio volume: applying %d step(s)\n", evdev_steps.vol);
 
-      return;
+      audio_step(evdev_steps.vol);
+      latency_done(LATENCY_VOLUME);
+
+      evdev_steps.vol = 0;
     }
 
-  ret = read(fd, &ev, sizeof(struct input_event));
+  evdev_steps.press = 0;
+}
+
+static void
+evdev_steps_timer(int id, uint64_t ticks)
+{
+  evdev_steps.timer = -1;
+
+  if ((evdev_steps.lcd == 0) && (evdev_steps.vol == 0))
+    return;
+
+  evdev_steps_flush();
+
+  /* Key still held down, keep coalescing */
+  evdev_steps.timer = evloop_add_oneshot_timer(EVDEV_REPEAT_COALESCE, evdev_steps_timer);
+}
+
+/* Called on SYN_REPORT, once a whole frame has been processed */
+static void
+evdev_steps_commit(void)
+{
+  if ((evdev_steps.lcd == 0) && (evdev_steps.vol == 0))
+    return;
 
-  if (ret != sizeof(struct input_event))
+  /* Auto-repeat within the coalescing window, wait for the timer */
+  if (!evdev_steps.press && (evdev_steps.timer > 0))
     return;
 
-  if (ev.type == EV_KEY)
+  evdev_steps_flush();
+
+  if (evdev_steps.timer > 0)
+    evloop_mod_timer(evdev_steps.timer, EVDEV_REPEAT_COALESCE);
+  else
+    evdev_steps.timer = evloop_add_oneshot_timer(EVDEV_REPEAT_COALESCE, evdev_steps_timer);
+}
+
+static void
+evdev_steps_add(int *steps, int dir, int value)
+{
+  /* Keep actions in order: anything else pending goes out first */
+  if (((steps == &evdev_steps.lcd) && (evdev_steps.vol != 0))
+      || ((steps == &evdev_steps.vol) && (evdev_steps.lcd != 0))
+      || ((*steps != 0) && ((*steps > 0) != (dir > 0))))
+    evdev_steps_flush();
+
+  *steps += dir;
+
+  /* value is 1 for a keypress, 2 for auto-repeat */
+  if (value == 1)
+    evdev_steps.press = 1;
+}
+
+
+static void
+evdev_process_event(int fd, struct input_event *ev)
+{
+  if (ev->type == EV_SYN)
+    {
+      if (ev->code == SYN_REPORT)
+	evdev_steps_commit();
+    }
+  else if (ev->type == EV_KEY)
     {
       /* key released - we don't care */
-      if (ev.value == 0)
+      if (ev->value == 0)
 	return;
 
       /* Reset keyboard backlight idle timer */
       if (fd == internal_kbd_fd)
-	{
-	  kbd_bck_info.idle = 0;
-	  kbd_backlight_inhibit_clear(KBD_INHIBIT_IDLE);
-	}
+	kbd_backlight_idle_reset();
 
-      switch (ev.code)
+      switch (ev->code)
 	{
 	  case KEY_BRIGHTNESSDOWN:
 	    logdebug("\nKEY: LCD backlight down\n");
 
-	    mops->lcd_backlight_step(STEP_DOWN);
-	    break;
+	    evdev_steps_add(&evdev_steps.lcd, STEP_DOWN, ev->value);
+	    evdev_latency_key(fd, LATENCY_LCD_DOWN, ev);
+	    return;
 
 	  case KEY_BRIGHTNESSUP:
 	    logdebug("\nKEY: LCD backlight up\n");
 
-	    mops->lcd_backlight_step(STEP_UP);
-	    break;
-
-	  case KEY_MUTE:
-	    logdebug("\nKEY: audio mute\n");
-
-	    audio_toggle_mute();
-	    break;
+	    evdev_steps_add(&evdev_steps.lcd, STEP_UP, ev->value);
+	    evdev_latency_key(fd, LATENCY_LCD_UP, ev);
+	    return;
 
 	  case KEY_VOLUMEDOWN:
 	    logdebug("\nKEY: audio down\n");
 
-	    audio_step(STEP_DOWN);
-	    break;
+	    evdev_steps_add(&evdev_steps.vol, STEP_DOWN, ev->value);
+	    evdev_latency_key(fd, LATENCY_VOLUME, ev);
+	    return;
 
 	  case KEY_VOLUMEUP:
 	    logdebug("\nKEY: audio up\n");
 
-	    audio_step(STEP_UP);
+	    evdev_steps_add(&evdev_steps.vol, STEP_UP, ev->value);
+	    evdev_latency_key(fd, LATENCY_VOLUME, ev);
+	    return;
+	}
+
+      /* Any other action: apply pending steps first */
+      evdev_steps_flush();
+
+      switch (ev->code)
+	{
+	  case KEY_MUTE:
+	    logdebug("\nKEY: audio mute\n");
+
+	    evdev_latency_key(fd, LATENCY_MUTE, ev);
+	    audio_toggle_mute();
+	    latency_done(LATENCY_MUTE);
 	    break;
 
 	  case KEY_SWITCHVIDEOMODE:
@@ -158,10 +293,14 @@ evdev_process_events(int fd, uint32_t events)
 	    if (!has_kbd_backlight())
 	      break;
 
+	    evdev_latency_key(fd, LATENCY_KBD, ev);
+
 	    if (kbd_cfg.auto_on)
 	      kbd_backlight_inhibit_toggle(KBD_INHIBIT_USER);
 	    else
 	      kbd_backlight_toggle();
+
+	    latency_done(LATENCY_KBD);
 	    break;
 
 	  case KEY_KBDILLUMDOWN:
@@ -170,9 +309,13 @@ evdev_process_events(int fd, uint32_t events)
 	    if (!has_kbd_backlight())
 	      break;
 
+	    evdev_latency_key(fd, LATENCY_KBD, ev);
+
 	    kbd_backlight_step(STEP_DOWN);
 	    if (kbd_bck_info.level == KBD_BACKLIGHT_OFF)
 	      kbd_backlight_inhibit_set(KBD_INHIBIT_USER);
+
+	    latency_done(LATENCY_KBD);
 	    break;
 
 	  case KEY_KBDILLUMUP:
@@ -181,14 +324,20 @@ evdev_process_events(int fd, uint32_t events)
 	    if (!has_kbd_backlight())
 	      break;
 
+	    evdev_latency_key(fd, LATENCY_KBD, ev);
+
 	    kbd_backlight_inhibit_clear(KBD_INHIBIT_USER);
 	    kbd_backlight_step(STEP_UP);
+
+	    latency_done(LATENCY_KBD);
 	    break;
 
 	  case KEY_EJECTCD:
 	    logdebug("\nKEY: CD eject\n");
 
+	    evdev_latency_key(fd, LATENCY_EJECT, ev);
 	    cd_eject();
+	    latency_done(LATENCY_EJECT);
 	    break;
 
 	  case KEY_NEXTSONG:
@@ -215,17 +364,17 @@ evdev_process_events(int fd, uint32_t events)
 
 	  default:
 #if 0
-	    logdebug("\nKEY: %x\n", ev.code);
+	    logdebug("\nKEY: %x\n", ev->code);
 #endif /* 0 */
 	    break;
 	}
     }
-  else if (ev.type == EV_SW)
+  else if (ev->type == EV_SW)
     {
       /* Lid switch */
-      if (ev.code == SW_LID)
+      if (ev->code == SW_LID)
 	{
-	  if (ev.value)
+	  if (ev->value)
 	    {
 	      logdebug("\nLID: closed\n");
 
@@ -241,6 +390,44 @@ evdev_process_events(int fd, uint32_t events)
     }
 }
 
+void
+evdev_process_events(int fd, uint32_t events)
+{
+  int ret;
+  int nev;
+  int i;
+
+  struct input_event ev[EVDEV_EVENTS_BATCH];
+
+  /* some of the event devices cease to exist when suspending */
+  if (events & (EPOLLERR | EPOLLHUP))
+    {
+      logmsg(LOG_INFO, "Error condition signaled on event device");
+
+      ret = evloop_remove(fd);
+      if (ret < 0)
+	logmsg(LOG_ERR, "Could not remove device from event loop");
+
+      if (fd == internal_kbd_fd)
+	internal_kbd_fd = -1;
+
+      close(fd);
+
+      return;
+    }
+
+  /* Drain as many events as are available in one go */
+  ret = read(fd, ev, sizeof(ev));
+
+  if (ret < (int)sizeof(struct input_event))
+    return;
+
+  nev = ret / sizeof(struct input_event);
+
+  for (i = 0; i < nev; i++)
+    evdev_process_event(fd, &ev[i]);
+}
+
 
 void
 evdev_inotify_process(int fd, uint32_t events)
@@ -324,6 +511,9 @@ evdev_inotify_process(int fd, uint32_t events)
       if ((ret <= 0) || (ret >= sizeof(evdev)))
 	continue;
 
+      if (!evdev_prefilter(ie->name))
+	continue;
+
       efd = open(evdev, O_RDWR);
       if (efd < 0)
 	{
@@ -340,585 +530,265 @@ evdev_inotify_process(int fd, uint32_t events)
 }
 
 
-#ifdef __powerpc__
-/* PowerBook G4 Titanium */
-static int
-evdev_is_adb(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_ADB)
-    return 0;
-
-  if (id[ID_VENDOR] != 0x0001)
-    return 0;
-
-  if ((product == ADB_PRODUCT_ID_KEYBOARD_ANSI)
-      || (product == ADB_PRODUCT_ID_KEYBOARD_ISO)
-      || (product == ADB_PRODUCT_ID_KEYBOARD_JIS))
-    {
-      logdebug(" -> ADB keyboard\n");
-
-      return 1;
-    }
-
-  if (product == ADB_PRODUCT_ID_PBBUTTONS)
-    {
-      logdebug(" -> ADB PowerBook buttons\n");
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* PowerBook G4 */
-static int
-evdev_is_fountain(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_FOUNTAIN_ANSI)
-      || (product == USB_PRODUCT_ID_FOUNTAIN_ISO)
-      || (product == USB_PRODUCT_ID_FOUNTAIN_JIS))
-    {
-      logdebug(" -> Fountain USB assembly\n");
-
-      return 1;
-    }
-
-  return 0;
-}
-
-static int
-evdev_is_geyser(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_GEYSER_ANSI)
-      || (product == USB_PRODUCT_ID_GEYSER_ISO)
-      || (product == USB_PRODUCT_ID_GEYSER_JIS))
-    {
-      logdebug(" -> Geyser USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Any internal keyboard */
-static int
-evdev_is_internal(unsigned short *id)
-{
-  return (evdev_is_adb(id)
-	  || evdev_is_fountain(id)
-	  || evdev_is_geyser(id));
-}
-
-
-/* PMU Lid switch */
-static int
-evdev_is_lidswitch(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_HOST)
-    return 0;
-
-  if (id[ID_VENDOR] != 0x0001)
-    return 0;
-
-  if (id[ID_VERSION] != 0x0100)
-    return 0;
-
-  if (product == 0x0001)
-    {
-      logdebug(" -> PMU LID switch\n");
-
-      return 1;
-    }
-
-  return 0;
-}
-
-#else
-
-/* Core Duo MacBook & MacBook Pro */
-static int
-evdev_is_geyser3(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_GEYSER3_ANSI)
-      || (product == USB_PRODUCT_ID_GEYSER3_ISO)
-      || (product == USB_PRODUCT_ID_GEYSER3_JIS))
-    {
-      logdebug(" -> Geyser III USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Core2 Duo MacBook & MacBook Pro */
-static int
-evdev_is_geyser4(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_GEYSER4_ANSI)
-      || (product == USB_PRODUCT_ID_GEYSER4_ISO)
-      || (product == USB_PRODUCT_ID_GEYSER4_JIS))
-    {
-      logdebug(" -> Geyser IV USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Core2 Duo Santa Rosa MacBook (MacBook3,1)
-   Core2 Duo MacBook (MacBook4,1, February 2008) */
-static int
-evdev_is_geyser4hf(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_GEYSER4HF_ANSI)
-      || (product == USB_PRODUCT_ID_GEYSER4HF_ISO)
-      || (product == USB_PRODUCT_ID_GEYSER4HF_JIS))
-    {
-      logdebug(" -> Geyser IV-HF USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* MacBook Air (MacBookAir1,1, January 2008) */
-static int
-evdev_is_wellspring(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING_JIS))
-    {
-      logdebug(" -> WellSpring USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Core2 Duo MacBook Pro (MacBookPro4,1, February 2008) */
-static int
-evdev_is_wellspring2(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING2_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING2_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING2_JIS))
-    {
-      logdebug(" -> WellSpring II USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Core2 Duo MacBook Pro (MacBookPro5,1, October 2008)
- * Core2 Duo MacBook (MacBook5,1, October 2008)
- * MacBook Air (MacBookAir2,1, October 2008) */
-static int
-evdev_is_wellspring3(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
+/* Device capabilities */
+#define EVDEV_INTERNAL     (1 << 0)  /* internal keyboard */
+#define EVDEV_LIDSWITCH    (1 << 1)  /* lid switch, only if kbd backlight */
+#define EVDEV_APPLEIR      (1 << 2)  /* Apple Remote, if enabled */
+#define EVDEV_EXTKBD       (1 << 3)  /* external Apple keyboard */
+#define EVDEV_VIRTUAL      (1 << 4)  /* virtual keyboard */
+#define EVDEV_FNMODE       (1 << 5)  /* set fnmode when found */
+#define EVDEV_ABS_OK       (1 << 6)  /* advertises EV_ABS, not a mouse */
 
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING3_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING3_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING3_JIS))
-    {
-      logdebug(" -> WellSpring III USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* MacBookAir3,2 (October 2010) */
-static int
-evdev_is_wellspring4(unsigned short *id)
+struct evdev_device
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING4_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING4_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING4_JIS))
-    {
-      logdebug(" -> WellSpring IV USB assembly\n");
+  unsigned short bus;
+  unsigned short vendor;
+  unsigned short product;
+  unsigned short version; /* 0: any */
 
-      kbd_set_fnmode();
+  int flags;
+  char *name;
+};
 
-      return 1;
-    }
-
-  return 0;
-}
+#define USB_APPLE(p, f, n)   { BUS_USB, USB_VENDOR_ID_APPLE, (p), 0, (f), (n) }
+#define BT_APPLE(p, f, n)    { BUS_BLUETOOTH, USB_VENDOR_ID_APPLE, (p), 0, (f), (n) }
 
-/* MacBookAir3,1 (October 2010) */
-static int
-evdev_is_wellspring4a(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING4A_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING4A_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING4A_JIS))
-    {
-      logdebug(" -> WellSpring IVa USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* MacBookPro8,1 (13" Early 2011)
- * MacBookPro8,2 (15" Early 2011)
- * MacBookPro8,3 (17" Early 2011)
+/* Known devices, sorted by bus, vendor and product for bsearch();
+ * adding a new model is a matter of adding its rows here.
  */
-static int
-evdev_is_wellspring5(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_WELLSPRING5_ANSI)
-      || (product == USB_PRODUCT_ID_WELLSPRING5_ISO)
-      || (product == USB_PRODUCT_ID_WELLSPRING5_JIS))
-    {
-      logdebug(" -> WellSpring V USB assembly\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
+static const struct evdev_device evdev_devices[] =
+  {
+    /* BUS_USB */
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_WHITE,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB keyboard (white)"),
+#ifdef __powerpc__
+    /* PowerBook G4 */
+    USB_APPLE(USB_PRODUCT_ID_FOUNTAIN_ANSI, EVDEV_INTERNAL, "Fountain USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_FOUNTAIN_ISO, EVDEV_INTERNAL, "Fountain USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_FOUNTAIN_JIS, EVDEV_INTERNAL, "Fountain USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser USB assembly"),
+#else
+    /* Core Duo MacBook & MacBook Pro */
+    USB_APPLE(USB_PRODUCT_ID_GEYSER3_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser III USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER3_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser III USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER3_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser III USB assembly"),
+    /* Core2 Duo MacBook & MacBook Pro */
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV USB assembly"),
+#endif
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_ANSI,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB mini keyboard (aluminium)"),
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_ISO,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB mini keyboard (aluminium)"),
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_JIS,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB mini keyboard (aluminium)"),
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_ANSI,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB keyboard (aluminium)"),
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_ISO,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB keyboard (aluminium)"),
+    USB_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_JIS,
+	      EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple USB keyboard (aluminium)"),
+#ifndef __powerpc__
+    /* MacBook Air (MacBookAir1,1, January 2008) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring USB assembly"),
+    /* Core2 Duo Santa Rosa MacBook (MacBook3,1)
+       Core2 Duo MacBook (MacBook4,1, February 2008) */
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4HF_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV-HF USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4HF_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV-HF USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_GEYSER4HF_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "Geyser IV-HF USB assembly"),
+    /* Core2 Duo MacBook Pro (MacBookPro4,1, February 2008) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING2_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring II USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING2_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring II USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING2_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring II USB assembly"),
+    /* Core2 Duo MacBook Pro (MacBookPro5,1, October 2008)
+     * Core2 Duo MacBook (MacBook5,1, October 2008)
+     * MacBook Air (MacBookAir2,1, October 2008) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING3_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring III USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING3_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring III USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING3_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring III USB assembly"),
+    /* MacBookAir3,2 (October 2010) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IV USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IV USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IV USB assembly"),
+    /* MacBookAir3,1 (October 2010) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4A_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IVa USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4A_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IVa USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING4A_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring IVa USB assembly"),
+    /* MacBookPro8,1 (13" Early 2011)
+     * MacBookPro8,2 (15" Early 2011)
+     * MacBookPro8,3 (17" Early 2011) */
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING5_ANSI, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring V USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING5_ISO, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring V USB assembly"),
+    USB_APPLE(USB_PRODUCT_ID_WELLSPRING5_JIS, EVDEV_INTERNAL | EVDEV_FNMODE, "WellSpring V USB assembly"),
+    /* Apple Remote IR Receiver */
+    USB_APPLE(USB_PRODUCT_ID_APPLEIR, EVDEV_APPLEIR, "Apple IR receiver"),
+    USB_APPLE(USB_PRODUCT_ID_APPLEIR_2, EVDEV_APPLEIR, "Apple IR receiver"),
+#endif /* !__powerpc__ */
 
-  return 0;
-}
+    /* BUS_BLUETOOTH */
+    /* Wireless keyboards advertise EV_ABS events */
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_ANSI,
+	     EVDEV_EXTKBD | EVDEV_FNMODE | EVDEV_ABS_OK, "External Apple wireless keyboard (aluminium)"),
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_ISO,
+	     EVDEV_EXTKBD | EVDEV_FNMODE | EVDEV_ABS_OK, "External Apple wireless keyboard (aluminium)"),
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_JIS,
+	     EVDEV_EXTKBD | EVDEV_FNMODE | EVDEV_ABS_OK, "External Apple wireless keyboard (aluminium)"),
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_ANSI,
+	     EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple wireless keyboard 2 (aluminium)"),
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_ISO,
+	     EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple wireless keyboard 2 (aluminium)"),
+    BT_APPLE(USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_JIS,
+	     EVDEV_EXTKBD | EVDEV_FNMODE, "External Apple wireless keyboard 2 (aluminium)"),
+
+    /* BUS_VIRTUAL */
+    { BUS_VIRTUAL, 0x001f, 0x001f, 0, EVDEV_VIRTUAL, "Mouseemu virtual keyboard" },
 
-/* Any internal keyboard */
-static int
-evdev_is_internal(unsigned short *id)
-{
-  return (evdev_is_geyser3(id)
-	  || evdev_is_geyser4(id)
-	  || evdev_is_geyser4hf(id)
-	  || evdev_is_wellspring(id)
-	  || evdev_is_wellspring2(id)
-	  || evdev_is_wellspring3(id)
-	  || evdev_is_wellspring4(id)
-	  || evdev_is_wellspring4a(id)
-	  || evdev_is_wellspring5(id));
-}
+#ifdef __powerpc__
+    /* BUS_ADB, PowerBook G4 Titanium */
+    { BUS_ADB, 0x0001, ADB_PRODUCT_ID_KEYBOARD_ANSI, 0, EVDEV_INTERNAL, "ADB keyboard" },
+    { BUS_ADB, 0x0001, ADB_PRODUCT_ID_KEYBOARD_ISO, 0, EVDEV_INTERNAL, "ADB keyboard" },
+    { BUS_ADB, 0x0001, ADB_PRODUCT_ID_KEYBOARD_JIS, 0, EVDEV_INTERNAL, "ADB keyboard" },
+    { BUS_ADB, 0x0001, ADB_PRODUCT_ID_PBBUTTONS, 0, EVDEV_INTERNAL, "ADB PowerBook buttons" },
+
+    /* BUS_HOST */
+    { BUS_HOST, 0x0001, 0x0001, 0x0100, EVDEV_LIDSWITCH, "PMU LID switch" },
+#else
+    /* BUS_HOST */
+    { BUS_HOST, 0x0000, 0x0005, 0, EVDEV_LIDSWITCH, "ACPI LID switch" },
+#endif
+  };
 
 
-/* Apple Remote IR Receiver */
 static int
-evdev_is_appleir(unsigned short *id)
+evdev_device_cmp(const void *a, const void *b)
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
+  const struct evdev_device *da = a;
+  const struct evdev_device *db = b;
 
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
+  if (da->bus != db->bus)
+    return da->bus - db->bus;
 
-  if ((product == USB_PRODUCT_ID_APPLEIR)
-      || (product == USB_PRODUCT_ID_APPLEIR_2))
-    {
-      logdebug(" -> Apple IR receiver\n");
-
-      return 1;
-    }
+  if (da->vendor != db->vendor)
+    return da->vendor - db->vendor;
 
-  return 0;
+  return da->product - db->product;
 }
 
-/* ACPI Lid switch */
-static int
-evdev_is_lidswitch(unsigned short *id)
+static const struct evdev_device *
+evdev_lookup(unsigned short bus, unsigned short vendor, unsigned short product)
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_HOST)
-    return 0;
-
-  if (id[ID_VENDOR] != 0)
-    return 0;
-
-  if (product == 0x0005)
-    {
-      logdebug(" -> ACPI LID switch\n");
+  struct evdev_device key;
 
-      return 1;
-    }
+  key.bus = bus;
+  key.vendor = vendor;
+  key.product = product;
 
-  return 0;
+  return bsearch(&key, evdev_devices,
+		 sizeof(evdev_devices) / sizeof(*evdev_devices), sizeof(*evdev_devices),
+		 evdev_device_cmp);
 }
-#endif /* !__powerpc__ */
 
-/* Apple external USB keyboard, white */
-static int
-evdev_is_extkbd_white(unsigned short *id)
+/* Look up a device and decide whether we want it */
+static const struct evdev_device *
+evdev_match(unsigned short *id)
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
+  const struct evdev_device *dev;
 
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
+  dev = evdev_lookup(id[ID_BUS], id[ID_VENDOR], id[ID_PRODUCT]);
+  if (dev == NULL)
+    return NULL;
 
-  if (product == USB_PRODUCT_ID_APPLE_EXTKBD_WHITE)
-    {
-      logdebug(" -> External Apple USB keyboard (white)\n");
+  if (dev->version && (dev->version != id[ID_VERSION]))
+    return NULL;
 
-      kbd_set_fnmode();
+  if ((dev->flags & EVDEV_LIDSWITCH) && !has_kbd_backlight())
+    return NULL;
 
-      return 1;
-    }
+#ifndef __powerpc__
+  if ((dev->flags & EVDEV_APPLEIR) && !appleir_cfg.enabled)
+    return NULL;
+#endif
 
-  return 0;
+  return dev;
 }
 
-/* Apple external USB mini keyboard, aluminium */
-static int
-evdev_is_extkbd_mini_alu(unsigned short *id)
+/* The table must stay sorted, or bsearch() will miss entries */
+static void
+evdev_check_table(void)
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
+  int i;
 
-  if ((product == USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_ANSI)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_ISO)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_MINI_ALU_JIS))
+  for (i = 1; i < sizeof(evdev_devices) / sizeof(*evdev_devices); i++)
     {
-      logdebug(" -> External Apple USB mini keyboard (aluminium)\n");
-
-      kbd_set_fnmode();
-
-      return 1;
+      if (evdev_device_cmp(&evdev_devices[i - 1], &evdev_devices[i]) >= 0)
+	logmsg(LOG_ERR, "evdev device table not sorted at entry %d (%s)", i, evdev_devices[i].name);
     }
-
-  return 0;
 }
 
-/* Apple external USB keyboard, aluminium */
-static int
-evdev_is_extkbd_alu(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_USB)
-    return 0;
-
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
-
-  if ((product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_ANSI)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_ISO)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_JIS))
-    {
-      logdebug(" -> External Apple USB keyboard (aluminium)\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
 
-/* Apple external wireless keyboard, aluminium */
+/* Read the device IDs from sysfs, without opening the device */
 static int
-evdev_is_extkbd_alu_wl(unsigned short *id)
+evdev_sysfs_id(char *evname, unsigned short *id)
 {
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_BLUETOOTH)
-    return 0;
+  char *attrs[4];
+  char path[PATH_MAX];
+  char buf[8];
+  int fd;
+  int ret;
+  int i;
 
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
+  attrs[ID_BUS] = "bustype";
+  attrs[ID_VENDOR] = "vendor";
+  attrs[ID_PRODUCT] = "product";
+  attrs[ID_VERSION] = "version";
 
-  if ((product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_ANSI)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_ISO)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_JIS))
+  for (i = 0; i < 4; i++)
     {
-      logdebug(" -> External Apple wireless keyboard (aluminium)\n");
-
-      kbd_set_fnmode();
-
-      return 1;
-    }
-
-  return 0;
-}
-
-/* Apple external wireless keyboard, aluminium, newer model */
-static int
-evdev_is_extkbd_alu_wl_2(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
+      ret = snprintf(path, sizeof(path), "%s/%s/device/id/%s", EVDEV_SYSFS_DIR, evname, attrs[i]);
+      if ((ret <= 0) || (ret >= sizeof(path)))
+	return -1;
 
-  if (id[ID_BUS] != BUS_BLUETOOTH)
-    return 0;
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	return -1;
 
-  if (id[ID_VENDOR] != USB_VENDOR_ID_APPLE)
-    return 0;
+      ret = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
 
-  if ((product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_ANSI)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_ISO)
-      || (product == USB_PRODUCT_ID_APPLE_EXTKBD_ALU_WL_2_JIS))
-    {
-      logdebug(" -> External Apple wireless keyboard 2 (aluminium)\n");
+      if (ret < 1)
+	return -1;
 
-      kbd_set_fnmode();
+      buf[ret] = '\0';
 
-      return 1;
+      id[i] = strtoul(buf, NULL, 16);
     }
 
   return 0;
 }
 
-/* Any external Apple USB keyboard */
+/* Returns 0 if the device can be skipped without opening it */
 static int
-evdev_is_extkbd(unsigned short *id)
+evdev_prefilter(char *evname)
 {
-  return (evdev_is_extkbd_white(id)
-	  || evdev_is_extkbd_mini_alu(id)
-	  || evdev_is_extkbd_alu(id)
-	  || evdev_is_extkbd_alu_wl(id)
-	  || evdev_is_extkbd_alu_wl_2(id));
-}
-
-/* Mouseemu virtual keyboard */
-static int
-evdev_is_mouseemu(unsigned short *id)
-{
-  unsigned short product = id[ID_PRODUCT];
-
-  if (id[ID_BUS] != BUS_VIRTUAL)
-    return 0;
+  unsigned short id[4];
 
-  if (id[ID_VENDOR] != 0x001f)
-    return 0;
+  /* No sysfs information, open and check the device */
+  if (evdev_sysfs_id(evname, id) < 0)
+    return 1;
 
-  if (product == 0x001f)
+  if (evdev_match(id) == NULL)
     {
-      logdebug(" -> Mouseemu virtual keyboard\n");
+      logdebug("Skipping %s: bus 0x%04x, vid 0x%04x, pid 0x%04x\n", evname, id[ID_BUS], id[ID_VENDOR], id[ID_PRODUCT]);
 
-      return 1;
+      return 0;
     }
 
-  return 0;
+  return 1;
 }
 
 
@@ -926,8 +796,10 @@ static int
 evdev_try_add(int fd)
 {
   unsigned short id[4];
+  const struct evdev_device *dev;
   unsigned long bit[EV_MAX][NBITS(KEY_MAX)];
   char devname[256];
+  int clk;
 
   int ret;
 
@@ -938,13 +810,8 @@ evdev_try_add(int fd)
 
   ioctl(fd, EVIOCGID, id);
 
-  if ((!evdev_is_internal(id))
-#ifndef __powerpc__
-      && !(appleir_cfg.enabled && evdev_is_appleir(id))
-#endif
-      && !(has_kbd_backlight() && evdev_is_lidswitch(id))
-      && !(evdev_is_mouseemu(id))
-      && !(evdev_is_extkbd(id)))
+  dev = evdev_match(id);
+  if (dev == NULL)
     {
       logdebug("Discarding evdev: bus 0x%04x, vid 0x%04x, pid 0x%04x\n", id[ID_BUS], id[ID_VENDOR], id[ID_PRODUCT]);
 
@@ -953,6 +820,11 @@ evdev_try_add(int fd)
       return -1;
     }
 
+  logdebug(" -> %s\n", dev->name);
+
+  if (dev->flags & EVDEV_FNMODE)
+    kbd_set_fnmode();
+
   memset(bit, 0, sizeof(bit));
 
   ioctl(fd, EVIOCGBIT(0, EV_MAX), bit[0]);
@@ -971,7 +843,7 @@ evdev_try_add(int fd)
 	}
     }
   /* Wireless keyboards advertise EV_ABS events, single them out */
-  else if (test_bit(EV_ABS, bit[0]) && !(evdev_is_extkbd_alu_wl(id)))
+  else if (test_bit(EV_ABS, bit[0]) && !(dev->flags & EVDEV_ABS_OK))
     {
       logdebug("Discarding evdev with EV_ABS event type (mouse/trackpad)\n");
 
@@ -980,11 +852,25 @@ evdev_try_add(int fd)
       return -1;
     }
 
+  /* Key timestamps on the clock the latency is measured with */
+  clk = CLOCK_REALTIME;
+  if (evloop_stats_enabled())
+    {
+      clk = CLOCK_MONOTONIC;
+
+      if (ioctl(fd, EVIOCSCLOCKID, &clk) < 0)
+	{
+	  logdebug("evdev: no EVIOCSCLOCKID, converting CLOCK_REALTIME timestamps\n");
+
+	  clk = CLOCK_REALTIME;
+	}
+    }
+
   /* There are 2 keyboards, but one of them only has the eject key;
      the real keyboard has all the keys and the LEDs. Checking for
      the LEDs is a quick way of identifying the keyboard we want.
   */
-  if (test_bit(EV_LED, bit[0]) && evdev_is_internal(id))
+  if (test_bit(EV_LED, bit[0]) && (dev->flags & EVDEV_INTERNAL))
     {
       logdebug(" -> Internal keyboard\n");
 
@@ -1004,6 +890,8 @@ evdev_try_add(int fd)
       return -1;
     }
 
+  evloop_lookup(fd)->data = (void *)(intptr_t)clk;
+
   return 0;
 }
 
@@ -1053,19 +941,39 @@ evdev_init(void)
   int ret;
   int i;
 
+  char evname[16];
   char evdev[32];
 
   int ndevs;
   int fd;
 
+  struct timespec start;
+  struct timespec end;
+
   internal_kbd_fd = -1;
 
+  evdev_check_table();
+
+  evdev_steps.lcd = 0;
+  evdev_steps.vol = 0;
+  evdev_steps.press = 0;
+  evdev_steps.timer = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   ndevs = 0;
   for (i = 0; i < EVDEV_MAX; i++)
     {
-      ret = snprintf(evdev, 32, "%s%d", EVDEV_BASE, i);
+      ret = snprintf(evname, sizeof(evname), "event%d", i);
+      if ((ret <= 0) || (ret >= sizeof(evname)))
+	return -1;
 
-      if ((ret <= 0) || (ret > 31))
+      /* Only open the devices we might be interested in */
+      if (!evdev_prefilter(evname))
+	continue;
+
+      ret = snprintf(evdev, sizeof(evdev), "%s/%s", EVDEV_DIR, evname);
+      if ((ret <= 0) || (ret >= sizeof(evdev)))
 	return -1;
 
       fd = open(evdev, O_RDWR);
@@ -1081,7 +989,10 @@ evdev_init(void)
 	ndevs++;
     }
 
-  logdebug("\nFound %d devices\n", ndevs);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  logdebug("\nFound %d devices in %ld us\n", ndevs,
+	   (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
 
   /* Initialize inotify */
   evdev_inotify_init();
@@ -1092,5 +1003,10 @@ evdev_init(void)
 void
 evdev_cleanup(void)
 {
+  if (evdev_steps.timer > 0)
+    evloop_remove_timer(evdev_steps.timer);
+
+  evdev_steps.timer = -1;
+
   /* evloop_cleanup() takes care of closing the devices */
 }
@@ -108,8 +108,13 @@
 
 
 #define EVDEV_DIR               "/dev/input"
-#define EVDEV_BASE              "/dev/input/event"
 #define EVDEV_MAX               32
+#define EVDEV_SYSFS_DIR         "/sys/class/input"
+
+/* Max events read from a device per wakeup */
+#define EVDEV_EVENTS_BATCH      64
+/* Auto-repeated steps are applied at most once per period (ms) */
+#define EVDEV_REPEAT_COALESCE   100
 
 
 int
@@ -44,24 +44,104 @@
 /* epoll fd */
 static int epfd;
 
-/* event sources registered on the main loop */
-static struct pommed_event *sources;
+/* event sources registered on the main loop, indexed by fd */
+static struct pommed_event **sources;
+static int sources_size;
+static uint32_t sources_gen;
 
 /* timers */
-static struct pommed_timer *timers;
-static int timer_job_id;
+static int timer_fd;
+static uint64_t timer_armed;  /* deadline the timerfd is armed for, 0 if none */
+static int timer_gen;
+
+static struct pommed_timer **timer_heap;
+static int timer_heap_len;
+
+static struct pommed_timer **timer_slots;
+static int timer_slots_size;
+static int *timer_free;
+static int timer_free_len;
+
+/* callbacks deferred to the end of the iteration */
+static struct
+{
+  pommed_defer_cb cb;
+  const char *name;
+} deferred[MAX_DEFERRED];
+static int n_deferred;
 
 static int running;
 
+/* wakeup accounting */
+static struct evloop_counters counters;
+static uint64_t start_time;
+
+/* per-callback statistics, off by default */
+static int stats_enabled;
+static struct evloop_stat stats[EVLOOP_MAX_STATS];
+static int n_stats;
+
+
+static int
+evloop_epoll_ctl(int op, struct pommed_event *ev, uint32_t events)
+{
+  struct epoll_event epoll_ev;
+
+  epoll_ev.events = events;
+  epoll_ev.data.u64 = ((uint64_t)ev->gen << 32) | (uint32_t)ev->fd;
 
+  return epoll_ctl(epfd, op, ev->fd, &epoll_ev);
+}
+
+struct pommed_event *
+evloop_lookup(int fd)
+{
+  if ((fd < 0) || (fd >= sources_size))
+    return NULL;
+
+  return sources[fd];
+}
+
+/* events may be 0 to register a source without polling it yet */
 int
-evloop_add(int fd, uint32_t events, pommed_event_cb cb)
+evloop_add_named(int fd, uint32_t events, pommed_event_cb cb, const char *name)
 {
   int ret;
+  int size;
 
-  struct epoll_event epoll_ev;
+  struct pommed_event **table;
   struct pommed_event *pommed_ev;
 
+  if (fd < 0)
+    return -1;
+
+  if (evloop_lookup(fd) != NULL)
+    {
+      logmsg(LOG_ERR, "Source %d already registered", fd);
+
+      return -1;
+    }
+
+  if (fd >= sources_size)
+    {
+      size = (sources_size > 0) ? sources_size * 2 : 16;
+      while (size <= fd)
+	size *= 2;
+
+      table = (struct pommed_event **)realloc(sources, size * sizeof(*table));
+      if (table == NULL)
+	{
+	  logmsg(LOG_ERR, "Could not allocate memory for new source");
+
+	  return -1;
+	}
+
+      memset(table + sources_size, 0, (size - sources_size) * sizeof(*table));
+
+      sources = table;
+      sources_size = size;
+    }
+
   pommed_ev = (struct pommed_event *)malloc(sizeof(*pommed_ev));
 
   if (pommed_ev == NULL)
@@ -72,23 +152,66 @@ evloop_add(int fd, uint32_t events, pommed_event_cb cb)
     }
 
   pommed_ev->fd = fd;
+  pommed_ev->events = events;
+  pommed_ev->gen = ++sources_gen;
   pommed_ev->cb = cb;
-  pommed_ev->next = sources;
+  pommed_ev->name = name;
+  pommed_ev->data = NULL;
 
-  epoll_ev.events = events;
-  epoll_ev.data.ptr = pommed_ev;
+  if (events != 0)
+    {
+      ret = evloop_epoll_ctl(EPOLL_CTL_ADD, pommed_ev, events);
+
+      if (ret < 0)
+	{
+	  logmsg(LOG_ERR, "Could not add source to epoll: %s", strerror(errno));
+
+	  free(pommed_ev);
+	  return -1;
+	}
+    }
 
-  ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epoll_ev);
+  sources[fd] = pommed_ev;
+
+  return 0;
+}
+
+int
+evloop_modify(int fd, uint32_t events)
+{
+  int ret;
+  int op;
+
+  struct pommed_event *pommed_ev;
+
+  pommed_ev = evloop_lookup(fd);
+  if (pommed_ev == NULL)
+    {
+      logmsg(LOG_ERR, "Could not modify source %d: not registered", fd);
+
+      return -1;
+    }
+
+  if (events == pommed_ev->events)
+    return 0;
+
+  if (pommed_ev->events == 0)
+    op = EPOLL_CTL_ADD;
+  else if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else
+    op = EPOLL_CTL_MOD;
+
+  ret = evloop_epoll_ctl(op, pommed_ev, events);
 
   if (ret < 0)
     {
-      logmsg(LOG_ERR, "Could not add source to epoll: %s", strerror(errno));
+      logmsg(LOG_ERR, "Could not modify source in epoll: %s", strerror(errno));
 
-      free(pommed_ev);
       return -1;
     }
 
-  sources = pommed_ev;
+  pommed_ev->events = events;
 
   return 0;
 }
@@ -98,242 +221,536 @@ evloop_remove(int fd)
 {
   int ret;
 
-  struct pommed_event *p;
-  struct pommed_event *e;
-
-  ret = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  struct pommed_event *pommed_ev;
 
-  if (ret < 0)
+  pommed_ev = evloop_lookup(fd);
+  if (pommed_ev == NULL)
     {
-      logmsg(LOG_ERR, "Could not remove source from epoll: %s", strerror(errno));
+      logmsg(LOG_ERR, "Could not remove source %d: not registered", fd);
 
       return -1;
     }
 
-  for (p = NULL, e = sources; e != NULL; p = e, e = e->next)
+  ret = 0;
+  if (pommed_ev->events != 0)
     {
-      if (e->fd != fd)
-	continue;
+      ret = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
 
-      if (p != NULL)
-	p->next = e->next;
-      else
-	sources = e->next;
+      /* Gone from the table anyway; epoll drops closed fds by itself */
+      if (ret < 0)
+	logmsg(LOG_ERR, "Could not remove source from epoll: %s", strerror(errno));
+    }
 
-      free(e);
+  sources[fd] = NULL;
+  free(pommed_ev);
 
-      break;
-    }
+  return ret;
+}
 
-  return 0;
+
+/* Timer slots: the low bits of a timer id index the slot table,
+ * the high bits carry a generation counter so that a stale id
+ * never matches a timer that reused the same slot.
+ */
+#define TIMER_SLOT_BITS     16
+#define TIMER_SLOT_MASK     ((1 << TIMER_SLOT_BITS) - 1)
+#define TIMER_GEN_MAX       0x7fff
+
+#define NSEC_PER_MSEC       1000000ULL
+#define NSEC_PER_SEC        1000000000ULL
+
+
+/* CLOCK_MONOTONIC, in ns */
+uint64_t
+evloop_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 }
 
 
-static void
-evloop_timer_callback(int fd, uint32_t events)
+/* Statistics: with evloop_enable_stats(), every callback is timed and
+ * accounted to its entry; otherwise the dispatch paths only test
+ * stats_enabled.
+ */
+void
+evloop_stat_add(struct evloop_stat *s, uint64_t t)
 {
-  uint64_t ticks;
+  uint64_t us;
+  int b;
 
-  struct pommed_timer *t;
-  struct pommed_timer_job *j;
+  s->calls++;
+  s->total += t;
+  if (t > s->max)
+    s->max = t;
 
-  /* Acknowledge timer */
-  read(fd, &ticks, sizeof(ticks));
+  us = t / 1000;
+  b = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+  if (b >= EVLOOP_HIST_BUCKETS)
+    b = EVLOOP_HIST_BUCKETS - 1;
 
-  j = NULL;
-  for (t = timers; t != NULL; t = t->next)
-    {
-      if (t->fd == fd)
-	{
-	  j = t->jobs;
+  s->hist[b]++;
+}
 
-	  break;
-	}
+static void
+evloop_account(const void *cb, const char *name, uint64_t start)
+{
+  uint64_t t;
+  int i;
+
+  t = evloop_now() - start;
+
+  for (i = 0; i < n_stats; i++)
+    {
+      if (stats[i].cb == cb)
+	break;
     }
 
-  while (j != NULL)
+  if (i == n_stats)
     {
-      j->cb(j->id, ticks);
+      if (n_stats == EVLOOP_MAX_STATS)
+	return;
 
-      j = j->next;
+      stats[i].cb = cb;
+      stats[i].name = name;
+      n_stats++;
     }
+
+  evloop_stat_add(&stats[i], t);
 }
 
-static int
-evloop_create_timer(int timeout)
+
+/* Min-heap helpers */
+static void
+timer_heap_swap(int a, int b)
 {
-  int fd;
-  int ret;
+  struct pommed_timer *t;
 
-  struct itimerspec timing;
+  t = timer_heap[a];
+  timer_heap[a] = timer_heap[b];
+  timer_heap[b] = t;
 
-  fd = timerfd_create(CLOCK_MONOTONIC, 0);
-  if (fd < 0)
+  timer_heap[a]->heap_idx = a;
+  timer_heap[b]->heap_idx = b;
+}
+
+static void
+timer_heap_up(int i)
+{
+  int parent;
+
+  while (i > 0)
     {
-      logmsg(LOG_ERR, "Could not create timer: %s", strerror(errno));
+      parent = (i - 1) / 2;
 
-      return -1;
+      if (timer_heap[parent]->deadline <= timer_heap[i]->deadline)
+	break;
+
+      timer_heap_swap(i, parent);
+      i = parent;
     }
+}
 
-  timing.it_interval.tv_sec = (timeout >= 1000) ? timeout / 1000 : 0;
-  timing.it_interval.tv_nsec = (timeout - (timing.it_interval.tv_sec * 1000)) * 1000000;
+static void
+timer_heap_down(int i)
+{
+  int child;
 
-  ret = clock_gettime(CLOCK_MONOTONIC, &timing.it_value);
-  if (ret < 0)
+  for (;;)
     {
-      logmsg(LOG_ERR, "Could not get current time: %s", strerror(errno));
+      child = 2 * i + 1;
 
-      close(fd);
-      return -1;
+      if (child >= timer_heap_len)
+	break;
+
+      if ((child + 1 < timer_heap_len)
+	  && (timer_heap[child + 1]->deadline < timer_heap[child]->deadline))
+	child++;
+
+      if (timer_heap[i]->deadline <= timer_heap[child]->deadline)
+	break;
+
+      timer_heap_swap(i, child);
+      i = child;
     }
+}
+
+static void
+timer_heap_fix(int i)
+{
+  if ((i > 0) && (timer_heap[(i - 1) / 2]->deadline > timer_heap[i]->deadline))
+    timer_heap_up(i);
+  else
+    timer_heap_down(i);
+}
+
+static void
+timer_heap_remove(struct pommed_timer *t)
+{
+  int i;
 
-  timing.it_value.tv_sec += timing.it_interval.tv_sec;
-  timing.it_value.tv_nsec += timing.it_interval.tv_nsec;
-  if (timing.it_value.tv_nsec > 1000000000)
+  i = t->heap_idx;
+  timer_heap_len--;
+
+  if (i != timer_heap_len)
     {
-      timing.it_value.tv_sec++;
-      timing.it_value.tv_nsec -= 1000000000;
+      timer_heap[i] = timer_heap[timer_heap_len];
+      timer_heap[i]->heap_idx = i;
+
+      timer_heap_fix(i);
     }
 
-  ret = timerfd_settime(fd, TFD_TIMER_ABSTIME, &timing, NULL);
+  t->heap_idx = -1;
+}
+
+
+/* Arm the timerfd for the earliest deadline, if it changed */
+static void
+evloop_timer_rearm(void)
+{
+  struct itimerspec timing;
+  uint64_t deadline;
+  int ret;
+
+  deadline = (timer_heap_len > 0) ? timer_heap[0]->deadline : 0;
+
+  if (deadline == timer_armed)
+    return;
+
+  memset(&timing, 0, sizeof(timing));
+
+  timing.it_value.tv_sec = deadline / NSEC_PER_SEC;
+  timing.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+
+  ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timing, NULL);
   if (ret < 0)
     {
       logmsg(LOG_ERR, "Could not setup timer: %s", strerror(errno));
 
-      close(fd);
-      return -1;
+      return;
     }
 
-  ret = evloop_add(fd, EPOLLIN, evloop_timer_callback);
-  if (ret < 0)
-    {
-      close(fd);
-      return -1;
-    }
+  timer_armed = deadline;
+}
+
+static struct pommed_timer *
+evloop_find_timer(int id)
+{
+  struct pommed_timer *t;
+  int slot;
 
-  return fd;
+  if (id <= 0)
+    return NULL;
+
+  slot = id & TIMER_SLOT_MASK;
+  if (slot >= timer_slots_size)
+    return NULL;
+
+  t = timer_slots[slot];
+  if ((t == NULL) || (t->id != id))
+    return NULL;
+
+  return t;
 }
 
-int
-evloop_add_timer(int timeout, pommed_timer_cb cb)
+static void
+evloop_free_timer(struct pommed_timer *t)
 {
-  int fd;
+  int slot;
+
+  slot = t->id & TIMER_SLOT_MASK;
+
+  timer_slots[slot] = NULL;
+  timer_free[timer_free_len] = slot;
+  timer_free_len++;
+
+  free(t);
+}
+
+
+static void
+evloop_timer_callback(int fd, uint32_t events)
+{
+  uint64_t expirations;
+  uint64_t now;
+  uint64_t ticks;
+  uint64_t interval;
+  int id;
 
   struct pommed_timer *t;
-  struct pommed_timer_job *j;
+  pommed_timer_cb cb;
+  const char *name;
+  uint64_t start;
+
+  /* Acknowledge timer; the fd is non-blocking */
+  read(fd, &expirations, sizeof(expirations));
 
-  j = (struct pommed_timer_job *)malloc(sizeof(struct pommed_timer_job));
-  if (j == NULL)
+  counters.timer_wakeups++;
+
+  /* The kernel disarmed the timer when it fired */
+  timer_armed = 0;
+
+  now = evloop_now();
+
+  while ((timer_heap_len > 0) && (timer_heap[0]->deadline <= now))
     {
-      logmsg(LOG_ERR, "Could not allocate memory for timer job");
-      return -1;
+      t = timer_heap[0];
+
+      id = t->id;
+      cb = t->cb;
+      name = t->name;
+
+      if (t->oneshot)
+	{
+	  ticks = 1;
+
+	  timer_heap_remove(t);
+	  evloop_free_timer(t);
+	}
+      else
+	{
+	  /* Account for missed expirations, like timerfd does */
+	  interval = t->timeout * NSEC_PER_MSEC;
+	  ticks = 1 + (now - t->deadline) / interval;
+
+	  t->deadline += ticks * interval;
+	  timer_heap_down(0);
+	}
+
+      /* The callback may add, modify or remove timers, including itself */
+      if (stats_enabled)
+	{
+	  start = evloop_now();
+	  cb(id, ticks);
+	  evloop_account(cb, name, start);
+	}
+      else
+	cb(id, ticks);
     }
 
-  j->cb = cb;
-  j->id = timer_job_id;
-  timer_job_id++;
+  evloop_timer_rearm();
+}
 
-  for (t = timers; t != NULL; t = t->next)
+/* Periodic timer, fires every timeout ms until removed, or one-shot
+ * timer, fires once after timeout ms then goes away; see evloop.h.
+ */
+int
+evloop_add_timer_named(int timeout, int oneshot, pommed_timer_cb cb, const char *name)
+{
+  struct pommed_timer *t;
+  struct pommed_timer **slots;
+  struct pommed_timer **heap;
+  int *freelist;
+  int slot;
+  int size;
+  int i;
+
+  /* Periodic timers need a non-zero interval */
+  if ((timeout < 0) || (!oneshot && (timeout == 0)))
     {
-      if (t->timeout == timeout)
-	break;
+      logmsg(LOG_ERR, "Invalid timer timeout %d", timeout);
+
+      return -1;
     }
 
-  if (t == NULL)
+  if (timer_free_len == 0)
     {
-      t = (struct pommed_timer *)malloc(sizeof(struct pommed_timer));
-      if (t == NULL)
+      size = (timer_slots_size > 0) ? timer_slots_size * 2 : 8;
+      if (size > TIMER_SLOT_MASK + 1)
+	{
+	  logmsg(LOG_ERR, "Too many timers");
+
+	  return -1;
+	}
+
+      slots = (struct pommed_timer **)realloc(timer_slots, size * sizeof(*slots));
+      if (slots == NULL)
+	{
+	  logmsg(LOG_ERR, "Could not allocate memory for timer");
+	  return -1;
+	}
+      timer_slots = slots;
+
+      heap = (struct pommed_timer **)realloc(timer_heap, size * sizeof(*heap));
+      if (heap == NULL)
 	{
 	  logmsg(LOG_ERR, "Could not allocate memory for timer");
 	  return -1;
 	}
+      timer_heap = heap;
 
-      fd = evloop_create_timer(timeout);
-      if (fd < 0)
+      freelist = (int *)realloc(timer_free, size * sizeof(*freelist));
+      if (freelist == NULL)
 	{
-	  free(t);
+	  logmsg(LOG_ERR, "Could not allocate memory for timer");
 	  return -1;
 	}
+      timer_free = freelist;
 
-      t->fd = fd;
-      t->timeout = timeout;
-      t->jobs = NULL;
-      t->next = timers;
-      timers = t;
+      /* Push the new slots in reverse so that the lowest one comes out first */
+      for (i = size - 1; i >= timer_slots_size; i--)
+	{
+	  timer_slots[i] = NULL;
+	  timer_free[timer_free_len] = i;
+	  timer_free_len++;
+	}
+
+      timer_slots_size = size;
     }
 
-  j->next = t->jobs;
-  t->jobs = j;
+  t = (struct pommed_timer *)malloc(sizeof(struct pommed_timer));
+  if (t == NULL)
+    {
+      logmsg(LOG_ERR, "Could not allocate memory for timer");
+      return -1;
+    }
 
-  return 0;
+  timer_free_len--;
+  slot = timer_free[timer_free_len];
+
+  timer_gen++;
+  if (timer_gen > TIMER_GEN_MAX)
+    timer_gen = 1;
+
+  t->id = (timer_gen << TIMER_SLOT_BITS) | slot;
+  t->timeout = timeout;
+  t->oneshot = oneshot;
+  t->cb = cb;
+  t->name = name;
+  t->deadline = evloop_now() + timeout * NSEC_PER_MSEC;
+
+  timer_slots[slot] = t;
+
+  t->heap_idx = timer_heap_len;
+  timer_heap[timer_heap_len] = t;
+  timer_heap_len++;
+
+  timer_heap_up(t->heap_idx);
+
+  evloop_timer_rearm();
+
+  return t->id;
 }
 
+/* Restart a timer with a new timeout, counted from now */
 int
-evloop_remove_timer(int id)
+evloop_mod_timer(int id, int timeout)
 {
-  int found;
-  int ret;
-
   struct pommed_timer *t;
-  struct pommed_timer *pt;
-  struct pommed_timer_job *j;
-  struct pommed_timer_job *pj;
 
-  found = 0;
-  for (pt = NULL, t = timers; t != NULL; pt = t, t = t->next)
-    {
-      for (pj = NULL, j = t->jobs; j != NULL; pj = j, j = j->next)
-	{
-	  if (j->id == id)
-	    {
-	      if (pj != NULL)
-		pj->next = j->next;
-	      else
-		t->jobs = j->next;
+  t = evloop_find_timer(id);
+  if (t == NULL)
+    return -1;
 
-	      free(j);
+  if ((timeout < 0) || (!t->oneshot && (timeout == 0)))
+    return -1;
 
-	      found = 1;
+  t->timeout = timeout;
+  t->deadline = evloop_now() + timeout * NSEC_PER_MSEC;
 
-	      break;
-	    }
-	}
+  timer_heap_fix(t->heap_idx);
 
-      if (found)
-	break;
-    }
+  evloop_timer_rearm();
+
+  return 0;
+}
 
+int
+evloop_remove_timer(int id)
+{
+  struct pommed_timer *t;
+
+  t = evloop_find_timer(id);
   if (t == NULL)
     return 0;
 
-  if (t->jobs == NULL)
-    {
-      ret = evloop_remove(t->fd);
-      if (ret < 0)
-	return ret;
+  timer_heap_remove(t);
+  evloop_free_timer(t);
 
-      close(t->fd);
+  evloop_timer_rearm();
 
-      if (pt != NULL)
-	pt->next = t->next;
-      else
-	timers = t->next;
+  return 0;
+}
+
+
+/* Deferred callbacks let a burst of updates made while handling
+ * events be acted upon once, after all the events have been handled.
+ * Deferring the same callback twice in an iteration runs it once.
+ */
+int
+evloop_defer_named(pommed_defer_cb cb, const char *name)
+{
+  int i;
 
-      free(t);
+  for (i = 0; i < n_deferred; i++)
+    {
+      if (deferred[i].cb == cb)
+	return 0;
     }
 
+  if (n_deferred == MAX_DEFERRED)
+    {
+      logmsg(LOG_ERR, "Too many deferred callbacks");
+
+      return -1;
+    }
+
+  deferred[n_deferred].cb = cb;
+  deferred[n_deferred].name = name;
+  n_deferred++;
+
   return 0;
 }
 
+static void
+evloop_run_deferred(void)
+{
+  pommed_defer_cb run[MAX_DEFERRED];
+  const char *names[MAX_DEFERRED];
+  uint64_t start;
+  int n;
+  int i;
+
+  /* Callbacks may defer themselves again for the next iteration */
+  n = n_deferred;
+  for (i = 0; i < n; i++)
+    {
+      run[i] = deferred[i].cb;
+      names[i] = deferred[i].name;
+    }
+  n_deferred = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      if (stats_enabled)
+	{
+	  start = evloop_now();
+	  run[i]();
+	  evloop_account(run[i], names[i], start);
+	}
+      else
+	run[i]();
+    }
+}
+
 
 int
 evloop_iteration(void)
 {
   int i;
   int nfds;
+  int fd;
+  uint64_t iter_start;
+  uint64_t start;
+  uint64_t stall;
 
   struct epoll_event epoll_ev[MAX_EPOLL_EVENTS];
   struct pommed_event *pommed_ev;
+  pommed_event_cb cb;
+  const char *name;
 
   if (!running)
     return -1;
@@ -352,10 +769,45 @@ evloop_iteration(void)
 	}
     }
 
+  counters.wakeups++;
+  counters.events += nfds;
+
+  iter_start = (stats_enabled) ? evloop_now() : 0;
+
   for (i = 0; i < nfds; i++)
     {
-      pommed_ev = epoll_ev[i].data.ptr;
-      pommed_ev->cb(pommed_ev->fd, epoll_ev[i].events);
+      fd = (int)(epoll_ev[i].data.u64 & 0xffffffff);
+
+      /* An earlier callback may have removed this source, and maybe
+       * registered a new one on the same fd
+       */
+      pommed_ev = evloop_lookup(fd);
+      if ((pommed_ev == NULL) || (pommed_ev->gen != (epoll_ev[i].data.u64 >> 32)))
+	continue;
+
+      /* The timers are accounted individually (name is NULL) */
+      if (stats_enabled && (pommed_ev->name != NULL))
+	{
+	  /* The source may be gone when the callback returns */
+	  cb = pommed_ev->cb;
+	  name = pommed_ev->name;
+
+	  start = evloop_now();
+	  cb(fd, epoll_ev[i].events);
+	  evloop_account(cb, name, start);
+	}
+      else
+	pommed_ev->cb(fd, epoll_ev[i].events);
+    }
+
+  if (n_deferred > 0)
+    evloop_run_deferred();
+
+  if (iter_start != 0)
+    {
+      stall = evloop_now() - iter_start;
+      if (stall > counters.max_stall)
+	counters.max_stall = stall;
     }
 
   return nfds;
@@ -367,14 +819,112 @@ evloop_stop(void)
   running = 0;
 }
 
+void
+evloop_get_counters(struct evloop_counters *c)
+{
+  *c = counters;
+}
+
+
+void
+evloop_enable_stats(void)
+{
+  stats_enabled = 1;
+}
+
+int
+evloop_stats_enabled(void)
+{
+  return stats_enabled;
+}
+
+/* Entries in order of first call */
+int
+evloop_get_stats(const struct evloop_stat **s)
+{
+  *s = stats;
+
+  return n_stats;
+}
+
+/* One line per entry, the histogram buckets by lower bound in us */
+void
+evloop_log_stat(const struct evloop_stat *s)
+{
+  char hist[EVLOOP_HIST_BUCKETS * 24];
+  int len;
+  int b;
+
+  len = 0;
+  for (b = 0; b < EVLOOP_HIST_BUCKETS; b++)
+    {
+      if (s->hist[b] == 0)
+	continue;
+
+      len += snprintf(hist + len, sizeof(hist) - len, " %s%lluus:%u",
+		      (b == 0) ? "<" : "", (b == 0) ? 1ULL : 1ULL << (b - 1), s->hist[b]);
+    }
+  hist[len] = '\0';
+
+  logmsg(LOG_INFO, "  %s: %llu calls, avg %llu us, max %llu us;%s",
+	 s->name, (unsigned long long)s->calls,
+	 (unsigned long long)(s->total / s->calls / 1000),
+	 (unsigned long long)(s->max / 1000), hist);
+}
+
+void
+evloop_dump_stats(void)
+{
+  uint64_t elapsed;
+  int i;
+
+  elapsed = (evloop_now() - start_time) / NSEC_PER_SEC;
+
+  logmsg(LOG_INFO, "Event loop: %llu wakeups, %llu from timers, %llu events over %llu s",
+	 (unsigned long long)counters.wakeups,
+	 (unsigned long long)counters.timer_wakeups,
+	 (unsigned long long)counters.events,
+	 (unsigned long long)elapsed);
+
+  if (!stats_enabled)
+    {
+      logmsg(LOG_INFO, "Event loop: statistics not enabled (pommed -s)");
+
+      return;
+    }
+
+  logmsg(LOG_INFO, "Event loop: longest iteration %llu us",
+	 (unsigned long long)(counters.max_stall / 1000));
+
+  for (i = 0; i < n_stats; i++)
+    evloop_log_stat(&stats[i]);
+}
+
 
 int
 evloop_init(void)
 {
+  int ret;
+
   sources = NULL;
+  sources_size = 0;
+  sources_gen = 0;
+
+  timer_heap = NULL;
+  timer_heap_len = 0;
+  timer_slots = NULL;
+  timer_slots_size = 0;
+  timer_free = NULL;
+  timer_free_len = 0;
+  timer_armed = 0;
+  timer_gen = 0;
+
+  n_deferred = 0;
 
-  timers = NULL;
-  timer_job_id = 0;
+  memset(&counters, 0, sizeof(counters));
+  memset(stats, 0, sizeof(stats));
+  n_stats = 0;
+  start_time = evloop_now();
 
   running = 1;
 
@@ -386,43 +936,74 @@ evloop_init(void)
       return -1;
     }
 
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (timer_fd < 0)
+    {
+      logmsg(LOG_ERR, "Could not create timer: %s", strerror(errno));
+
+      close(epfd);
+      return -1;
+    }
+
+  fcntl(timer_fd, F_SETFL, O_NONBLOCK);
+  fcntl(timer_fd, F_SETFD, FD_CLOEXEC);
+
+  /* No name: the timers are accounted individually */
+  ret = evloop_add_named(timer_fd, EPOLLIN, evloop_timer_callback, NULL);
+  if (ret < 0)
+    {
+      close(timer_fd);
+      close(epfd);
+      return -1;
+    }
+
   return 0;
 }
 
 void
 evloop_cleanup(void)
 {
-  struct pommed_event *p;
-  struct pommed_timer *t;
-  struct pommed_timer_job *j;
-  struct pommed_timer_job *jobs;
+  uint64_t elapsed;
+  int i;
+
+  elapsed = (evloop_now() - start_time) / NSEC_PER_SEC;
+
+  logdebug("Event loop: %llu wakeups, %llu from timers, over %llu s\n",
+	   (unsigned long long)counters.wakeups,
+	   (unsigned long long)counters.timer_wakeups,
+	   (unsigned long long)elapsed);
 
   close(epfd);
 
-  while (sources != NULL)
+  for (i = 0; i < sources_size; i++)
     {
-      p = sources;
-      sources = sources->next;
+      if (sources[i] == NULL)
+	continue;
 
-      close(p->fd);
+      close(i);
 
-      free(p);
+      free(sources[i]);
     }
 
-  while (timers != NULL)
-    {
-      t = timers;
-      timers = timers->next;
+  free(sources);
+  sources = NULL;
+  sources_size = 0;
 
-      jobs = t->jobs;
-      while (jobs != NULL)
-	{
-	  j = jobs;
-	  jobs = jobs->next;
+  /* timer_fd was closed along with the other sources */
+  for (i = 0; i < timer_slots_size; i++)
+    {
+      if (timer_slots[i] != NULL)
+	free(timer_slots[i]);
+    }
 
-	  free(j);
-	}
+  free(timer_slots);
+  free(timer_heap);
+  free(timer_free);
 
-      free(t);
-    }
+  timer_slots = NULL;
+  timer_heap = NULL;
+  timer_free = NULL;
+  timer_slots_size = 0;
+  timer_heap_len = 0;
+  timer_free_len = 0;
 }
@@ -7,54 +7,135 @@
 
 
 #define MAX_EPOLL_EVENTS        8
+#define MAX_DEFERRED            8
+
+/* Statistics: one entry per callback */
+#define EVLOOP_MAX_STATS        32
+/* Bucket 0: < 1us, bucket n: [2^(n-1), 2^n) us, the last one is open */
+#define EVLOOP_HIST_BUCKETS     20
 
 typedef void(*pommed_event_cb)(int fd, uint32_t events);
 
+/* Sources are kept in a table indexed by fd */
 struct pommed_event
 {
   int fd;
+  uint32_t events;   /* 0: parked, registered but not polled */
+  uint32_t gen;      /* tells stale epoll events from a reused fd */
   pommed_event_cb cb;
-  struct pommed_event *next;
+  const char *name;  /* callback name, for the statistics */
+
+  void *data;        /* for the owner, see evloop_lookup() */
 };
 
 typedef void(*pommed_timer_cb)(int id, uint64_t ticks);
 
-struct pommed_timer_job
+/* Run once at the end of the current loop iteration */
+typedef void(*pommed_defer_cb)(void);
+
+/* All timers share a single timerfd; they are kept in a min-heap
+ * ordered by deadline and the timerfd is armed for the earliest one.
+ */
+struct pommed_timer
 {
   int id;
+  int timeout;       /* interval in ms */
+  int oneshot;       /* fire once, then go away */
+  uint64_t deadline; /* CLOCK_MONOTONIC, in ns */
   pommed_timer_cb cb;
+  const char *name;
 
-  struct pommed_timer_job *next;
+  int heap_idx;      /* position in the timer heap */
 };
 
-struct pommed_timer
+struct evloop_counters
 {
-  int fd;
-  int timeout;
-  struct pommed_timer_job *jobs;
+  uint64_t wakeups;       /* epoll_wait() returns with events */
+  uint64_t timer_wakeups; /* of which timerfd expirations */
+  uint64_t events;        /* events dispatched */
+
+  /* Only with statistics enabled */
+  uint64_t max_stall;     /* longest iteration, in ns */
+};
 
-  struct pommed_timer *next;
+struct evloop_stat
+{
+  const void *cb;
+  const char *name;
+
+  uint64_t calls;
+  uint64_t total;         /* ns */
+  uint64_t max;           /* ns */
+  uint32_t hist[EVLOOP_HIST_BUCKETS];
 };
 
 
+/* The callbacks are registered under their own name, which shows up
+ * in the statistics.
+ */
+#define evloop_add(fd, events, cb) \
+  evloop_add_named(fd, events, cb, #cb)
+#define evloop_add_timer(timeout, cb) \
+  evloop_add_timer_named(timeout, 0, cb, #cb)
+#define evloop_add_oneshot_timer(timeout, cb) \
+  evloop_add_timer_named(timeout, 1, cb, #cb)
+#define evloop_defer(cb) \
+  evloop_defer_named(cb, #cb)
+
 int
-evloop_add(int fd, uint32_t events, pommed_event_cb cb);
+evloop_add_named(int fd, uint32_t events, pommed_event_cb cb, const char *name);
+
+int
+evloop_modify(int fd, uint32_t events);
 
 int
 evloop_remove(int fd);
 
+struct pommed_event *
+evloop_lookup(int fd);
+
+int
+evloop_add_timer_named(int timeout, int oneshot, pommed_timer_cb cb, const char *name);
+
 int
-evloop_add_timer(int timeout, pommed_timer_cb cb);
+evloop_mod_timer(int id, int timeout);
 
 int
 evloop_remove_timer(int id);
 
+int
+evloop_defer_named(pommed_defer_cb cb, const char *name);
+
 int
 evloop_iteration(void);
 
 void
 evloop_stop(void);
 
+void
+evloop_get_counters(struct evloop_counters *c);
+
+uint64_t
+evloop_now(void);
+
+void
+evloop_enable_stats(void);
+
+int
+evloop_stats_enabled(void);
+
+int
+evloop_get_stats(const struct evloop_stat **stats);
+
+void
+evloop_dump_stats(void);
+
+void
+evloop_stat_add(struct evloop_stat *s, uint64_t t);
+
+void
+evloop_log_stat(const struct evloop_stat *s);
+
 int
 evloop_init(void);
 
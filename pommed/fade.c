@@ -0,0 +1,88 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pommed.h"
+#include "evloop.h"
+#include "fade.h"
+
+
+/* Fade engine
+ *
+ * Moves a level from one value to another over a given length of time,
+ * one step per timer tick, without blocking the event loop. The owner
+ * supplies the raw write function and the timer callback, which calls
+ * fade_process() and commits the final value (and sends the signal)
+ * when the fade is over.
+ */
+
+int
+fade_start_named(struct fade *f, int from, int to, int length, pommed_timer_cb cb, const char *name)
+{
+  f->steps = length / FADE_INTERVAL;
+  if (f->steps < 1)
+    f->steps = 1;
+
+  f->step = 0;
+  f->from = from;
+  f->to = to;
+  f->cur = from;
+
+  f->timer = evloop_add_timer_named(FADE_INTERVAL, 0, cb, name);
+
+  return (f->timer < 0) ? -1 : 0;
+}
+
+/* Returns 1 when the fade is over and the final value must be committed,
+ * -1 if the fade was aborted, 0 otherwise.
+ */
+int
+fade_process(struct fade *f, uint64_t ticks)
+{
+  f->step += ticks;
+
+  if (f->step >= f->steps)
+    {
+      fade_cancel(f);
+
+      return 1;
+    }
+
+  f->cur = f->from + ((f->to - f->from) * f->step) / f->steps;
+
+  if (f->write(f->cur) < 0)
+    {
+      fade_cancel(f);
+
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+fade_cancel(struct fade *f)
+{
+  if (f->timer > 0)
+    evloop_remove_timer(f->timer);
+
+  f->timer = -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * pommed - fade.h
+ */
+
+#ifndef __FADE_H__
+#define __FADE_H__
+
+/* One fade step every FADE_INTERVAL ms */
+#define FADE_INTERVAL        20
+/* Longest fade accepted from clients (ms) */
+#define FADE_MAX_LENGTH      10000
+
+
+struct fade
+{
+  int timer;  /* > 0 while a fade is in progress */
+  int steps;
+  int step;
+  int from;
+  int to;
+  int cur;    /* last value written */
+
+  int (*write)(int val);
+};
+
+
+/* Like evloop_add_timer(), names the timer after the callback */
+#define fade_start(f, from, to, length, cb) \
+  fade_start_named(f, from, to, length, cb, #cb)
+
+int
+fade_start_named(struct fade *f, int from, int to, int length, pommed_timer_cb cb, const char *name);
+
+int
+fade_process(struct fade *f, uint64_t ticks);
+
+void
+fade_cancel(struct fade *f);
+
+
+#endif /* !__FADE_H__ */
@@ -19,6 +19,124 @@
 
 
 static int kbd_timer;
+static int kbd_timeout; /* current ambient sampling interval */
+
+
+/* Automatic changes fade the backlight over KBD_BACKLIGHT_FADE_LENGTH ms
+ * (see fade.c). A new request retargets or cancels the fade in progress.
+ *
+ * The platform code provides kbd_backlight_get() and kbd_backlight_write().
+ */
+static struct fade kbd_fade = { .timer = -1, .write = kbd_backlight_write };
+static int kbd_fade_who;
+
+
+static void
+kbd_backlight_commit(int val, int who)
+{
+  if (kbd_backlight_write(val) < 0)
+    return;
+
+  latency_mark(LATENCY_KBD, LATENCY_WRITE);
+
+  logdebug("KBD backlight value set to %d\n", val);
+
+  mbpdbus_send_kbd_backlight(val, kbd_bck_info.level, who);
+
+  kbd_bck_info.level = val;
+}
+
+static void
+kbd_fade_process(int id, uint64_t ticks)
+{
+  int ret;
+
+  ret = fade_process(&kbd_fade, ticks);
+
+  if (ret > 0)
+    kbd_backlight_commit(kbd_fade.to, kbd_fade_who);
+  else if (ret == 0)
+    logdebug("KBD backlight value faded to %d\n", kbd_fade.cur);
+}
+
+static void
+kbd_fade_start(int from, int to, int who, int length)
+{
+  kbd_fade_who = who;
+
+  /* No timer, no fade */
+  if (fade_start(&kbd_fade, from, to, length, kbd_fade_process) < 0)
+    kbd_backlight_commit(to, who);
+}
+
+/* Level the backlight is at, or is fading to */
+static int
+kbd_backlight_target(void)
+{
+  if (kbd_fade.timer > 0)
+    return kbd_fade.to;
+
+  return kbd_bck_info.level;
+}
+
+static void
+kbd_backlight_fade_to(int val, int who, int length)
+{
+  int curval;
+
+  if (kbd_bck_info.inhibit & ~KBD_INHIBIT_CFG)
+    return;
+
+  if ((val < KBD_BACKLIGHT_OFF) || (val > KBD_BACKLIGHT_MAX))
+    return;
+
+  /* Already fading there */
+  if ((kbd_fade.timer > 0) && (kbd_fade.to == val) && (who == KBD_AUTO))
+    return;
+
+  if (kbd_fade.timer > 0)
+    curval = kbd_fade.cur;
+  else
+    curval = kbd_backlight_get();
+
+  /* Any new request overrides the fade in progress */
+  fade_cancel(&kbd_fade);
+
+  if (val == curval)
+    {
+      /* Fade interrupted right there */
+      if (val != kbd_bck_info.level)
+	kbd_backlight_commit(val, who);
+
+      return;
+    }
+
+  if ((length > 0) && (curval >= 0))
+    kbd_fade_start(curval, val, who, length);
+  else
+    kbd_backlight_commit(val, who);
+}
+
+static void
+kbd_backlight_set(int val, int who)
+{
+  kbd_backlight_fade_to(val, who, (who == KBD_AUTO) ? KBD_BACKLIGHT_FADE_LENGTH : 0);
+}
+
+/* Absolute level requested by a client, optionally faded */
+void
+kbd_backlight_set_level(int val, int length)
+{
+  if (val < KBD_BACKLIGHT_OFF)
+    val = KBD_BACKLIGHT_OFF;
+  else if (val > KBD_BACKLIGHT_MAX)
+    val = KBD_BACKLIGHT_MAX;
+
+  if (length > FADE_MAX_LENGTH)
+    length = FADE_MAX_LENGTH;
+
+  kbd_backlight_fade_to(val, KBD_USER, length);
+}
 
 
 /* simple backlight toggle */
@@ -49,12 +167,15 @@ void
 kbd_backlight_inhibit_set(int mask)
 {
   int lvl;
+  int target;
+
+  target = kbd_backlight_target();
 
   if (!kbd_bck_info.inhibit)
-    kbd_bck_info.inhibit_lvl = kbd_bck_info.level;
+    kbd_bck_info.inhibit_lvl = target;
 
   if (mask & KBD_INHIBIT_IDLE)
-    lvl = (kbd_cfg.idle_lvl < kbd_bck_info.level) ? kbd_cfg.idle_lvl : kbd_bck_info.level;
+    lvl = (kbd_cfg.idle_lvl < target) ? kbd_cfg.idle_lvl : target;
   else
     lvl = KBD_BACKLIGHT_OFF;
 
@@ -99,24 +220,30 @@ kbd_backlight_inhibit_toggle(int mask)
 }
 
 
-void
+/* Returns 1 if the ambient light changed noticeably since the last check */
+int
 kbd_backlight_ambient_check(void)
 {
   int amb_r, amb_l;
+  int changed;
 
   ambient_get(&amb_r, &amb_l);
 
   if ((amb_r < 0) || (amb_l < 0))
-    return;
+    return 0;
 
-  mbpdbus_send_ambient_light(amb_l, kbd_bck_info.l_sens, amb_r, kbd_bck_info.r_sens);
+  changed = ((abs(amb_r - kbd_bck_info.r_sens) > KBD_AMBIENT_JITTER)
+	     || (abs(amb_l - kbd_bck_info.l_sens) > KBD_AMBIENT_JITTER));
+
+  if ((amb_r != kbd_bck_info.r_sens) || (amb_l != kbd_bck_info.l_sens))
+    mbpdbus_send_ambient_light(amb_l, kbd_bck_info.l_sens, amb_r, kbd_bck_info.r_sens);
 
   kbd_bck_info.r_sens = amb_r;
   kbd_bck_info.l_sens = amb_l;
 
   /* Inhibited */
   if (kbd_bck_info.inhibit)
-    return;
+    return changed;
 
   if ((amb_r < kbd_cfg.on_thresh) && (amb_l < kbd_cfg.on_thresh))
     {
@@ -124,7 +251,7 @@ kbd_backlight_ambient_check(void)
 
       /* backlight already on */
       if (kbd_backlight_get() > KBD_BACKLIGHT_OFF)
-	return;
+	return changed;
 
       /* turn on backlight */
       kbd_bck_info.auto_on = 1;
@@ -142,25 +269,79 @@ kbd_backlight_ambient_check(void)
 	  kbd_backlight_set(KBD_BACKLIGHT_OFF, KBD_AUTO);
 	}
     }
+
+  return changed;
 }
 
 
+static void
+kbd_auto_set_timeout(int timeout)
+{
+  if (timeout == kbd_timeout)
+    return;
+
+  kbd_timeout = timeout;
+
+  if (kbd_timer > 0)
+    evloop_mod_timer(kbd_timer, kbd_timeout);
+}
+
 static void
 kbd_auto_process(int id, uint64_t ticks)
 {
+  int timeout;
+  int idle_left;
+
   /* Increment keyboard backlight idle timer */
-  kbd_bck_info.idle += KBD_TIMEOUT;
+  kbd_bck_info.idle += kbd_timeout * ticks;
   if ((kbd_cfg.idle > 0) && (kbd_bck_info.idle > 1000 * kbd_cfg.idle))
     kbd_backlight_inhibit_set(KBD_INHIBIT_IDLE);
 
-  kbd_backlight_ambient_check();
+  /* Sample the ambient light sensors at KBD_TIMEOUT while the readings
+   * change, back off exponentially up to KBD_TIMEOUT_MAX while they
+   * are stable.
+   */
+  if (kbd_backlight_ambient_check())
+    timeout = KBD_TIMEOUT;
+  else
+    {
+      timeout = kbd_timeout * 2;
+      if (timeout > KBD_TIMEOUT_MAX)
+	timeout = KBD_TIMEOUT_MAX;
+    }
+
+  /* Don't overshoot the idle deadline */
+  if ((kbd_cfg.idle > 0) && !(kbd_bck_info.inhibit & KBD_INHIBIT_IDLE))
+    {
+      idle_left = 1000 * kbd_cfg.idle - kbd_bck_info.idle;
+
+      if (idle_left < timeout)
+	timeout = (idle_left > KBD_TIMEOUT) ? idle_left : KBD_TIMEOUT;
+    }
+
+  kbd_auto_set_timeout(timeout);
+}
+
+/* User activity on the internal keyboard */
+void
+kbd_backlight_idle_reset(void)
+{
+  kbd_bck_info.idle = 0;
+  kbd_backlight_inhibit_clear(KBD_INHIBIT_IDLE);
+
+  /* The user is there, go back to fast sampling */
+  kbd_auto_set_timeout(KBD_TIMEOUT);
 }
 
 
 static int
 kbd_auto_init(void)
 {
-  kbd_timer = evloop_add_timer(KBD_TIMEOUT, kbd_auto_process);
+  kbd_fade.timer = -1;
+
+  kbd_timeout = KBD_TIMEOUT;
+
+  kbd_timer = evloop_add_timer(kbd_timeout, kbd_auto_process);
   if (kbd_timer < 0)
     return -1;
 
@@ -172,4 +353,14 @@ kbd_auto_cleanup(void)
 {
   if (kbd_timer > 0)
     evloop_remove_timer(kbd_timer);
+
+  kbd_timer = -1;
+
+  /* Jump to the end of the fade in progress */
+  if (kbd_fade.timer > 0)
+    {
+      fade_cancel(&kbd_fade);
+
+      kbd_backlight_commit(kbd_fade.to, kbd_fade_who);
+    }
 }
@@ -10,7 +10,6 @@
 
 /* fading duration in milliseconds */
 #define KBD_BACKLIGHT_FADE_LENGTH 350
-#define KBD_BACKLIGHT_FADE_STEPS 20
 
 #define KBD_INHIBIT_USER        (1 << 0)
 #define KBD_INHIBIT_LID         (1 << 1)
@@ -22,7 +21,12 @@
 #define KBD_USER     0
 #define KBD_AUTO     1
 
+/* ambient light sampling interval, adaptive (ms) */
 #define KBD_TIMEOUT 200
+#define KBD_TIMEOUT_MAX 3200
+
+/* ambient sensor variation considered as noise */
+#define KBD_AMBIENT_JITTER 2
 
 
 struct _kbd_bck_info
@@ -95,6 +99,9 @@ kbd_backlight_fix_config(void);
 void
 kbd_backlight_toggle(void);
 
+void
+kbd_backlight_set_level(int val, int length);
+
 void
 kbd_backlight_inhibit_set(int mask);
 
@@ -104,8 +111,11 @@ kbd_backlight_inhibit_clear(int mask);
 void
 kbd_backlight_inhibit_toggle(int mask);
 
-void
+int
 kbd_backlight_ambient_check(void);
 
+void
+kbd_backlight_idle_reset(void);
+
 
 #endif /* !__KBD_BACKLIGHT_H__ */
@@ -0,0 +1,198 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <syslog.h>
+
+#include "pommed.h"
+#include "evloop.h"
+#include "latency.h"
+
+
+/* Key-to-action latency, with event loop statistics enabled.
+ *
+ * A hotkey opens a trace for its action, stamped with the kernel
+ * timestamp of the input event (CLOCK_MONOTONIC, see evdev.c). The
+ * code doing the work marks the points it reaches; each mark records
+ * the time elapsed since the keypress in the histogram for that action
+ * and point. Auto-repeated keys coalesced into one step keep the stamp
+ * of the first key not acted upon yet.
+ */
+
+#define LATENCY_BIT(p)        (1 << (p))
+
+static struct
+{
+  uint64_t stamp;  /* keypress, 0 if no trace open */
+  int pending;     /* points not reached yet */
+} traces[LATENCY_ACTIONS];
+
+/* Points each action goes through */
+static const int latency_points[LATENCY_ACTIONS] =
+  {
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL),                             /* LCD up */
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL),                             /* LCD down */
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL),                             /* kbd */
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL) | LATENCY_BIT(LATENCY_BEEP), /* volume */
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL),                             /* mute */
+    LATENCY_BIT(LATENCY_WRITE) | LATENCY_BIT(LATENCY_SIGNAL),                             /* eject */
+  };
+
+static const char *latency_names[LATENCY_ACTIONS][LATENCY_POINTS] =
+  {
+    { "lcd-up:write", "lcd-up:signal", "lcd-up:beep" },
+    { "lcd-down:write", "lcd-down:signal", "lcd-down:beep" },
+    { "kbd:write", "kbd:signal", "kbd:beep" },
+    { "volume:write", "volume:signal", "volume:beep" },
+    { "mute:write", "mute:signal", "mute:beep" },
+    { "eject:write", "eject:signal", "eject:beep" },
+  };
+
+static struct evloop_stat stats[LATENCY_ACTIONS * LATENCY_POINTS];
+
+
+static void
+latency_cancel(int action)
+{
+  traces[action].stamp = 0;
+  traces[action].pending = 0;
+}
+
+/* repeat: auto-repeated key; doesn't restart a trace the action
+ * hasn't acted upon yet
+ */
+void
+latency_key(int action, uint64_t stamp, int repeat)
+{
+  if (!evloop_stats_enabled())
+    return;
+
+  if (repeat && (traces[action].pending & LATENCY_BIT(LATENCY_WRITE)))
+    return;
+
+  traces[action].stamp = stamp;
+  traces[action].pending = latency_points[action];
+}
+
+void
+latency_record(int action, int point, uint64_t t)
+{
+  struct evloop_stat *s;
+
+  s = &stats[action * LATENCY_POINTS + point];
+
+  s->name = latency_names[action][point];
+
+  evloop_stat_add(s, t);
+}
+
+/* Returns the keypress stamp for a point reached outside of the main
+ * thread, which computes the latency and hands it back through
+ * latency_record(); 0 if there's no trace waiting for that point.
+ */
+uint64_t
+latency_handoff(int action, int point)
+{
+  uint64_t stamp;
+
+  if (!(traces[action].pending & LATENCY_BIT(point)))
+    return 0;
+
+  stamp = traces[action].stamp;
+
+  traces[action].pending &= ~LATENCY_BIT(point);
+  if (traces[action].pending == 0)
+    latency_cancel(action);
+
+  return stamp;
+}
+
+void
+latency_mark(int action, int point)
+{
+  uint64_t stamp;
+  uint64_t now;
+  uint64_t t;
+
+  stamp = latency_handoff(action, point);
+  if (stamp == 0)
+    return;
+
+  now = evloop_now();
+
+  /* Converted stamps may be a bit ahead, see evdev_key_stamp() */
+  t = (now > stamp) ? now - stamp : 0;
+
+  /* Stale trace; the keypress led nowhere, don't blame this one on it */
+  if (t > LATENCY_TRACE_TIMEOUT * 1000000ULL)
+    {
+      latency_cancel(action);
+      return;
+    }
+
+  latency_record(action, point, t);
+}
+
+/* Called once the key has been acted upon: no write means there was
+ * nothing to do (level at its max already...), so nothing else will
+ * follow; the click, if any, was queued along with the write.
+ */
+void
+latency_done(int action)
+{
+  if (traces[action].pending & LATENCY_BIT(LATENCY_WRITE))
+    {
+      latency_cancel(action);
+      return;
+    }
+
+  traces[action].pending &= ~LATENCY_BIT(LATENCY_BEEP);
+  if (traces[action].pending == 0)
+    latency_cancel(action);
+}
+
+
+/* Entries with calls == 0 have not been reached yet */
+int
+latency_get_stats(const struct evloop_stat **s)
+{
+  *s = stats;
+
+  return LATENCY_ACTIONS * LATENCY_POINTS;
+}
+
+void
+latency_dump_stats(void)
+{
+  int i;
+
+  if (!evloop_stats_enabled())
+    return;
+
+  logmsg(LOG_INFO, "Key-to-action latency:");
+
+  for (i = 0; i < LATENCY_ACTIONS * LATENCY_POINTS; i++)
+    {
+      if (stats[i].calls > 0)
+	evloop_log_stat(&stats[i]);
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * pommed - latency.h
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+
+/* Actions, by the hotkey that triggers them */
+#define LATENCY_LCD_UP         0
+#define LATENCY_LCD_DOWN       1
+#define LATENCY_KBD            2
+#define LATENCY_VOLUME         3
+#define LATENCY_MUTE           4
+#define LATENCY_EJECT          5
+#define LATENCY_ACTIONS        6
+
+/* Points reached by an action, timed from the keypress */
+#define LATENCY_WRITE          0  /* hardware written, eject started */
+#define LATENCY_SIGNAL         1  /* DBus signal sent */
+#define LATENCY_BEEP           2  /* click started */
+#define LATENCY_POINTS         3
+
+/* Traces still incomplete after this long are dropped (ms) */
+#define LATENCY_TRACE_TIMEOUT  10000
+
+
+void
+latency_key(int action, uint64_t stamp, int repeat);
+
+void
+latency_mark(int action, int point);
+
+uint64_t
+latency_handoff(int action, int point);
+
+void
+latency_record(int action, int point, uint64_t t);
+
+void
+latency_done(int action);
+
+int
+latency_get_stats(const struct evloop_stat **stats);
+
+void
+latency_dump_stats(void);
+
+
+#endif /* !__LATENCY_H__ */
@@ -0,0 +1,130 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <syslog.h>
+
+#include "pommed.h"
+#include "evloop.h"
+#include "lcd_backlight.h"
+#include "dbus.h"
+#include "fade.h"
+#include "latency.h"
+
+
+/* Driver-independent LCD backlight operations; the drivers are
+ * reached through mops. Steps and toggles cancel any fade started
+ * by lcd_backlight_set_level().
+ */
+
+static struct fade lcd_fade = { .timer = -1 };
+
+
+static void
+lcd_backlight_commit(int val)
+{
+  val = mops->lcd_backlight_write(val);
+  if (val < 0)
+    return;
+
+  logdebug("LCD backlight value set to %d\n", val);
+
+  mbpdbus_send_lcd_backlight(val, lcd_bck_info.level, LCD_USER);
+
+  lcd_bck_info.level = val;
+}
+
+static void
+lcd_fade_process(int id, uint64_t ticks)
+{
+  int ret;
+
+  ret = fade_process(&lcd_fade, ticks);
+
+  if (ret > 0)
+    lcd_backlight_commit(lcd_fade.to);
+  else if (ret == 0)
+    logdebug("LCD backlight value faded to %d\n", lcd_fade.cur);
+}
+
+
+void
+lcd_backlight_step(int dir)
+{
+  int prev;
+
+  fade_cancel(&lcd_fade);
+
+  prev = lcd_bck_info.level;
+
+  /* The drivers write the new level, then signal it */
+  mops->lcd_backlight_step(dir);
+
+  /* Not written (no driver, level at its limit): latency_done()
+   * drops the trace
+   */
+  if (lcd_bck_info.level != prev)
+    latency_mark((dir > 0) ? LATENCY_LCD_UP : LATENCY_LCD_DOWN, LATENCY_WRITE);
+}
+
+void
+lcd_backlight_toggle(int lvl)
+{
+  fade_cancel(&lcd_fade);
+
+  mops->lcd_backlight_toggle(lvl);
+}
+
+/* Absolute level requested by a client, clamped to [0, max];
+ * the drivers further clamp to what the hardware accepts.
+ */
+void
+lcd_backlight_set_level(int val, int length)
+{
+  int from;
+
+  if (val < 0)
+    val = 0;
+  else if (val > lcd_bck_info.max)
+    val = lcd_bck_info.max;
+
+  if (length > FADE_MAX_LENGTH)
+    length = FADE_MAX_LENGTH;
+
+  /* Start from wherever the fade in progress got to */
+  if (lcd_fade.timer > 0)
+    from = lcd_fade.cur;
+  else
+    from = lcd_bck_info.level;
+
+  fade_cancel(&lcd_fade);
+
+  if ((length == 0) || (val == from))
+    {
+      lcd_backlight_commit(val);
+      return;
+    }
+
+  lcd_fade.write = mops->lcd_backlight_write;
+
+  if (fade_start(&lcd_fade, from, val, length, lcd_fade_process) < 0)
+    lcd_backlight_commit(val);
+}
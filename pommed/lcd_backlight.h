@@ -23,6 +23,16 @@ extern struct _lcd_bck_info lcd_bck_info;
 #define LCD_ON_BATT_LEVEL  1
 
 
+void
+lcd_backlight_step(int dir);
+
+void
+lcd_backlight_toggle(int lvl);
+
+void
+lcd_backlight_set_level(int val, int length);
+
+
 #ifndef __powerpc__
 /* x1600_backlight.c */
 #define X1600_BACKLIGHT_OFF       0
@@ -34,6 +44,9 @@ x1600_backlight_step(int dir);
 void
 x1600_backlight_toggle(int lvl);
 
+int
+x1600_backlight_write(int val);
+
 int
 x1600_backlight_probe(void);
 
@@ -51,6 +64,9 @@ gma950_backlight_step(int dir);
 void
 gma950_backlight_toggle(int lvl);
 
+int
+gma950_backlight_write(int val);
+
 int
 gma950_backlight_probe(void);
 
@@ -65,6 +81,9 @@ nv8600mgt_backlight_step(int dir);
 void
 nv8600mgt_backlight_toggle(int lvl);
 
+int
+nv8600mgt_backlight_write(int val);
+
 int
 nv8600mgt_backlight_probe(void);
 
@@ -82,6 +101,9 @@ sysfs_backlight_step(int dir);
 void
 sysfs_backlight_toggle(int lvl);
 
+int
+sysfs_backlight_write(int val);
+
 #ifdef __powerpc__
 void
 sysfs_backlight_step_kernel(int dir);
@@ -31,10 +31,12 @@
 
 #include "../pommed.h"
 #include "../ambient.h"
+#include "../sysfs_attr.h"
 
 
 #define HWMON_SYSFS_BASE    "/sys/class/hwmon"
 static char *smcpath;
+static struct sysfs_attr light_attr;
 
 
 struct _ambient_info ambient_info;
@@ -43,7 +45,6 @@ struct _ambient_info ambient_info;
 void
 ambient_get(int *r, int *l)
 {
-  int fd;
   int ret;
   char buf[16];
   char *p;
@@ -51,20 +52,15 @@ ambient_get(int *r, int *l)
   if (!smcpath)
     goto out_error;
 
-  fd = open(smcpath, O_RDONLY);
-  if (fd < 0)
+  ret = sysfs_attr_read(&light_attr, buf, sizeof(buf));
+  if (ret <= 0)
     goto out_error;
 
-  ret = read(fd, buf, 16);
-
-  close(fd);
-
-  if ((ret <= 0) || (ret > 15))
+  /* Format is (left,right) */
+  p = strchr(buf, ',');
+  if (!p)
     goto out_error;
 
-  buf[strlen(buf)] = '\0';
-
-  p = strchr(buf, ',');
   *p++ = '\0';
   *r = atoi(p);
 
@@ -152,6 +148,8 @@ ambient_init(int *r, int *l)
 
 	      strcat(smcpath, "/light");
 
+	      sysfs_attr_init(&light_attr, smcpath, O_RDONLY);
+
 	      break;
 	    }
 	}
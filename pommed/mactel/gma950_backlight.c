@@ -161,6 +161,28 @@ gma950_backlight_unmap(void)
 }
 
 
+int
+gma950_backlight_write(int val)
+{
+  int ret;
+
+  ret = gma950_backlight_map();
+  if (ret < 0)
+    return -1;
+
+  /* Below the minimum, the backlight is off */
+  if (val < GMA950_BACKLIGHT_MIN)
+    val = 0x00;
+  else if (val > GMA950_BACKLIGHT_MAX)
+    val = GMA950_BACKLIGHT_MAX;
+
+  gma950_backlight_set(val);
+
+  gma950_backlight_unmap();
+
+  return val;
+}
+
 void
 gma950_backlight_step(int dir)
 {
@@ -175,9 +197,9 @@ gma950_backlight_step(int dir)
 
   val = gma950_backlight_get();
 
-  if (dir == STEP_UP)
+  if (dir > 0)
     {
-      newval = val + lcd_gma950_cfg.step;
+      newval = val + dir * lcd_gma950_cfg.step;
 
       if (newval < GMA950_BACKLIGHT_MIN)
 	newval = GMA950_BACKLIGHT_MIN;
@@ -185,18 +207,18 @@ gma950_backlight_step(int dir)
       if (newval > GMA950_BACKLIGHT_MAX)
 	newval = GMA950_BACKLIGHT_MAX;
 
-      logdebug("LCD stepping +%d -> %d\n", lcd_gma950_cfg.step, newval);
+      logdebug("LCD stepping +%d -> %d\n", dir * lcd_gma950_cfg.step, newval);
     }
-  else if (dir == STEP_DOWN)
+  else if (dir < 0)
     {
       /* val is unsigned */
-      if (val > lcd_gma950_cfg.step)
-	newval = val - lcd_gma950_cfg.step;
+      if (val > -dir * lcd_gma950_cfg.step)
+	newval = val + dir * lcd_gma950_cfg.step;
 
       if (newval < GMA950_BACKLIGHT_MIN)
 	newval = 0x00;
 
-      logdebug("LCD stepping -%d -> %d\n", lcd_gma950_cfg.step, newval);
+      logdebug("LCD stepping -%d -> %d\n", -dir * lcd_gma950_cfg.step, newval);
     }
   else
     return;
@@ -25,7 +25,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
-#include <time.h>
 
 #include <syslog.h>
 
@@ -37,35 +36,41 @@
 #include "../kbd_backlight.h"
 #include "../ambient.h"
 #include "../dbus.h"
+#include "../fade.h"
+#include "../latency.h"
+#include "../sysfs_attr.h"
 
 
 struct _kbd_bck_info kbd_bck_info;
 
 
+/* brightness node, kept open for both reading and writing */
+static struct sysfs_attr kbd_attr;
+
+
 static int
-kbd_backlight_open(int flags)
+kbd_backlight_open(void)
 {
   char *kbdbck_node[] =
     {
       "/sys/class/leds/smc::kbd_backlight/brightness", /* 2.6.25 & up */
       "/sys/class/leds/smc:kbd_backlight/brightness"
     };
-  int fd;
   int i;
 
+  if (kbd_attr.path != NULL)
+    return 0;
+
   for (i = 0; i < sizeof(kbdbck_node) / sizeof(*kbdbck_node); i++)
     {
       logdebug("Trying %s\n", kbdbck_node[i]);
 
-      fd = open(kbdbck_node[i], flags);
-      if (fd >= 0)
-	return fd;
-
-      if (errno == ENOENT)
+      if (access(kbdbck_node[i], F_OK) < 0)
 	continue;
 
-      logmsg(LOG_WARNING, "Could not open %s: %s", kbdbck_node[i], strerror(errno));
-      return -1;
+      sysfs_attr_init(&kbd_attr, kbdbck_node[i], O_RDWR);
+
+      return 0;
     }
 
   return -1;
@@ -75,25 +80,14 @@ kbd_backlight_open(int flags)
 static int
 kbd_backlight_get(void)
 {
-  int fd;
   int ret;
-  char buf[8];
 
-  fd = kbd_backlight_open(O_RDONLY);
-  if (fd < 0)
+  if (kbd_backlight_open() < 0)
     return -1;
 
-  memset(buf, 0, 8);
-
-  ret = read(fd, buf, 8);
-
-  close(fd);
-
-  if ((ret < 1) || (ret > 7))
+  if (sysfs_attr_read_int(&kbd_attr, &ret) < 0)
     return -1;
 
-  ret = atoi(buf);
-
   logdebug("KBD backlight value is %d\n", ret);
 
   if ((ret < KBD_BACKLIGHT_OFF) || (ret > KBD_BACKLIGHT_MAX))
@@ -102,86 +96,19 @@ kbd_backlight_get(void)
   return ret;
 }
 
-static void
-kbd_backlight_set(int val, int who)
+static int
+kbd_backlight_write(int val)
 {
-  int curval;
-
-  int i;
-  float fadeval;
-  float step;
-  struct timespec fade_step;
-
-  int fd;
-  FILE *fp;
-
-  if (kbd_bck_info.inhibit & ~KBD_INHIBIT_CFG)
-    return;
-
-  curval = kbd_backlight_get();
-
-  if (val == curval)
-    return;
-
-  if ((val < KBD_BACKLIGHT_OFF) || (val > KBD_BACKLIGHT_MAX))
-    return;
-
-  if (who == KBD_AUTO)
-    {
-      fade_step.tv_sec = 0;
-      fade_step.tv_nsec = (KBD_BACKLIGHT_FADE_LENGTH / KBD_BACKLIGHT_FADE_STEPS) * 1000000;
-
-      fadeval = (float)curval;
-      step = (float)(val - curval) / (float)KBD_BACKLIGHT_FADE_STEPS;
-
-      for (i = 0; i < KBD_BACKLIGHT_FADE_STEPS; i++)
-	{
-	  fadeval += step;
-
-	  fd = kbd_backlight_open(O_WRONLY);
-	  if (fd < 0)
-	    continue;
-
-	  fp = fdopen(fd, "a");
-	  if (fp == NULL)
-	    {
-	      logmsg(LOG_WARNING, "Could not fdopen backlight fd: %s", strerror(errno));
-	      close(fd);
-	      continue;
-	    }
-
-	  fprintf(fp, "%d", (int)fadeval);
-
-	  fclose(fp);
-
-	  logdebug("KBD backlight value faded to %d\n", (int)fadeval);
-
-	  nanosleep(&fade_step, NULL);
-	}
-    }
-
-  fd = kbd_backlight_open(O_WRONLY);
-  if (fd < 0)
-    return;
-
-  fp = fdopen(fd, "a");
-  if (fp == NULL)
-    {
-      logmsg(LOG_WARNING, "Could not fdopen backlight fd %d: %s", fd, strerror(errno));
-      close(fd);
-      return;
-    }
-
-  fprintf(fp, "%d", val);
+  if (kbd_backlight_open() < 0)
+    return -1;
 
-  fclose(fp);
+  return sysfs_attr_write_int(&kbd_attr, val);
+}
 
-  logdebug("KBD backlight value set to %d\n", val);
 
-  mbpdbus_send_kbd_backlight(val, curval, who);
+/* Include automatic backlight routines */
+#include "../kbd_auto.c"
 
-  kbd_bck_info.level = val;
-}
 
 void
 kbd_backlight_step(int dir)
@@ -222,10 +149,6 @@ kbd_backlight_step(int dir)
 }
 
 
-/* Include automatic backlight routines */
-#include "../kbd_auto.c"
-
-
 void
 kbd_backlight_init(void)
 {
@@ -270,6 +193,8 @@ kbd_backlight_cleanup(void)
 {
   if (has_kbd_backlight())
     kbd_auto_cleanup();
+
+  sysfs_attr_close(&kbd_attr);
 }
 
 
@@ -82,6 +82,22 @@ nv8600mgt_backlight_set(unsigned char value)
 }
 
 
+int
+nv8600mgt_backlight_write(int val)
+{
+  if (nv8600mgt_inited == 0)
+    return -1;
+
+  if (val < NV8600MGT_BACKLIGHT_OFF)
+    val = NV8600MGT_BACKLIGHT_OFF;
+  else if (val > NV8600MGT_BACKLIGHT_MAX)
+    val = NV8600MGT_BACKLIGHT_MAX;
+
+  nv8600mgt_backlight_set((unsigned char)val);
+
+  return val;
+}
+
 void
 nv8600mgt_backlight_step(int dir)
 {
@@ -93,23 +109,23 @@ nv8600mgt_backlight_step(int dir)
 
   val = nv8600mgt_backlight_get();
 
-  if (dir == STEP_UP)
+  if (dir > 0)
     {
-      newval = val + lcd_nv8600mgt_cfg.step;
+      newval = val + dir * lcd_nv8600mgt_cfg.step;
 
       if (newval > NV8600MGT_BACKLIGHT_MAX)
 	newval = NV8600MGT_BACKLIGHT_MAX;
 
-      logdebug("LCD stepping +%d -> %d\n", lcd_nv8600mgt_cfg.step, newval);
+      logdebug("LCD stepping +%d -> %d\n", dir * lcd_nv8600mgt_cfg.step, newval);
     }
-  else if (dir == STEP_DOWN)
+  else if (dir < 0)
     {
-      newval = val - lcd_nv8600mgt_cfg.step;
+      newval = val + dir * lcd_nv8600mgt_cfg.step;
 
       if (newval < NV8600MGT_BACKLIGHT_OFF)
 	newval = NV8600MGT_BACKLIGHT_OFF;
 
-      logdebug("LCD stepping -%d -> %d\n", lcd_nv8600mgt_cfg.step, newval);
+      logdebug("LCD stepping -%d -> %d\n", -dir * lcd_nv8600mgt_cfg.step, newval);
     }
   else
     return;
@@ -131,6 +131,27 @@ x1600_backlight_unmap(void)
 }
 
 
+int
+x1600_backlight_write(int val)
+{
+  int ret;
+
+  ret = x1600_backlight_map();
+  if (ret < 0)
+    return -1;
+
+  if (val < X1600_BACKLIGHT_OFF)
+    val = X1600_BACKLIGHT_OFF;
+  else if (val > X1600_BACKLIGHT_MAX)
+    val = X1600_BACKLIGHT_MAX;
+
+  x1600_backlight_set((unsigned char)val);
+
+  x1600_backlight_unmap();
+
+  return val;
+}
+
 void
 x1600_backlight_step(int dir)
 {
@@ -145,23 +166,23 @@ x1600_backlight_step(int dir)
 
   val = x1600_backlight_get();
 
-  if (dir == STEP_UP)
+  if (dir > 0)
     {
-      newval = val + lcd_x1600_cfg.step;
+      newval = val + dir * lcd_x1600_cfg.step;
 
       if (newval > X1600_BACKLIGHT_MAX)
 	newval = X1600_BACKLIGHT_MAX;
 
-      logdebug("LCD stepping +%d -> %d\n", lcd_x1600_cfg.step, newval);
+      logdebug("LCD stepping +%d -> %d\n", dir * lcd_x1600_cfg.step, newval);
     }
-  else if (dir == STEP_DOWN)
+  else if (dir < 0)
     {
-      newval = val - lcd_x1600_cfg.step;
+      newval = val + dir * lcd_x1600_cfg.step;
 
       if (newval < X1600_BACKLIGHT_OFF)
 	newval = X1600_BACKLIGHT_OFF;
 
-      logdebug("LCD stepping -%d -> %d\n", lcd_x1600_cfg.step, newval);
+      logdebug("LCD stepping -%d -> %d\n", -dir * lcd_x1600_cfg.step, newval);
     }
   else
     return;
@@ -27,7 +27,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
-#include <time.h>
 
 #include <syslog.h>
 
@@ -45,6 +44,8 @@
 #include "../kbd_backlight.h"
 #include "../ambient.h"
 #include "../dbus.h"
+#include "../fade.h"
+#include "../latency.h"
 
 
 #define SYSFS_I2C_BASE      "/sys/class/i2c-dev"
@@ -54,6 +55,9 @@
 struct _lmu_info lmu_info;
 struct _kbd_bck_info kbd_bck_info;
 
+/* LMU i2c device, kept open with I2C_SLAVE set since the probe */
+static int lmu_fd = -1;
+
 
 static int
 kbd_backlight_get(void)
@@ -85,77 +89,15 @@ lmu_write_kbd_value(int fd, unsigned char val)
     logmsg(LOG_ERR, "Could not set LMU kbd brightness: %s", strerror(errno));
 }
 
-static void
-kbd_lmu_backlight_set(int val, int who)
+static int
+kbd_lmu_backlight_write(int val)
 {
-  int curval;
-
-  int i;
-  float fadeval;
-  float step;
-  struct timespec fade_step;
-
-  int fd;
-  int ret;
-
-  if (kbd_bck_info.inhibit & ~KBD_INHIBIT_CFG)
-    return;
-
-  if (lmu_info.lmuaddr == 0)
-    return;
-
-  curval = kbd_backlight_get();
-
-  if (val == curval)
-    return;
-
-  if ((val < KBD_BACKLIGHT_OFF) || (val > KBD_BACKLIGHT_MAX))
-    return;
-
-  fd = open(lmu_info.i2cdev, O_RDWR);
-  if (fd < 0)
-    {
-      logmsg(LOG_ERR, "Could not open %s: %s", lmu_info.i2cdev, strerror(errno));
-
-      return;
-    }
-
-  ret = ioctl(fd, I2C_SLAVE, lmu_info.lmuaddr);
-  if (ret < 0)
-    {
-      logmsg(LOG_ERR, "Could not ioctl the i2c bus: %s", strerror(errno));
-
-      close(fd);
-      return;
-    }
-
-  if (who == KBD_AUTO)
-    {
-      fade_step.tv_sec = 0;
-      fade_step.tv_nsec = (KBD_BACKLIGHT_FADE_LENGTH / KBD_BACKLIGHT_FADE_STEPS) * 1000000;
-
-      fadeval = (float)curval;
-      step = (float)(val - curval) / (float)KBD_BACKLIGHT_FADE_STEPS;
-
-      for (i = 0; i < KBD_BACKLIGHT_FADE_STEPS; i++)
-	{
-	  fadeval += step;
-
-	  lmu_write_kbd_value(fd, (unsigned char)fadeval);
-
-	  logdebug("KBD backlight value faded to %d\n", (int)fadeval);
-
-	  nanosleep(&fade_step, NULL);
-	}
-    }
-
-  lmu_write_kbd_value(fd, val);
-
-  close(fd);
+  if ((lmu_info.lmuaddr == 0) || (lmu_fd < 0))
+    return -1;
 
-  mbpdbus_send_kbd_backlight(val, kbd_bck_info.level, who);
+  lmu_write_kbd_value(lmu_fd, val);
 
-  kbd_bck_info.level = val;
+  return 0;
 }
 
 
@@ -185,81 +127,45 @@ adb_write_kbd_value(int fd, unsigned char val)
     }
 }
 
-static void
-kbd_pmu_backlight_set(int val, int who)
+static int
+kbd_pmu_backlight_write(int val)
 {
-  int curval;
-
-  int i;
-  float fadeval;
-  float step;
-  struct timespec fade_step;
-
   int fd;
 
-  if (kbd_bck_info.inhibit & ~KBD_INHIBIT_CFG)
-    return;
-
-  curval = kbd_backlight_get();
-
-  if (val == curval)
-    return;
-
-  if ((val < KBD_BACKLIGHT_OFF) || (val > KBD_BACKLIGHT_MAX))
-    return;
-
   fd = open(ADB_DEVICE, O_RDWR);
   if (fd < 0)
     {
       logmsg(LOG_ERR, "Could not open %s: %s", ADB_DEVICE, strerror(errno));
 
-      return;
-    }
-
-  if (who == KBD_AUTO)
-    {
-      fade_step.tv_sec = 0;
-      fade_step.tv_nsec = (KBD_BACKLIGHT_FADE_LENGTH / KBD_BACKLIGHT_FADE_STEPS) * 1000000;
-
-      fadeval = (float)curval;
-      step = (float)(val - curval) / (float)KBD_BACKLIGHT_FADE_STEPS;
-
-      for (i = 0; i < KBD_BACKLIGHT_FADE_STEPS; i++)
-	{
-	  fadeval += step;
-
-	  adb_write_kbd_value(fd, (unsigned char)fadeval);
-
-	  logdebug("KBD backlight value faded to %d\n", (int)fadeval);
-
-	  nanosleep(&fade_step, NULL);
-	}
+      return -1;
     }
 
   adb_write_kbd_value(fd, val);
 
   close(fd);
 
-  mbpdbus_send_kbd_backlight(val, kbd_bck_info.level, who);
-
-  kbd_bck_info.level = val;
+  return 0;
 }
 
-static void
-kbd_backlight_set(int val, int who)
+static int
+kbd_backlight_write(int val)
 {
   if ((mops->type == MACHINE_POWERBOOK_58)
       || (mops->type == MACHINE_POWERBOOK_59))
     {
-      kbd_pmu_backlight_set(val, who);
+      return kbd_pmu_backlight_write(val);
     }
   else
     {
-      kbd_lmu_backlight_set(val, who);
+      return kbd_lmu_backlight_write(val);
     }
 }
 
 
+/* Include automatic backlight routines */
+#include "../kbd_auto.c"
+
+
 void
 kbd_backlight_step(int dir)
 {
@@ -299,10 +205,6 @@ kbd_backlight_step(int dir)
 }
 
 
-/* Include automatic backlight routines */
-#include "../kbd_auto.c"
-
-
 static int 
 kbd_probe_lmu(void);
 
@@ -365,6 +267,11 @@ kbd_backlight_cleanup(void)
 {
   if (has_kbd_backlight())
     kbd_auto_cleanup();
+
+  if (lmu_fd >= 0)
+    close(lmu_fd);
+
+  lmu_fd = -1;
 }
 
 
@@ -501,7 +408,7 @@ kbd_probe_lmu(void)
   if (ret < 0)
     return -1;
 
-  fd = open(lmu_info.i2cdev, O_RDWR);
+  fd = open(lmu_info.i2cdev, O_RDWR | O_CLOEXEC);
   if (fd < 0)
     {
       logmsg(LOG_WARNING, "Could not open device %s: %s", lmu_info.i2cdev, strerror(errno));
@@ -526,9 +433,11 @@ kbd_probe_lmu(void)
       close(fd);
       return -1;
     }
-  close(fd);
 
   logdebug("Probing successful on %s\n", lmu_info.i2cdev);
 
+  /* Keep it for the backlight writes */
+  lmu_fd = fd;
+
   return 0;
 }
@@ -29,6 +29,8 @@
 #include <signal.h>
 
 #include <sys/utsname.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
 
 #include <syslog.h>
 #include <stdarg.h>
@@ -54,6 +56,10 @@
 #include "dbus.h"
 #include "power.h"
 #include "beep.h"
+#include "song.h"
+#include "state.h"
+#include "child.h"
+#include "latency.h"
 
 
 /* Machine-specific operations */
@@ -76,6 +82,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = aty128_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step_kernel,
     .lcd_backlight_toggle = sysfs_backlight_toggle_kernel,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -84,6 +91,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -92,6 +100,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -100,6 +109,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -110,6 +120,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = nvidia_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -118,6 +129,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -126,6 +138,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -134,6 +147,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -142,6 +156,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -150,6 +165,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_fountain, */
   },
 
@@ -158,6 +174,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_fountain, */
   },
 
@@ -166,6 +183,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_geyser, */
   },
 
@@ -174,6 +192,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_geyser, */
   },
 
@@ -184,6 +203,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = nvidia_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -192,6 +212,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = nvidia_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -200,6 +221,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -208,6 +230,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = nvidia_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -216,6 +239,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -226,6 +250,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = r9x00_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   },
 
@@ -234,6 +259,7 @@ struct machine_ops pb_mops[] = {
     .lcd_backlight_probe = nvidia_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_adb, */
   }
 };
@@ -248,6 +274,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = x1600_backlight_probe,
     .lcd_backlight_step = x1600_backlight_step,
     .lcd_backlight_toggle = x1600_backlight_toggle,
+    .lcd_backlight_write = x1600_backlight_write,
     /* .evdev_identify = evdev_is_geyser3, */
   },
 
@@ -256,6 +283,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = x1600_backlight_probe,
     .lcd_backlight_step = x1600_backlight_step,
     .lcd_backlight_toggle = x1600_backlight_toggle,
+    .lcd_backlight_write = x1600_backlight_write,
     /* .evdev_identify = evdev_is_geyser4, */
   },
 
@@ -264,6 +292,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_geyser4, */
   },
 
@@ -272,6 +301,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring2, */
   },
 
@@ -284,6 +314,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -293,6 +324,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -301,6 +333,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -312,6 +345,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring5, */
   },
 
@@ -322,6 +356,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = gma950_backlight_probe,
     .lcd_backlight_step = gma950_backlight_step,
     .lcd_backlight_toggle = gma950_backlight_toggle,
+    .lcd_backlight_write = gma950_backlight_write,
     /* .evdev_identify = evdev_is_geyser3, */
   },
 
@@ -330,6 +365,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = gma950_backlight_probe,
     .lcd_backlight_step = gma950_backlight_step,
     .lcd_backlight_toggle = gma950_backlight_toggle,
+    .lcd_backlight_write = gma950_backlight_write,
     /* .evdev_identify = evdev_is_geyser4, */
   },
 
@@ -338,6 +374,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = gma950_backlight_probe, /* gma950 supports the gma965 */
     .lcd_backlight_step = gma950_backlight_step,
     .lcd_backlight_toggle = gma950_backlight_toggle,
+    .lcd_backlight_write = gma950_backlight_write,
     /* .evdev_identify = evdev_is_geyser4hf, */
   },
 
@@ -346,6 +383,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = gma950_backlight_probe, /* gma950 supports the gma965 */
     .lcd_backlight_step = gma950_backlight_step,
     .lcd_backlight_toggle = gma950_backlight_toggle,
+    .lcd_backlight_write = gma950_backlight_write,
     /* .evdev_identify = evdev_is_geyser4hf, */
   },
 
@@ -354,6 +392,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -362,6 +401,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -370,6 +410,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -380,6 +421,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = gma950_backlight_probe, /* gma950 supports the gma965 */
     .lcd_backlight_step = gma950_backlight_step,
     .lcd_backlight_toggle = gma950_backlight_toggle,
+    .lcd_backlight_write = gma950_backlight_write,
     /* .evdev_identify = evdev_is_wellspring, */
   },
 
@@ -388,6 +430,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring3, */
   },
 
@@ -396,6 +439,7 @@ struct machine_ops mb_mops[] = {
     .lcd_backlight_probe = mbp_sysfs_backlight_probe,
     .lcd_backlight_step = sysfs_backlight_step,
     .lcd_backlight_toggle = sysfs_backlight_toggle,
+    .lcd_backlight_write = sysfs_backlight_write,
     /* .evdev_identify = evdev_is_wellspring4a / evdev_is_wellspring4, */
   }
 };
@@ -808,6 +852,7 @@ usage(void)
   printf("\tpommed -v\t-- print version and exit\n");
   printf("\tpommed -f\t-- run in the foreground with log messages\n");
   printf("\tpommed -d\t-- run in the foreground with debug messages\n");
+  printf("\tpommed -s\t-- time the event handlers (SIGUSR1 or getStats to see)\n");
 }
 
 
@@ -817,18 +862,73 @@ sig_int_term_handler(int signal)
   evloop_stop();
 }
 
+static void
+sig_usr1_process(int fd, uint32_t events)
+{
+  struct signalfd_siginfo si;
+
+  /* Drain the signalfd, one dump will do */
+  while (read(fd, &si, sizeof(si)) == sizeof(si))
+    ;
+
+  evloop_dump_stats();
+  latency_dump_stats();
+}
+
+/* SIGUSR1 dumps the event loop statistics to the log; it goes through
+ * the event loop so the dump doesn't race the accounting.
+ */
+static int
+sig_usr1_init(void)
+{
+  sigset_t sigs;
+  int fd;
+  int ret;
+
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGUSR1);
+
+  /* Before any thread is created, they inherit the mask */
+  ret = sigprocmask(SIG_BLOCK, &sigs, NULL);
+  if (ret < 0)
+    {
+      logmsg(LOG_ERR, "Could not block SIGUSR1: %s", strerror(errno));
+
+      return -1;
+    }
+
+  fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    {
+      logmsg(LOG_ERR, "Could not create signalfd: %s", strerror(errno));
+
+      return -1;
+    }
+
+  ret = evloop_add(fd, EPOLLIN, sig_usr1_process);
+  if (ret < 0)
+    {
+      close(fd);
+
+      return -1;
+    }
+
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
   int ret;
   int c;
+  int stats = 0;
 
   FILE *pidfile;
   struct utsname sysinfo;
 
   machine_type machine;
 
-  while ((c = getopt(argc, argv, "fdv")) != -1)
+  while ((c = getopt(argc, argv, "fdsv")) != -1)
     {
       switch (c)
 	{
@@ -841,6 +941,10 @@ main (int argc, char **argv)
 	    console = 1;
 	    break;
 
+	  case 's':
+	    stats = 1;
+	    break;
+
 	  case 'v':
 	    printf("pommed v" M_VERSION " Apple laptops hotkeys handler\n");
 	    printf("Copyright (C) 2006-2011 Julien BLACHE <jb@jblache.org>\n");
@@ -935,6 +1039,15 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (stats)
+    evloop_enable_stats();
+
+  ret = sig_usr1_init();
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "Could not set up SIGUSR1, statistics dump disabled");
+    }
+
   ret = mops->lcd_backlight_probe();
   if (ret < 0)
     {
@@ -967,6 +1080,18 @@ main (int argc, char **argv)
 
   power_init();
 
+  ret = child_init();
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "Could not set up child process handling");
+    }
+
+  ret = cd_eject_init();
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "CD eject initialization failed, CD eject disabled");
+    }
+
   if (!console)
     {
       /*
@@ -994,6 +1119,9 @@ main (int argc, char **argv)
   fprintf(pidfile, "%d\n", getpid());
   fclose(pidfile);
 
+  /* Publish the state page, after daemonizing so it has our PID */
+  state_init();
+
   /* Spawn the beep thread */
   beep_init();
 
@@ -1015,8 +1143,18 @@ main (int argc, char **argv)
 
   kbd_backlight_cleanup();
 
+  audio_cleanup();
+
   power_cleanup();
 
+  cd_eject_cleanup();
+
+  song_cleanup();
+
+  child_cleanup();
+
+  state_cleanup();
+
   evloop_cleanup();
 
   config_cleanup();
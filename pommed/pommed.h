@@ -83,6 +83,10 @@ struct machine_ops
   int (*lcd_backlight_probe) (void);
   void (*lcd_backlight_step) (int dir);
   void (*lcd_backlight_toggle) (int lvl);
+  /* Set an absolute level, clamped to the hardware range; no signal.
+   * Returns the level written.
+   */
+  int (*lcd_backlight_write) (int val);
 };
 
 extern struct machine_ops *mops;
@@ -91,6 +95,9 @@ extern struct machine_ops *mops;
 #define PIDFILE                "/var/run/pommed.pid"
 #define CONFFILE               "/etc/pommed.conf"
 
+/* LCD backlight & volume step functions take a signed number
+ * of steps; STEP_UP and STEP_DOWN are single steps
+ */
 #define STEP_UP                 1
 #define STEP_DOWN               -1
 
@@ -22,13 +22,19 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <syslog.h>
 
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+
 #include "pommed.h"
 #include "evloop.h"
 #include "lcd_backlight.h"
 #include "power.h"
+#include "sysfs_attr.h"
 
 
 /* Internal API - legacy procfs interface, ACPI or PMU */
@@ -38,33 +44,24 @@ procfs_check_ac_state(void);
 
 static int prev_state;
 static int power_timer;
+static int uevent_fd;
 
 
 /* sysfs power_supply class */
+static struct sysfs_attr ac_attr = SYSFS_ATTR_INIT(SYSFS_POWER_AC_STATE, O_RDONLY);
+
 static int
 sysfs_check_ac_state(void)
 {
-  FILE *fp;
-  char ac_state;
+  char ac_state[4];
 
-  fp = fopen(SYSFS_POWER_AC_STATE, "r");
-  if (fp == NULL)
+  if (sysfs_attr_read(&ac_attr, ac_state, sizeof(ac_state)) < 1)
     return AC_STATE_ERROR;
 
-  fread(&ac_state, 1, 1, fp);
-
-  if (ferror(fp) != 0)
-    {
-      logdebug("power: Error reading sysfs AC state: %s\n", strerror(errno));
-      return AC_STATE_ERROR;
-    }
-
-  fclose(fp);
-
-  if (ac_state == '1')
+  if (ac_state[0] == '1')
     return AC_STATE_ONLINE;
 
-  if (ac_state == '0')
+  if (ac_state[0] == '0')
     return AC_STATE_OFFLINE;
 
   return AC_STATE_UNKNOWN;
@@ -84,7 +81,7 @@ check_ac_state(void)
 
 
 static void
-power_check_ac_state(int id, uint64_t ticks)
+power_check_ac_state(void)
 {
   int ac_state;
 
@@ -99,12 +96,12 @@ power_check_ac_state(int id, uint64_t ticks)
     {
       case AC_STATE_ONLINE:
 	logdebug("power: switched to AC\n");
-	mops->lcd_backlight_toggle(LCD_ON_AC_LEVEL);
+	lcd_backlight_toggle(LCD_ON_AC_LEVEL);
 	break;
 
       case AC_STATE_OFFLINE:
 	logdebug("power: switched to battery\n");
-	mops->lcd_backlight_toggle(LCD_ON_BATT_LEVEL);
+	lcd_backlight_toggle(LCD_ON_BATT_LEVEL);
 	break;
 
       case AC_STATE_ERROR:
@@ -117,13 +114,168 @@ power_check_ac_state(int id, uint64_t ticks)
     }
 }
 
+static void
+power_timer_process(int id, uint64_t ticks)
+{
+  power_check_ac_state();
+}
+
+
+/* power_supply uevents, only used with the sysfs interface */
+static void
+power_uevent_process(int fd, uint32_t events)
+{
+  char buf[UEVENT_BUFFER_SIZE];
+  char *p;
+  socklen_t len;
+  int check;
+  int err;
+  int ret;
+
+  check = 0;
+
+  if (events & EPOLLERR)
+    {
+      /* Reading SO_ERROR clears it; an overflow (ENOBUFS) lost some
+       * uevents, possibly ours, so check anyway
+       */
+      len = sizeof(err);
+      ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+      if ((ret == 0) && (err == ENOBUFS) && !(events & EPOLLHUP))
+	{
+	  logdebug("power: uevent socket overflow\n");
+
+	  check = 1;
+	}
+      else
+	events |= EPOLLHUP;
+    }
+
+  if (events & EPOLLHUP)
+    {
+      logmsg(LOG_WARNING, "power: uevent socket lost, falling back to polling");
+
+      evloop_remove(fd);
+      close(fd);
+      uevent_fd = -1;
+
+      power_timer = evloop_add_timer(POWER_TIMEOUT, power_timer_process);
+
+      power_check_ac_state();
+      return;
+    }
+
+  /* Drain the socket; the uevent payload is a list of
+   * NUL-separated KEY=value strings following the header
+   */
+  for (;;)
+    {
+      ret = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+      if (ret < 0)
+	{
+	  /* Overflowed again while draining */
+	  if (errno == ENOBUFS)
+	    {
+	      check = 1;
+	      continue;
+	    }
+
+	  break;
+	}
+
+      if (ret == 0)
+	break;
+
+      buf[ret] = '\0';
+
+      for (p = buf; p < buf + ret; p += strlen(p) + 1)
+	{
+	  if (strcmp(p, "SUBSYSTEM=power_supply") == 0)
+	    {
+	      check = 1;
+	      break;
+	    }
+	}
+    }
+
+  if (check)
+    {
+      logdebug("power: power_supply uevent\n");
+
+      power_check_ac_state();
+    }
+}
+
+static int
+power_uevent_init(void)
+{
+  struct sockaddr_nl addr;
+  int size;
+  int fd;
+  int ret;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    {
+      logmsg(LOG_WARNING, "power: could not open uevent socket: %s", strerror(errno));
+
+      return -1;
+    }
+
+  /* SO_RCVBUFFORCE goes past rmem_max, we're root */
+  size = UEVENT_RCVBUF;
+  ret = setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+  if (ret < 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_pid = 0;
+  addr.nl_groups = 1; /* kernel uevents */
+
+  ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "power: could not bind uevent socket: %s", strerror(errno));
+
+      close(fd);
+      return -1;
+    }
+
+  ret = evloop_add(fd, EPOLLIN, power_uevent_process);
+  if (ret < 0)
+    {
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
 
 void
 power_init(void)
 {
+  power_timer = -1;
+  uevent_fd = -1;
+
   prev_state = check_ac_state();
 
-  power_timer = evloop_add_timer(POWER_TIMEOUT, power_check_ac_state);
+  /* The sysfs power_supply class sends uevents on AC state changes,
+   * the legacy procfs interfaces must be polled
+   */
+  if (sysfs_check_ac_state() != AC_STATE_ERROR)
+    uevent_fd = power_uevent_init();
+
+  if (uevent_fd < 0)
+    {
+      logdebug("power: polling AC state every %d ms\n", POWER_TIMEOUT);
+
+      power_timer = evloop_add_timer(POWER_TIMEOUT, power_timer_process);
+    }
+  else
+    logdebug("power: tracking AC state through uevents\n");
 }
 
 void
@@ -131,4 +283,8 @@ power_cleanup(void)
 {
   if (power_timer > 0)
     evloop_remove_timer(power_timer);
+
+  sysfs_attr_close(&ac_attr);
+
+  /* uevent_fd is closed by evloop_cleanup() */
 }
@@ -14,6 +14,10 @@
 
 #define POWER_TIMEOUT 200
 
+#define UEVENT_BUFFER_SIZE 2048
+/* Socket receive buffer, large enough for the uevent storm on resume */
+#define UEVENT_RCVBUF      (256 * 1024)
+
 #ifdef __powerpc__
 # define SYSFS_POWER_AC_STATE  "/sys/class/power_supply/pmu-ac/online"
 #else
@@ -23,17 +23,464 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 
 #include <errno.h>
 
 #include <syslog.h>
 
+#include <sys/epoll.h>
+
 #include "pommed.h"
 #include "conffile.h"
+#include "evloop.h"
 #include "song.h"
+#include "child.h"
+
+
+/* Native MPD client
+ *
+ * The connection is opened on the first media key and kept open;
+ * everything is non-blocking and driven by the event loop. If MPD
+ * closes the connection (idle timeout, restart), it is reopened
+ * on the next keypress.
+ */
+
+enum
+  {
+    MPD_DISCONNECTED,
+    MPD_CONNECTING,
+    MPD_CONNECTED,
+  };
+
+/* What we expect in reply to the commands we sent, in order */
+enum
+  {
+    MPD_REPLY_GREETING,
+    MPD_REPLY_STATUS,
+    MPD_REPLY_PLAIN,
+  };
+
+static struct
+{
+  int fd;
+  int state;
+  uint32_t events;
+
+  char out[MPD_BUF_SIZE];
+  int outlen;
+  char in[MPD_BUF_SIZE];
+  int inlen;
+
+  struct
+  {
+    int reply;
+    char **fallback;  /* command to run if we never get to talk to MPD */
+  } pending[MPD_PENDING_MAX];
+  int npending;
+
+  int playing;
+} mpd = { .fd = -1 };
+
+/* MPD server addresses, resolved at config time; the event loop
+ * can't afford to wait on the resolver
+ */
+static struct addrinfo *mpd_addrs;
+
+
+static void
+mpd_io(int fd, uint32_t events);
+
+
+static void
+mpd_close(void)
+{
+  if (mpd.fd < 0)
+    return;
+
+  if (mpd.events != 0)
+    evloop_remove(mpd.fd);
+  close(mpd.fd);
+
+  mpd.fd = -1;
+  mpd.state = MPD_DISCONNECTED;
+  mpd.events = 0;
+  mpd.outlen = 0;
+  mpd.inlen = 0;
+  mpd.npending = 0;
+}
+
+/* Don't lose the keypresses, run the commands instead */
+static void
+mpd_fail(void)
+{
+  char **fallback[MPD_PENDING_MAX];
+  int n;
+  int i;
+
+  n = mpd.npending;
+  for (i = 0; i < n; i++)
+    fallback[i] = mpd.pending[i].fallback;
+
+  mpd_close();
+
+  for (i = 0; i < n; i++)
+    song_exec(fallback[i]);
+}
+
+static void
+mpd_update_events(void)
+{
+  uint32_t events;
+  int ret;
+
+  events = EPOLLIN;
+  if ((mpd.state == MPD_CONNECTING) || (mpd.outlen > 0))
+    events |= EPOLLOUT;
+
+  if (events == mpd.events)
+    return;
+
+  if (mpd.events != 0)
+    ret = evloop_modify(mpd.fd, events);
+  else
+    ret = evloop_add(mpd.fd, events, mpd_io);
+
+  if (ret < 0)
+    {
+      logmsg(LOG_ERR, "Could not add MPD connection to event loop");
+
+      mpd_close();
+      return;
+    }
+
+  mpd.events = events;
+}
+
+static int
+mpd_connect_fd(void)
+{
+  struct sockaddr_un sun;
+  struct addrinfo *ai;
+  int fd;
+  int ret;
+
+  if (song_cfg.mpd_host[0] == '/')
+    {
+      if (strlen(song_cfg.mpd_host) >= sizeof(sun.sun_path))
+	{
+	  logmsg(LOG_ERR, "MPD socket path too long");
+
+	  return -1;
+	}
+
+      fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+	{
+	  logmsg(LOG_ERR, "Could not create MPD socket: %s", strerror(errno));
+
+	  return -1;
+	}
+
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      strcpy(sun.sun_path, song_cfg.mpd_host);
+
+      /* EAGAIN on a UNIX socket is a full listen backlog, not a
+       * connection in progress
+       */
+      ret = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+      if ((ret < 0) && (errno != EINPROGRESS))
+	{
+	  logmsg(LOG_ERR, "Could not connect to MPD at %s: %s", song_cfg.mpd_host, strerror(errno));
+
+	  close(fd);
+	  return -1;
+	}
+
+      mpd.state = (ret < 0) ? MPD_CONNECTING : MPD_CONNECTED;
+
+      return fd;
+    }
+
+  if (mpd_addrs == NULL)
+    return -1;
+
+  fd = -1;
+  for (ai = mpd_addrs; ai != NULL; ai = ai->ai_next)
+    {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd < 0)
+	continue;
+
+      ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+      if ((ret == 0) || (errno == EINPROGRESS))
+	break;
+
+      close(fd);
+      fd = -1;
+    }
+
+  if (fd < 0)
+    {
+      logmsg(LOG_ERR, "Could not connect to MPD at %s:%d", song_cfg.mpd_host, song_cfg.mpd_port);
+
+      return -1;
+    }
+
+  mpd.state = (ret < 0) ? MPD_CONNECTING : MPD_CONNECTED;
+
+  return fd;
+}
+
+static int
+mpd_connect(void)
+{
+  mpd.fd = mpd_connect_fd();
+  if (mpd.fd < 0)
+    {
+      mpd.state = MPD_DISCONNECTED;
+      return -1;
+    }
+
+  logdebug("MPD connection %s\n", (mpd.state == MPD_CONNECTING) ? "in progress" : "established");
+
+  mpd.events = 0;
+  mpd.outlen = 0;
+  mpd.inlen = 0;
+
+  /* MPD speaks first */
+  mpd.pending[0].reply = MPD_REPLY_GREETING;
+  mpd.pending[0].fallback = NULL;
+  mpd.npending = 1;
+
+  mpd_update_events();
+
+  return (mpd.fd < 0) ? -1 : 0;
+}
+
+static int
+mpd_send(const char *cmd, int reply, char **fallback)
+{
+  int len;
+
+  if ((mpd.fd < 0) && (mpd_connect() < 0))
+    return -1;
+
+  len = strlen(cmd);
+
+  if ((mpd.npending == MPD_PENDING_MAX) || (mpd.outlen + len + 1 > MPD_BUF_SIZE))
+    {
+      logmsg(LOG_WARNING, "MPD not keeping up, not sending command %s", cmd);
+
+      /* The caller runs the fallback */
+      return -1;
+    }
+
+  memcpy(mpd.out + mpd.outlen, cmd, len);
+  mpd.outlen += len;
+  mpd.out[mpd.outlen++] = '\n';
+
+  mpd.pending[mpd.npending].reply = reply;
+  mpd.pending[mpd.npending].fallback = fallback;
+  mpd.npending++;
+
+  logdebug("MPD command: %s\n", cmd);
+
+  mpd_update_events();
+
+  return 0;
+}
+
+static void
+mpd_pop_pending(void)
+{
+  mpd.npending--;
+  memmove(mpd.pending, mpd.pending + 1, mpd.npending * sizeof(*mpd.pending));
+}
+
+static void
+mpd_process_line(char *line)
+{
+  if (mpd.npending == 0)
+    {
+      logdebug("MPD: unexpected reply %s\n", line);
+
+      return;
+    }
+
+  if (strncmp(line, "ACK ", 4) == 0)
+    {
+      logmsg(LOG_WARNING, "MPD error: %s", line + 4);
+
+      mpd_pop_pending();
+      return;
+    }
+
+  switch (mpd.pending[0].reply)
+    {
+      case MPD_REPLY_GREETING:
+	if (strncmp(line, "OK MPD ", 7) != 0)
+	  {
+	    logmsg(LOG_ERR, "Unexpected MPD greeting: %s", line);
+
+	    mpd_fail();
+	    return;
+	  }
+
+	logdebug("MPD: server version %s\n", line + 7);
+
+	mpd_pop_pending();
+	break;
+
+      case MPD_REPLY_STATUS:
+	if (strncmp(line, "state: ", 7) == 0)
+	  {
+	    mpd.playing = (strcmp(line + 7, "play") == 0);
+	  }
+	else if (strcmp(line, "OK") == 0)
+	  {
+	    mpd_pop_pending();
+
+	    mpd_send((mpd.playing) ? "pause 1" : "play", MPD_REPLY_PLAIN, NULL);
+	  }
+	break;
+
+      case MPD_REPLY_PLAIN:
+	if (strcmp(line, "OK") == 0)
+	  mpd_pop_pending();
+	break;
+    }
+}
+
+static void
+mpd_read(void)
+{
+  char *line;
+  char *eol;
+  int consumed;
+  int ret;
+
+  ret = read(mpd.fd, mpd.in + mpd.inlen, sizeof(mpd.in) - mpd.inlen - 1);
+  if (ret < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EINTR))
+	return;
+
+      logmsg(LOG_WARNING, "Error reading from MPD: %s", strerror(errno));
+
+      mpd_fail();
+      return;
+    }
+  else if (ret == 0)
+    {
+      logdebug("MPD closed the connection\n");
+
+      mpd_fail();
+      return;
+    }
+
+  mpd.inlen += ret;
+  mpd.in[mpd.inlen] = '\0';
+
+  line = mpd.in;
+  while ((eol = strchr(line, '\n')) != NULL)
+    {
+      *eol = '\0';
+
+      mpd_process_line(line);
+
+      /* The connection may have been closed */
+      if (mpd.fd < 0)
+	return;
+
+      line = eol + 1;
+    }
+
+  consumed = line - mpd.in;
+  if ((consumed == 0) && (mpd.inlen == sizeof(mpd.in) - 1))
+    {
+      /* Line too long (status has no such thing); throw it away */
+      mpd.inlen = 0;
+      return;
+    }
+
+  mpd.inlen -= consumed;
+  memmove(mpd.in, line, mpd.inlen);
+}
+
+static void
+mpd_write(void)
+{
+  int ret;
+
+  /* EPIPE rather than SIGPIPE if MPD went away */
+  ret = send(mpd.fd, mpd.out, mpd.outlen, MSG_NOSIGNAL);
+  if (ret < 0)
+    {
+      if ((errno == EAGAIN) || (errno == EINTR))
+	return;
+
+      logmsg(LOG_WARNING, "Error writing to MPD: %s", strerror(errno));
+
+      mpd_fail();
+      return;
+    }
+
+  mpd.outlen -= ret;
+  memmove(mpd.out, mpd.out + ret, mpd.outlen);
+}
+
+static void
+mpd_io(int fd, uint32_t events)
+{
+  socklen_t len;
+  int err;
+
+  if (mpd.state == MPD_CONNECTING)
+    {
+      if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+	return;
+
+      len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+	err = errno;
+
+      if (err != 0)
+	{
+	  logmsg(LOG_ERR, "Could not connect to MPD: %s", strerror(err));
+
+	  mpd_fail();
+	  return;
+	}
+
+      logdebug("MPD connection established\n");
+
+      mpd.state = MPD_CONNECTED;
+    }
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+      mpd_read();
+      if (mpd.fd < 0)
+	return;
+    }
+
+  if ((events & EPOLLOUT) && (mpd.outlen > 0))
+    {
+      mpd_write();
+      if (mpd.fd < 0)
+	return;
+    }
+
+  mpd_update_events();
+}
+
 
 void
 song_playpause(void)
@@ -41,7 +488,11 @@ song_playpause(void)
   if (!song_cfg.enabled)
     return;
 
-  song_exec(song_cfg.playpause_cmd);
+  /* Ask for the player state, the reply decides between play and pause */
+  if (song_cfg.mpd && (mpd_send("status", MPD_REPLY_STATUS, song_cfg.playpause_argv) == 0))
+    return;
+
+  song_exec(song_cfg.playpause_argv);
 }
 
 void
@@ -50,7 +501,10 @@ song_next(void)
   if (!song_cfg.enabled)
     return;
 
-  song_exec(song_cfg.next_cmd);
+  if (song_cfg.mpd && (mpd_send("next", MPD_REPLY_PLAIN, song_cfg.next_argv) == 0))
+    return;
+
+  song_exec(song_cfg.next_argv);
 }
 
 void
@@ -59,70 +513,191 @@ song_prev(void)
   if (!song_cfg.enabled)
     return;
 
-  song_exec(song_cfg.prev_cmd);
+  if (song_cfg.mpd && (mpd_send("previous", MPD_REPLY_PLAIN, song_cfg.prev_argv) == 0))
+    return;
+
+  song_exec(song_cfg.prev_argv);
 }
 
 void
-song_exec(char *cmd)
-{
-    // TODO Allocate as much space as needed instead of just "lots"
-  char *song_argv[30];
-  char *search = " ";
-  char *buf = malloc(sizeof(cmd));
-  int it = 0;
-  long max_fd;
-  int fd;
-  int ret;
+song_exec(char **argv)
+{
+  if (argv == NULL)
+    return;
 
-  strcpy(buf, cmd);
-  if ((song_argv[0] = strtok(buf, search)))
-    {
-      do
-      {
-        it++;
-      } while ((song_argv[it] = strtok(NULL, search)));
-    }
-  else
+  child_spawn(argv, NULL, CHILD_PATH, SONG_CMD_TIMEOUT, NULL, NULL);
+}
+
+
+/* Split a command line into an argv vector, honouring single quotes,
+ * double quotes and backslash escapes. The vector and the strings
+ * live in a single allocation, freed with free().
+ */
+static char **
+song_parse_cmd(char *cmd)
+{
+  char **argv;
+  char *buf;
+  char *p;
+  char quote;
+  int maxargs;
+  int argc;
+  int len;
+
+  len = strlen(cmd);
+
+  /* At most one argument every other character */
+  maxargs = len / 2 + 1;
+  if (maxargs > SONG_ARGV_MAX)
+    maxargs = SONG_ARGV_MAX;
+
+  argv = (char **) malloc((maxargs + 1) * sizeof(char *) + len + 1);
+  if (argv == NULL)
     {
-      free(buf);
-      return;
+      logmsg(LOG_ERR, "Could not allocate memory for command %s", cmd);
+
+      return NULL;
     }
 
-  ret = fork();
-  if (ret == 0) /* exec object */
+  buf = (char *)(argv + maxargs + 1);
+  argc = 0;
+  p = cmd;
+
+  for (;;)
     {
-      max_fd = sysconf(_SC_OPEN_MAX);
+      while ((*p == ' ') || (*p == '\t'))
+	p++;
+
+      if (*p == '\0')
+	break;
+
+      if (argc == maxargs)
+	{
+	  logmsg(LOG_ERR, "Too many arguments in command %s", cmd);
+
+	  goto error_out;
+	}
+
+      argv[argc++] = buf;
+      quote = '\0';
+
+      for (; *p != '\0'; p++)
+	{
+	  if (quote == '\'')
+	    {
+	      if (*p == '\'')
+		quote = '\0';
+	      else
+		*buf++ = *p;
+
+	      continue;
+	    }
+
+	  if ((*p == '\\') && (p[1] != '\0')
+	      && ((quote == '\0') || (p[1] == '"') || (p[1] == '\\')))
+	    {
+	      p++;
+	      *buf++ = *p;
+
+	      continue;
+	    }
 
-      if (max_fd > INT_MAX)
-        max_fd = INT_MAX;
+	  if (quote == '"')
+	    {
+	      if (*p == '"')
+		quote = '\0';
+	      else
+		*buf++ = *p;
 
-      for (fd = 3; fd < max_fd; fd++)
-        close(fd);
+	      continue;
+	    }
 
-      execvp(song_argv[0], song_argv);
+	  if ((*p == ' ') || (*p == '\t'))
+	    break;
 
-      logmsg(LOG_ERR, "Could not execute %s: %s", song_argv[0], strerror(errno));
-      exit(1);
+	  if ((*p == '\'') || (*p == '"'))
+	    quote = *p;
+	  else
+	    *buf++ = *p;
+	}
+
+      if (quote != '\0')
+	{
+	  logmsg(LOG_ERR, "Unterminated quote in command %s", cmd);
+
+	  goto error_out;
+	}
+
+      *buf++ = '\0';
     }
-  else if (ret == -1)
+
+  if (argc == 0)
+    goto error_out;
+
+  argv[argc] = NULL;
+
+  return argv;
+
+ error_out:
+  free(argv);
+  return NULL;
+}
+
+/* Called at config time, where blocking on the resolver is fine */
+static void
+mpd_resolve(void)
+{
+  struct addrinfo hints;
+  char port[8];
+  int ret;
+
+  if (mpd_addrs != NULL)
     {
-      logmsg(LOG_ERR, "Could not fork: %s", strerror(errno));
+      freeaddrinfo(mpd_addrs);
+      mpd_addrs = NULL;
     }
-  else
+
+  if (!song_cfg.mpd || (song_cfg.mpd_host[0] == '/'))
+    return;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+
+  snprintf(port, sizeof(port), "%d", song_cfg.mpd_port);
+
+  ret = getaddrinfo(song_cfg.mpd_host, port, &hints, &mpd_addrs);
+  if (ret != 0)
     {
-      waitpid(ret, &ret, 0);
-      if ((WIFEXITED(ret) == 0) || (WEXITSTATUS(ret) != 0))
-      	{
-      	  logmsg(LOG_INFO, "%s failed", song_argv[0]);
-  	    }
-     }
-  free(buf);
-  return;
+      logmsg(LOG_ERR, "Could not resolve MPD host %s: %s, using the media key commands",
+	     song_cfg.mpd_host, gai_strerror(ret));
+
+      mpd_addrs = NULL;
+    }
+}
+
+void
+song_cleanup(void)
+{
+  mpd_close();
+
+  if (mpd_addrs != NULL)
+    freeaddrinfo(mpd_addrs);
+
+  mpd_addrs = NULL;
 }
 
 void
 song_fix_config(void)
 {
-    /* TODO */
-    return;
+  if ((song_cfg.mpd_port < 1) || (song_cfg.mpd_port > 65535))
+    song_cfg.mpd_port = 6600;
+
+  /* Parse the commands once and for all */
+  song_cfg.playpause_argv = song_parse_cmd(song_cfg.playpause_cmd);
+  song_cfg.next_argv = song_parse_cmd(song_cfg.next_cmd);
+  song_cfg.prev_argv = song_parse_cmd(song_cfg.prev_cmd);
+
+  mpd_resolve();
 }
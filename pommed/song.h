@@ -5,6 +5,16 @@
 #ifndef __SONG_H__
 #define __SONG_H__
 
+/* Kill the media key command if it takes longer than this (ms) */
+#define SONG_CMD_TIMEOUT     5000
+
+/* Max number of arguments in a media key command */
+#define SONG_ARGV_MAX        32
+
+/* MPD client: buffer size for each direction, max commands in flight */
+#define MPD_BUF_SIZE         1024
+#define MPD_PENDING_MAX      16
+
 void
 song_playpause(void);
 
@@ -15,7 +25,10 @@ void
 song_prev(void);
 
 void
-song_exec(char *cmd);
+song_exec(char **argv);
+
+void
+song_cleanup(void);
 
 void
 song_fix_config(void);
@@ -0,0 +1,212 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2009 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <syslog.h>
+
+#include <errno.h>
+
+#include <linux/futex.h>
+
+#include "pommed.h"
+#include "evloop.h"
+#include "lcd_backlight.h"
+#include "kbd_backlight.h"
+#include "ambient.h"
+#include "audio.h"
+#include "state.h"
+
+
+/* The state page is published under STATE_FILE and updated in place
+ * with a seqlock; readers need no syscall beyond the initial mmap(),
+ * unless they want to sleep on the futex until the next update.
+ * Updates are deferred to the end of the loop iteration, so a burst
+ * of changes costs one publication.
+ */
+
+static struct pommed_state *st;
+static int state_fd = -1;
+
+static uint32_t cd_ejects;
+static uint32_t video_switches;
+
+
+static void
+state_write_begin(void)
+{
+  __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+state_write_end(void)
+{
+  st->updates++;
+
+  __atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+
+  /* The page is read-only for the readers, so we can't know whether
+   * anyone is asleep; one wake per publication is cheap enough.
+   */
+  syscall(SYS_futex, &st->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void
+state_publish(void)
+{
+  if (st == NULL)
+    return;
+
+  state_write_begin();
+
+  st->lcd_level = lcd_bck_info.level;
+  st->lcd_max = lcd_bck_info.max;
+  st->kbd_level = kbd_bck_info.level;
+  st->kbd_max = kbd_bck_info.max;
+  st->ambient_left = ambient_info.left;
+  st->ambient_right = ambient_info.right;
+  st->ambient_max = ambient_info.max;
+  st->audio_level = audio_info.level;
+  st->audio_max = audio_info.max;
+  st->audio_muted = audio_info.muted;
+
+  st->cd_ejects = cd_ejects;
+  st->video_switches = video_switches;
+
+  state_write_end();
+}
+
+
+void
+state_update(void)
+{
+  if (st == NULL)
+    return;
+
+  if (evloop_defer(state_publish) < 0)
+    state_publish();
+}
+
+void
+state_event(int event)
+{
+  switch (event)
+    {
+      case STATE_CD_EJECT:
+	cd_ejects++;
+	break;
+
+      case STATE_VIDEO_SWITCH:
+	video_switches++;
+	break;
+
+      default:
+	return;
+    }
+
+  state_update();
+}
+
+
+int
+state_init(void)
+{
+  int ret;
+
+  /* Never truncate a file readers may still have mapped (SIGBUS);
+   * start over with a new one.
+   */
+  unlink(STATE_FILE);
+
+  state_fd = open(STATE_FILE, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (state_fd < 0)
+    {
+      logmsg(LOG_WARNING, "Could not create state file %s: %s", STATE_FILE, strerror(errno));
+
+      return -1;
+    }
+
+  ret = fchmod(state_fd, 0644);
+  if (ret == 0)
+    ret = ftruncate(state_fd, sizeof(struct pommed_state));
+  if (ret < 0)
+    {
+      logmsg(LOG_WARNING, "Could not set up state file: %s", strerror(errno));
+
+      goto out_unlink;
+    }
+
+  st = mmap(NULL, sizeof(struct pommed_state), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+  if (st == MAP_FAILED)
+    {
+      logmsg(LOG_WARNING, "Could not map state file: %s", strerror(errno));
+
+      st = NULL;
+      goto out_unlink;
+    }
+
+  st->magic = STATE_MAGIC;
+  st->version = STATE_VERSION;
+  st->alive = 1;
+  st->pid = getpid();
+
+  state_publish();
+
+  return 0;
+
+ out_unlink:
+  close(state_fd);
+  state_fd = -1;
+
+  unlink(STATE_FILE);
+
+  return -1;
+}
+
+void
+state_cleanup(void)
+{
+  if (st != NULL)
+    {
+      /* Tell the readers, including those asleep, to go away */
+      state_write_begin();
+      st->alive = 0;
+      state_write_end();
+
+      munmap(st, sizeof(struct pommed_state));
+      st = NULL;
+
+      unlink(STATE_FILE);
+    }
+
+  if (state_fd >= 0)
+    close(state_fd);
+
+  state_fd = -1;
+}
@@ -0,0 +1,72 @@
+/*
+ * pommed - state.h
+ */
+
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stdint.h>
+
+
+/* Read-only state page, mmap()ed by clients.
+ *
+ * This header is also used by client-common/state-client.c; keep it
+ * self-contained. The functions below are for pommed only.
+ */
+
+#define STATE_FILE             "/var/run/pommed.state"
+
+#define STATE_MAGIC            0x504d5354 /* PMST */
+#define STATE_VERSION          1
+
+
+struct pommed_state
+{
+  uint32_t magic;
+  uint32_t version;
+
+  /* seqlock: odd while an update is in progress; also the futex word
+   * readers sleep on (shared, not FUTEX_PRIVATE).
+   */
+  uint32_t seq;
+
+  /* 0 once pommed has exited, reopen STATE_FILE */
+  uint32_t alive;
+  uint32_t pid;
+  uint32_t reserved;
+
+  uint32_t lcd_level;
+  uint32_t lcd_max;
+  uint32_t kbd_level;
+  uint32_t kbd_max;
+  uint32_t ambient_left;
+  uint32_t ambient_right;
+  uint32_t ambient_max;
+  uint32_t audio_level;
+  uint32_t audio_max;
+  uint32_t audio_muted;
+
+  /* counters */
+  uint32_t cd_ejects;
+  uint32_t video_switches;
+  uint64_t updates;
+};
+
+
+#define STATE_CD_EJECT         1
+#define STATE_VIDEO_SWITCH     2
+
+void
+state_update(void);
+
+void
+state_event(int event);
+
+int
+state_init(void);
+
+void
+state_cleanup(void);
+
+
+#endif /* !__STATE_H__ */
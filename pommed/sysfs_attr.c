@@ -0,0 +1,177 @@
+/*
+ * pommed - Apple laptops hotkeys handler daemon
+ *
+ * Copyright (C) 2006-2011 Julien BLACHE <jb@jblache.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <syslog.h>
+
+#include <errno.h>
+
+#include "pommed.h"
+#include "sysfs_attr.h"
+
+
+/* Errors meaning the node we have open is gone */
+static int
+sysfs_attr_stale(int err)
+{
+  return ((err == ENODEV) || (err == ENOENT) || (err == ESTALE) || (err == EBADF));
+}
+
+static int
+sysfs_attr_reopen(struct sysfs_attr *attr)
+{
+  if (attr->fd >= 0)
+    close(attr->fd);
+
+  attr->fd = open(attr->path, attr->flags | O_CLOEXEC);
+  if (attr->fd < 0)
+    {
+      if (errno != ENOENT)
+	logmsg(LOG_WARNING, "Could not open %s: %s", attr->path, strerror(errno));
+
+      return -1;
+    }
+
+  return 0;
+}
+
+
+void
+sysfs_attr_init(struct sysfs_attr *attr, char *path, int flags)
+{
+  attr->path = path;
+  attr->flags = flags;
+  attr->fd = -1;
+}
+
+/* Read the attribute into buf, NUL-terminated; returns the length read */
+int
+sysfs_attr_read(struct sysfs_attr *attr, char *buf, int len)
+{
+  int n;
+
+  if ((attr->fd < 0) && (sysfs_attr_reopen(attr) < 0))
+    return -1;
+
+  n = pread(attr->fd, buf, len - 1, 0);
+
+  if ((n < 0) && sysfs_attr_stale(errno))
+    {
+      if (sysfs_attr_reopen(attr) < 0)
+	return -1;
+
+      n = pread(attr->fd, buf, len - 1, 0);
+    }
+
+  if (n < 0)
+    {
+      logmsg(LOG_WARNING, "Could not read %s: %s", attr->path, strerror(errno));
+
+      return -1;
+    }
+
+  buf[n] = '\0';
+
+  return n;
+}
+
+int
+sysfs_attr_read_int(struct sysfs_attr *attr, int *val)
+{
+  char buf[16];
+  int n;
+
+  n = sysfs_attr_read(attr, buf, sizeof(buf));
+  if (n < 1)
+    return -1;
+
+  *val = atoi(buf);
+
+  return 0;
+}
+
+int
+sysfs_attr_write_int(struct sysfs_attr *attr, int val)
+{
+  char buf[16];
+  char *p;
+  unsigned int v;
+  int neg;
+  int len;
+  int n;
+
+  /* Format the value right-aligned in buf, no stdio involved */
+  neg = (val < 0);
+  v = (neg) ? -(unsigned int)val : (unsigned int)val;
+
+  p = buf + sizeof(buf);
+  do
+    {
+      p--;
+      *p = '0' + (v % 10);
+      v /= 10;
+    }
+  while (v > 0);
+
+  if (neg)
+    {
+      p--;
+      *p = '-';
+    }
+
+  len = buf + sizeof(buf) - p;
+
+  if ((attr->fd < 0) && (sysfs_attr_reopen(attr) < 0))
+    return -1;
+
+  n = pwrite(attr->fd, p, len, 0);
+
+  if ((n < 0) && sysfs_attr_stale(errno))
+    {
+      if (sysfs_attr_reopen(attr) < 0)
+	return -1;
+
+      n = pwrite(attr->fd, p, len, 0);
+    }
+
+  if (n != len)
+    {
+      logmsg(LOG_WARNING, "Could not write %s: %s", attr->path, strerror(errno));
+
+      return -1;
+    }
+
+  return 0;
+}
+
+void
+sysfs_attr_close(struct sysfs_attr *attr)
+{
+  if (attr->fd >= 0)
+    close(attr->fd);
+
+  attr->fd = -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * pommed - sysfs_attr.h
+ */
+
+#ifndef __SYSFS_ATTR_H__
+#define __SYSFS_ATTR_H__
+
+
+/* A sysfs attribute kept open for the lifetime of the daemon;
+ * the fd is opened lazily and reopened if the node went away
+ * (hotplug, suspend/resume).
+ *
+ * The path is not copied and must outlive the attribute.
+ */
+struct sysfs_attr
+{
+  char *path;
+  int flags;
+  int fd;
+};
+
+#define SYSFS_ATTR_INIT(p, f)   { .path = (p), .flags = (f), .fd = -1 }
+
+
+void
+sysfs_attr_init(struct sysfs_attr *attr, char *path, int flags);
+
+int
+sysfs_attr_read(struct sysfs_attr *attr, char *buf, int len);
+
+int
+sysfs_attr_read_int(struct sysfs_attr *attr, int *val);
+
+int
+sysfs_attr_write_int(struct sysfs_attr *attr, int val);
+
+void
+sysfs_attr_close(struct sysfs_attr *attr);
+
+
+#endif /* __SYSFS_ATTR_H__ */
@@ -32,6 +32,7 @@
 #include "conffile.h"
 #include "lcd_backlight.h"
 #include "dbus.h"
+#include "sysfs_attr.h"
 
 
 enum {
@@ -113,90 +114,71 @@ static char *max_brightness[] =
 struct _lcd_bck_info lcd_bck_info;
 
 
+/* Attributes of the driver in use, kept open */
+static struct sysfs_attr actual_attr = SYSFS_ATTR_INIT("/dev/null", O_RDONLY);
+static struct sysfs_attr brightness_attr = SYSFS_ATTR_INIT("/dev/null", O_WRONLY);
+
+
 static int
 sysfs_backlight_get(void)
 {
-  int fd;
-  int n;
-  char buffer[8];
+  int val;
 
   if (bck_driver == SYSFS_DRIVER_NONE)
     return 0;
 
-  fd = open(actual_brightness[bck_driver], O_RDONLY);
-  if (fd < 0)
-    {
-      logmsg(LOG_WARNING, "Could not open sysfs actual_brightness node: %s", strerror(errno));
-
-      return 0;
-    }
-
-  memset(buffer, 0, sizeof(buffer));
-  n = read(fd, buffer, sizeof(buffer) - 1);
-  if (n < 1)
-    {
-      logmsg(LOG_WARNING, "Could not read sysfs actual_brightness node");
-
-      close(fd);
-      return 0;
-    }
-  close(fd);
+  if (sysfs_attr_read_int(&actual_attr, &val) < 0)
+    return 0;
 
-  return atoi(buffer);
+  return val;
 }
 
 static int
 sysfs_backlight_get_max(void)
 {
-  int fd;
-  int n;
-  char buffer[8];
+  struct sysfs_attr max_attr;
+  int val;
+  int ret;
 
   if (bck_driver == SYSFS_DRIVER_NONE)
     return 0;
 
-  fd = open(max_brightness[bck_driver], O_RDONLY);
-  if (fd < 0)
-    {
-      logmsg(LOG_WARNING, "Could not open sysfs max_brightness node: %s", strerror(errno));
+  /* Only read once at probe time, no need to keep it open */
+  sysfs_attr_init(&max_attr, max_brightness[bck_driver], O_RDONLY);
 
-      return 0;
-    }
+  ret = sysfs_attr_read_int(&max_attr, &val);
+  sysfs_attr_close(&max_attr);
 
-  memset(buffer, 0, sizeof(buffer));
-  n = read(fd, buffer, sizeof(buffer) - 1);
-  if (n < 1)
-    {
-      logmsg(LOG_WARNING, "Could not read sysfs max_brightness node");
-
-      close(fd);
-      return 0;
-    }
-  close(fd);
+  if (ret < 0)
+    return 0;
 
-  return atoi(buffer);
+  return val;
 }
 
 
 static void
 sysfs_backlight_set(int value)
 {
-  FILE *fp;
-
   if (bck_driver == SYSFS_DRIVER_NONE)
     return;
 
-  fp = fopen(brightness[bck_driver], "a");
-  if (fp == NULL)
-    {
-      logmsg(LOG_WARNING, "Could not open sysfs brightness node: %s", strerror(errno));
+  sysfs_attr_write_int(&brightness_attr, value);
+}
 
-      return;
-    }
+int
+sysfs_backlight_write(int val)
+{
+  if (bck_driver == SYSFS_DRIVER_NONE)
+    return -1;
 
-  fprintf(fp, "%d", value);
+  if (val < SYSFS_BACKLIGHT_OFF)
+    val = SYSFS_BACKLIGHT_OFF;
+  else if (val > lcd_bck_info.max)
+    val = lcd_bck_info.max;
 
-  fclose(fp);
+  sysfs_backlight_set(val);
+
+  return val;
 }
 
 void
@@ -210,23 +192,23 @@ sysfs_backlight_step(int dir)
 
   val = sysfs_backlight_get();
 
-  if (dir == STEP_UP)
+  if (dir > 0)
     {
-      newval = val + lcd_sysfs_cfg.step;
+      newval = val + dir * lcd_sysfs_cfg.step;
 
       if (newval > lcd_bck_info.max)
 	newval = lcd_bck_info.max;
 
-      logdebug("LCD stepping +%d -> %d\n", lcd_sysfs_cfg.step, newval);
+      logdebug("LCD stepping +%d -> %d\n", dir * lcd_sysfs_cfg.step, newval);
     }
-  else if (dir == STEP_DOWN)
+  else if (dir < 0)
     {
-      newval = val - lcd_sysfs_cfg.step;
+      newval = val + dir * lcd_sysfs_cfg.step;
 
       if (newval < SYSFS_BACKLIGHT_OFF)
 	newval = SYSFS_BACKLIGHT_OFF;
 
-      logdebug("LCD stepping -%d -> %d\n", lcd_sysfs_cfg.step, newval);
+      logdebug("LCD stepping -%d -> %d\n", -dir * lcd_sysfs_cfg.step, newval);
     }
   else
     return;
@@ -367,6 +349,12 @@ sysfs_backlight_probe(int driver)
 
   bck_driver = driver;
 
+  sysfs_attr_close(&actual_attr);
+  sysfs_attr_close(&brightness_attr);
+
+  sysfs_attr_init(&actual_attr, actual_brightness[driver], O_RDONLY);
+  sysfs_attr_init(&brightness_attr, brightness[driver], O_WRONLY);
+
   lcd_bck_info.max = sysfs_backlight_get_max();
 
   /* Now we can fix the config */
@@ -441,6 +429,7 @@ mbp_sysfs_backlight_probe(void)
 	    /* Wire up fallback native driver */
 	    mops->lcd_backlight_step = nv8600mgt_backlight_step;
 	    mops->lcd_backlight_toggle = nv8600mgt_backlight_toggle;
+	    mops->lcd_backlight_write = nv8600mgt_backlight_write;
 	  }
 	return ret;
 
@@ -106,270 +106,142 @@ DBusConnection *conn;
 void
 wmmbp_get_values(void);
 
-int
-wmmbp_dbus_init(void)
-{
-  unsigned int signals;
-
-  signals = MBP_DBUS_SIG_LCD | MBP_DBUS_SIG_KBD
-            | MBP_DBUS_SIG_VOL | MBP_DBUS_SIG_MUTE
-            | MBP_DBUS_SIG_LIGHT | MBP_DBUS_SIG_VIDEO;
-
-  conn = mbp_dbus_init(&dbus_err, signals);
-
-  if (conn == NULL)
-    {
-      mbpdisplay = DISPLAY_FLAG_UPDATE | DISPLAY_TYPE_DBUS_NOK;
-
-      return -1;
-    }
-  else
-    wmmbp_get_values();
-
-  return 0;
-}
-
 /* Forward */
 void
 wmmbp_video_getvtstate_cb(DBusPendingCall *pending, void *status);
 
-void
-mbp_dbus_listen(void)
-{
-  DBusMessage *msg;
-
-  int scratch;
+static int dbus_lost;
 
-  if (conn == NULL)
-    return;
-
-  while (1)
-    {
-      dbus_connection_read_write(conn, 0);
-
-      msg = dbus_connection_pop_message(conn);
-
-      if (msg == NULL)
-	return;
-
-      if (dbus_message_is_signal(msg, "org.pommed.signal.ambientLight", "ambientLight"))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_UINT32, &mbp.ambient_l,
-				DBUS_TYPE_UINT32, &scratch, /* previous left */
-				DBUS_TYPE_UINT32, &mbp.ambient_r,
-				DBUS_TYPE_UINT32, &scratch, /* previous right */
-				DBUS_TYPE_UINT32, &mbp.ambient_max,
-				DBUS_TYPE_INVALID);
-
-	  if (mbpdisplay & DISPLAY_TYPE_AMBIENT)
-	    mbpdisplay |= DISPLAY_FLAG_UPDATE;
-	}
-      else if (dbus_message_is_signal(msg, "org.pommed.signal.lcdBacklight", "lcdBacklight"))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_UINT32, &mbp.lcd_lvl,
-				DBUS_TYPE_UINT32, &scratch, /* previous */
-				DBUS_TYPE_UINT32, &mbp.lcd_max,
-				DBUS_TYPE_UINT32, &scratch, /* who */
-				DBUS_TYPE_INVALID);
-
-	  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
-	    mbpdisplay |= DISPLAY_FLAG_UPDATE;
-	}
-      else if (dbus_message_is_signal(msg, "org.pommed.signal.kbdBacklight", "kbdBacklight"))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_UINT32, &mbp.kbd_lvl,
-				DBUS_TYPE_UINT32, &scratch, /* previous */
-				DBUS_TYPE_UINT32, &mbp.kbd_max,
-				DBUS_TYPE_UINT32, &scratch, /* who */
-				DBUS_TYPE_INVALID);
-
-	  if (mbpdisplay & (DISPLAY_TYPE_MACBOOK | DISPLAY_TYPE_AMBIENT))
-	    mbpdisplay |= DISPLAY_FLAG_UPDATE;
-	}
-      else if (dbus_message_is_signal(msg, "org.pommed.signal.audioVolume", "audioVolume"))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_UINT32, &mbp.snd_lvl,
-				DBUS_TYPE_UINT32, &scratch, /* previous */
-				DBUS_TYPE_UINT32, &mbp.snd_max,
-				DBUS_TYPE_INVALID);
-
-	  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
-	    mbpdisplay |= DISPLAY_FLAG_UPDATE;
-	}
-      else if (dbus_message_is_signal(msg, "org.pommed.signal.audioMute", "audioMute"))
-	{
-	  dbus_message_get_args(msg, &dbus_err,
-				DBUS_TYPE_BOOLEAN, &mbp.snd_mute,
-				DBUS_TYPE_INVALID);
-
-	  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
-	    mbpdisplay |= DISPLAY_FLAG_UPDATE;
-	}
-      else if (dbus_message_is_signal(msg, "org.pommed.signal.videoSwitch", "videoSwitch"))
-	{
-	  int vtnum;
-	  int vtstate;
-	  int ret;
-
-	  vtnum = mbp_get_x_vtnum(display);
-
-	  ret = mbp_call_video_getvtstate(vtnum, wmmbp_video_getvtstate_cb, &vtstate);
-	  if ((ret < 0) || (vtstate < 0))
-	    fprintf(stderr, "video getVTState call failed !\n");
-	  else if (vtstate == 1)
-	    mbp_video_switch();
-	}
-      else if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected"))
-	{
-	  fprintf(stderr, "DBus disconnected\n");
-
-	  mbpdisplay = DISPLAY_FLAG_UPDATE | DISPLAY_TYPE_DBUS_NOK;
-
-	  mbp_dbus_cleanup();
-	  conn = NULL;
-
-	  dbus_message_unref(msg);
-
-	  break;
-	}
+static void
+wmmbp_ambient_light(int l, int l_prev, int r, int r_prev, int max, void *userdata)
+{
+  mbp.ambient_l = l;
+  mbp.ambient_r = r;
+  mbp.ambient_max = max;
 
-      dbus_message_unref(msg);
-    }
+  if (mbpdisplay & DISPLAY_TYPE_AMBIENT)
+    mbpdisplay |= DISPLAY_FLAG_UPDATE;
 }
 
-
-/* DBus method call callbacks */
-void
-wmmbp_lcd_getlevel_cb(DBusPendingCall *pending, void *status)
+static void
+wmmbp_lcd_backlight(int cur, int prev, int max, int who, void *userdata)
 {
-  DBusMessage *msg;
+  mbp.lcd_lvl = cur;
+  mbp.lcd_max = max;
 
-  msg = dbus_pending_call_steal_reply(pending);
-
-  if (msg == NULL)
-    {
-      fprintf(stderr, "Could not steal reply\n");
-
-      dbus_pending_call_unref(pending);
-
-      return;
-    }
-
-  dbus_pending_call_unref(pending);
+  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
+    mbpdisplay |= DISPLAY_FLAG_UPDATE;
+}
 
-  if (!mbp_dbus_check_error(msg))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &mbp.lcd_lvl,
-			    DBUS_TYPE_UINT32, &mbp.lcd_max,
-			    DBUS_TYPE_INVALID);
-    }
-  else
-    *(int *)status = -1;
+static void
+wmmbp_kbd_backlight(int cur, int prev, int max, int who, void *userdata)
+{
+  mbp.kbd_lvl = cur;
+  mbp.kbd_max = max;
 
-  dbus_message_unref(msg);
+  if (mbpdisplay & (DISPLAY_TYPE_MACBOOK | DISPLAY_TYPE_AMBIENT))
+    mbpdisplay |= DISPLAY_FLAG_UPDATE;
 }
 
-void
-wmmbp_kbd_getlevel_cb(DBusPendingCall *pending, void *status)
+static void
+wmmbp_audio_volume(int cur, int prev, int max, void *userdata)
 {
-  DBusMessage *msg;
-
-  msg = dbus_pending_call_steal_reply(pending);
+  mbp.snd_lvl = cur;
+  mbp.snd_max = max;
 
-  if (msg == NULL)
-    {
-      fprintf(stderr, "Could not steal reply\n");
+  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
+    mbpdisplay |= DISPLAY_FLAG_UPDATE;
+}
 
-      dbus_pending_call_unref(pending);
+static void
+wmmbp_audio_mute(int mute, void *userdata)
+{
+  mbp.snd_mute = mute;
 
-      return;
-    }
+  if (mbpdisplay & DISPLAY_TYPE_MACBOOK)
+    mbpdisplay |= DISPLAY_FLAG_UPDATE;
+}
 
-  dbus_pending_call_unref(pending);
+static void
+wmmbp_video_switch(void *userdata)
+{
+  int vtnum;
+  int vtstate;
+  int ret;
 
-  if (!mbp_dbus_check_error(msg))
-    {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &mbp.kbd_lvl,
-			    DBUS_TYPE_UINT32, &mbp.kbd_max,
-			    DBUS_TYPE_INVALID);
-    }
-  else
-    *(int *)status = -1;
+  vtnum = mbp_get_x_vtnum(display);
 
-  dbus_message_unref(msg);
+  ret = mbp_call_video_getvtstate(vtnum, wmmbp_video_getvtstate_cb, &vtstate);
+  if ((ret < 0) || (vtstate < 0))
+    fprintf(stderr, "video getVTState call failed !\n");
+  else if (vtstate == 1)
+    mbp_video_switch();
 }
 
-void
-wmmbp_ambient_getlevel_cb(DBusPendingCall *pending, void *status)
+static void
+wmmbp_dbus_disconnected(void *userdata)
 {
-  DBusMessage *msg;
-
-  msg = dbus_pending_call_steal_reply(pending);
+  fprintf(stderr, "DBus disconnected\n");
 
-  if (msg == NULL)
-    {
-      fprintf(stderr, "Could not steal reply\n");
+  /* Cleaned up once out of the dispatch loop */
+  dbus_lost = 1;
+}
 
-      dbus_pending_call_unref(pending);
+static const struct mbp_dbus_handlers wmmbp_dbus_handlers =
+  {
+    .ambient_light = wmmbp_ambient_light,
+    .lcd_backlight = wmmbp_lcd_backlight,
+    .kbd_backlight = wmmbp_kbd_backlight,
+    .audio_volume = wmmbp_audio_volume,
+    .audio_mute = wmmbp_audio_mute,
+    .video_switch = wmmbp_video_switch,
+    .disconnected = wmmbp_dbus_disconnected,
+  };
 
-      return;
-    }
+int
+wmmbp_dbus_init(void)
+{
+  dbus_lost = 0;
 
-  dbus_pending_call_unref(pending);
+  conn = mbp_dbus_init(&dbus_err, &wmmbp_dbus_handlers, NULL);
 
-  if (!mbp_dbus_check_error(msg))
+  if (conn == NULL)
     {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &mbp.ambient_l,
-			    DBUS_TYPE_UINT32, &mbp.ambient_r,
-			    DBUS_TYPE_UINT32, &mbp.ambient_max,
-			    DBUS_TYPE_INVALID);
+      mbpdisplay = DISPLAY_FLAG_UPDATE | DISPLAY_TYPE_DBUS_NOK;
+
+      return -1;
     }
   else
-    *(int *)status = -1;
+    wmmbp_get_values();
 
-  dbus_message_unref(msg);
+  return 0;
 }
 
+/* Signals go to the handlers above, through the dbus-client filter */
 void
-wmmbp_audio_getvolume_cb(DBusPendingCall *pending, void *status)
+mbp_dbus_listen(void)
 {
-  DBusMessage *msg;
-
-  msg = dbus_pending_call_steal_reply(pending);
-
-  if (msg == NULL)
-    {
-      fprintf(stderr, "Could not steal reply\n");
-
-      dbus_pending_call_unref(pending);
+  if (conn == NULL)
+    return;
 
-      return;
-    }
+  dbus_connection_read_write(conn, 0);
 
-  dbus_pending_call_unref(pending);
+  while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
 
-  if (!mbp_dbus_check_error(msg))
+  if (dbus_lost)
     {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_UINT32, &mbp.snd_lvl,
-			    DBUS_TYPE_UINT32, &mbp.snd_max,
-			    DBUS_TYPE_INVALID);
-    }
-  else
-    *(int *)status = -1;
+      mbpdisplay = DISPLAY_FLAG_UPDATE | DISPLAY_TYPE_DBUS_NOK;
 
-  dbus_message_unref(msg);
+      mbp_dbus_cleanup();
+      conn = NULL;
+    }
 }
 
+
+/* DBus method call callbacks */
 void
-wmmbp_audio_getmute_cb(DBusPendingCall *pending, void *status)
+wmmbp_get_state_cb(DBusPendingCall *pending, void *status)
 {
   DBusMessage *msg;
 
@@ -381,19 +253,33 @@ wmmbp_audio_getmute_cb(DBusPendingCall *pending, void *status)
 
       dbus_pending_call_unref(pending);
 
+      *(int *)status = -1;
       return;
     }
 
   dbus_pending_call_unref(pending);
 
-  if (!mbp_dbus_check_error(msg))
+  if (!mbp_dbus_check_error(msg)
+      && dbus_message_get_args(msg, &dbus_err,
+			       DBUS_TYPE_UINT32, &mbp.lcd_lvl,
+			       DBUS_TYPE_UINT32, &mbp.lcd_max,
+			       DBUS_TYPE_UINT32, &mbp.kbd_lvl,
+			       DBUS_TYPE_UINT32, &mbp.kbd_max,
+			       DBUS_TYPE_UINT32, &mbp.ambient_l,
+			       DBUS_TYPE_UINT32, &mbp.ambient_r,
+			       DBUS_TYPE_UINT32, &mbp.ambient_max,
+			       DBUS_TYPE_UINT32, &mbp.snd_lvl,
+			       DBUS_TYPE_UINT32, &mbp.snd_max,
+			       DBUS_TYPE_BOOLEAN, &mbp.snd_mute,
+			       DBUS_TYPE_INVALID))
+    *(int *)status = 0;
+  else
     {
-      dbus_message_get_args(msg, &dbus_err,
-			    DBUS_TYPE_BOOLEAN, &mbp.snd_mute,
-			    DBUS_TYPE_INVALID);
+      if (dbus_error_is_set(&dbus_err))
+	dbus_error_free(&dbus_err);
+
+      *(int *)status = -1;
     }
-  else
-    *(int *)status = -1;
 
   dbus_message_unref(msg);
 }
@@ -435,38 +321,12 @@ wmmbp_get_values(void)
   int ret;
   int cbret;
 
-  ret = mbp_call_lcd_getlevel(wmmbp_lcd_getlevel_cb, &cbret);
-  if ((ret < 0) || (cbret < 0))
-    {
-      fprintf(stderr, "lcdBacklight getLevel call failed !\n");
-      goto mcall_error;
-    }
-
-  ret = mbp_call_kbd_getlevel(wmmbp_kbd_getlevel_cb, &cbret);
-  if ((ret < 0) || (cbret < 0))
-    {
-      fprintf(stderr, "kbdBacklight getLevel call failed !\n");
-      goto mcall_error;
-    }
-
-  ret = mbp_call_ambient_getlevel(wmmbp_ambient_getlevel_cb, &cbret);
-  if ((ret < 0) || (cbret < 0))
-    {
-      fprintf(stderr, "ambient getLevel call failed !\n");
-      goto mcall_error;
-    }
-
-  ret = mbp_call_audio_getvolume(wmmbp_audio_getvolume_cb, &cbret);
-  if ((ret < 0) || (cbret < 0))
-    {
-      fprintf(stderr, "audio getVolume call failed !\n");
-      goto mcall_error;
-    }
+  cbret = -1;
 
-  ret = mbp_call_audio_getmute(wmmbp_audio_getmute_cb, &cbret);
+  ret = mbp_call_get_state(wmmbp_get_state_cb, &cbret);
   if ((ret < 0) || (cbret < 0))
     {
-      fprintf(stderr, "audio getMute call failed !\n");
+      fprintf(stderr, "getState call failed !\n");
       goto mcall_error;
     }
 